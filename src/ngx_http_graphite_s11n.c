@@ -0,0 +1,283 @@
+
+/**
+ * (c) BSD-2-Cause, link: https://opensource.org/licenses/BSD-2-Clause
+ * (c) V. Soshnikov, mailto: dedok.mad@gmail.com
+ */
+
+#include "ngx_http_stat_module.h"
+
+
+/*
+ * pickle protocol 2 opcodes, only what carbon's safe unpickler needs
+ * to load [(path, (timestamp, value)), ...]
+ */
+#define PICKLE_PROTO        0x80
+#define PICKLE_EMPTY_LIST   ']'
+#define PICKLE_MARK         '('
+#define PICKLE_APPENDS      'e'
+#define PICKLE_BINUNICODE   'X'
+#define PICKLE_BININT       'J'
+#define PICKLE_BINFLOAT     'G'
+#define PICKLE_TUPLE2       0x86
+#define PICKLE_STOP         '.'
+
+/* X len path J ts G value TUPLE2 TUPLE2 */
+#define PICKLE_SERIES_LEN(path_len) \
+    (1 + 4 + (path_len) + 1 + 4 + 1 + 8 + 1 + 1)
+
+/* frame length, PROTO 2, EMPTY_LIST, MARK ... APPENDS, STOP */
+#define PICKLE_FRAME_LEN (4 + 2 + 1 + 1 + 1 + 1)
+
+
+static u_char *ngx_http_graphite_path(ngx_http_stat_sink_t *sink,
+        ngx_http_stat_series_t *series, u_char *buffer, u_char *last);
+static u_char *ngx_http_graphite_pickle_frame(ngx_http_stat_sink_t *sink,
+        u_char *start, u_char *last, ngx_log_t *log);
+
+
+/** Serializer part {{{
+ */
+static u_char *
+ngx_http_graphite_path(ngx_http_stat_sink_t *sink,
+        ngx_http_stat_series_t *series, u_char *buffer, u_char *last)
+{
+    u_char                      p[4];
+    ngx_str_t                   percentile, *split, *interval;
+    ngx_http_stat_main_conf_t  *smcf;
+
+    smcf = sink->smcf;
+
+    if (series->percentile) {
+        percentile.data = p;
+        percentile.len = ngx_snprintf(p, sizeof(p), "p%ui",
+                series->percentile) - p;
+
+        interval = &percentile;
+
+    } else {
+        interval = &series->interval;
+    }
+
+    if (series->split == SPLIT_INTERNAL) {
+
+        if (series->percentile) {
+            return ngx_snprintf(buffer, last - buffer, "%V.%V_%V",
+                    &smcf->host, &series->param, interval);
+        }
+
+        return ngx_snprintf(buffer, last - buffer, "%V.%V",
+                &smcf->host, &series->param);
+    }
+
+    split = &((ngx_str_t *) smcf->splits->elts)[series->split];
+
+    if (sink->template->nelts == 0) {
+        return ngx_snprintf(buffer, last - buffer, "%V.%V.%V_%V",
+                &smcf->host, split, &series->param, interval);
+    }
+
+    ngx_str_t *variables[] = TEMPLATE_VARIABLES(
+            &smcf->host, split, &series->param, interval);
+
+    return ngx_http_stat_template_execute(buffer, last - buffer,
+            sink->template, variables);
+}
+
+
+/** Plaintext protocol, one "<path> <value> <timestamp>" line per series.
+ */
+u_char *
+ngx_http_graphite_serialize(ngx_http_stat_sink_t *sink,
+        ngx_http_stat_series_t *series, time_t ts, u_char *buffer,
+        u_char *last)
+{
+    u_char *b;
+
+    b = ngx_http_graphite_path(sink, series, buffer, last);
+
+    return ngx_snprintf(b, last - b, " %.3f %T\n", series->value, ts);
+}
+
+
+/** Pickle protocol, the series are encoded as (path, (timestamp, value))
+ *  tuples here and framed into lists by ngx_http_graphite_pickle_flush.
+ */
+u_char *
+ngx_http_graphite_pickle_serialize(ngx_http_stat_sink_t *sink,
+        ngx_http_stat_series_t *series, time_t ts, u_char *buffer,
+        u_char *last)
+{
+    u_char      *b, *path;
+    size_t       len;
+    uint32_t     n;
+    uint64_t     bits;
+    ngx_uint_t   i;
+
+    if (last - buffer < PICKLE_SERIES_LEN(0)) {
+        return last;
+    }
+
+    path = buffer + 1 + 4;
+
+    b = ngx_http_graphite_path(sink, series, path,
+            last - (PICKLE_SERIES_LEN(0) - 1 - 4));
+
+    len = b - path;
+
+    if (b == last - (PICKLE_SERIES_LEN(0) - 1 - 4)) {
+        return last;
+    }
+
+    buffer[0] = PICKLE_BINUNICODE;
+
+    for (i = 0; i < 4; i++) {
+        buffer[1 + i] = (u_char) (len >> (8 * i));
+    }
+
+    /* BININT is little endian */
+
+    *b++ = PICKLE_BININT;
+
+    n = (uint32_t) ts;
+
+    for (i = 0; i < 4; i++) {
+        *b++ = (u_char) (n >> (8 * i));
+    }
+
+    /* BINFLOAT is big endian */
+
+    *b++ = PICKLE_BINFLOAT;
+
+    ngx_memcpy(&bits, &series->value, sizeof(double));
+
+    for (i = 0; i < 8; i++) {
+        *b++ = (u_char) (bits >> (8 * (7 - i)));
+    }
+
+    *b++ = PICKLE_TUPLE2;
+    *b++ = PICKLE_TUPLE2;
+
+    return b;
+}
+/** }}} */
+
+/** Pickle transport {{{
+ */
+ngx_int_t
+ngx_http_graphite_pickle_init(ngx_http_stat_sink_t *sink, ngx_cycle_t *cycle)
+{
+    ngx_http_stat_stream_t *stream;
+
+    if (ngx_http_stat_tcp_init(sink, cycle) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    stream = &sink->stream;
+
+    /* every queued buffer is one frame of at most "batch" bytes */
+
+    stream->buf_size = sink->batch_size + PICKLE_FRAME_LEN;
+    stream->max_bufs = sink->queue_size / stream->buf_size;
+
+    sink->chunk_size = sink->batch_size;
+
+    if (stream->max_bufs == 0) {
+        stream->max_bufs = 1;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_graphite_pickle_flush(ngx_http_stat_sink_t *sink, u_char *start,
+        u_char *last, ngx_log_t *log)
+{
+    while (start < last) {
+
+        start = ngx_http_graphite_pickle_frame(sink, start, last, log);
+
+        if (start == NULL) {
+            break;
+        }
+    }
+
+    return ngx_http_stat_tcp_flush(sink, NULL, NULL, log);
+}
+
+
+/** Moves as many series as fit into "batch" bytes to a new frame.
+ *  Returns the first series left or NULL if the queue is full.
+ */
+static u_char *
+ngx_http_graphite_pickle_frame(ngx_http_stat_sink_t *sink, u_char *start,
+        u_char *last, ngx_log_t *log)
+{
+    u_char      *p, *frame;
+    size_t       len, size;
+    ngx_buf_t   *b;
+    ngx_uint_t   i;
+
+    p = start;
+    len = 0;
+    size = 0;
+
+    while (p < last) {
+
+        len = PICKLE_SERIES_LEN((size_t) p[1] | (size_t) p[2] << 8
+                | (size_t) p[3] << 16 | (size_t) p[4] << 24);
+
+        if (size + len > sink->batch_size) {
+            break;
+        }
+
+        size += len;
+        p += len;
+    }
+
+    if (p == start) {
+
+        /* a single series larger than the batch */
+
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                "ngx_http_graphite_pickle_flush: batch size too small, "
+                "need send %z to \"%V\"", len, &sink->server.name);
+
+        return start + len;
+    }
+
+    b = ngx_http_stat_tcp_append(sink);
+
+    if (b == NULL) {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                "ngx_http_graphite_pickle_flush: queue to \"%V\" is full, "
+                "%z bytes dropped", &sink->server.name,
+                (size_t) (last - start));
+        return NULL;
+    }
+
+    frame = b->last;
+
+    b->last += 4;
+
+    *b->last++ = PICKLE_PROTO;
+    *b->last++ = 2;
+    *b->last++ = PICKLE_EMPTY_LIST;
+    *b->last++ = PICKLE_MARK;
+
+    b->last = ngx_cpymem(b->last, start, size);
+
+    *b->last++ = PICKLE_APPENDS;
+    *b->last++ = PICKLE_STOP;
+
+    /* the length prefix is big endian */
+
+    len = b->last - frame - 4;
+
+    for (i = 0; i < 4; i++) {
+        frame[i] = (u_char) (len >> (8 * (3 - i)));
+    }
+
+    return p;
+}
+/** }}} */
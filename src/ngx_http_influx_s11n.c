@@ -0,0 +1,145 @@
+
+/**
+ * (c) BSD-2-Cause, link: https://opensource.org/licenses/BSD-2-Clause
+ * (c) V. Soshnikov, mailto: dedok.mad@gmail.com
+ */
+
+#include "ngx_http_stat_module.h"
+
+
+static u_char *ngx_http_influx_serialize_fields(ngx_http_stat_sink_t *sink,
+        ngx_http_stat_series_t *series, time_t ts, u_char *buffer,
+        u_char *last);
+
+
+/** Serializer part {{{
+ */
+u_char *
+ngx_http_influx_serialize(ngx_http_stat_sink_t *sink,
+        ngx_http_stat_series_t *series, time_t ts, u_char *buffer,
+        u_char *last)
+{
+    char                       *name;
+    u_char                      p[4], *b;
+    ngx_str_t                   percentile, *split, *interval;
+    ngx_http_stat_main_conf_t  *smcf;
+
+    if (sink->fields == FIELDS_MULTI) {
+        return ngx_http_influx_serialize_fields(sink, series, ts, buffer,
+                last);
+    }
+
+    smcf = sink->smcf;
+
+    b = buffer;
+
+    if (series->percentile) {
+        percentile.data = p;
+        percentile.len = ngx_snprintf(p, sizeof(p), "p%ui",
+                series->percentile) - p;
+
+        name = "percentile";
+        interval = &percentile;
+
+    } else {
+        name = "interval";
+        interval = &series->interval;
+    }
+
+    if (series->split != SPLIT_INTERNAL) {
+
+        split = &((ngx_str_t *) smcf->splits->elts)[series->split];
+
+        if (sink->template->nelts == 0) {
+
+            b = ngx_snprintf(b, last - b,
+                    "%V,location=%V,parameter=%V,%s=%V",
+                    &smcf->host, split, &series->param, name, interval);
+
+        } else {
+
+            ngx_str_t *variables[] = TEMPLATE_VARIABLES(
+                    &smcf->host, split, &series->param, interval);
+
+            b = ngx_http_stat_template_execute(b, last - b,
+                    sink->template, variables);
+        }
+
+    } else if (series->percentile) {
+
+        b = ngx_snprintf(b, last - b, "%V,parameter=%V,percentile=%V",
+                &smcf->host, &series->param, &percentile);
+
+    } else {
+
+        b = ngx_snprintf(b, last - b, "%V,parameter=%V",
+                &smcf->host, &series->param);
+    }
+
+    b = ngx_snprintf(b, last - b, " value=%.3f %T\n", series->value, ts);
+
+    return b;
+}
+
+
+/** One line per split and interval (or percentile) with a field per param,
+ *  "<host>,location=<split>,interval=<interval> <param>=<value>,... <ts>".
+ *  The snapshot is ordered so the series of a line are adjacent, a series
+ *  of the same line as the previously serialized one replaces its " <ts>"
+ *  tail with one more field.
+ */
+static u_char *
+ngx_http_influx_serialize_fields(ngx_http_stat_sink_t *sink,
+        ngx_http_stat_series_t *series, time_t ts, u_char *buffer,
+        u_char *last)
+{
+    u_char                      p[4], tail[NGX_TIME_T_LEN + 2], *b;
+    size_t                      len;
+    ngx_str_t                   percentile, *split;
+    ngx_http_stat_series_t     *prev;
+    ngx_http_stat_main_conf_t  *smcf;
+
+    smcf = sink->smcf;
+
+    b = buffer;
+    prev = sink->prev;
+
+    if (prev && prev->split == series->split
+            && prev->window == series->window
+            && prev->percentile == series->percentile)
+    {
+        len = ngx_snprintf(tail, sizeof(tail), " %T\n", ts) - tail;
+
+        b = ngx_snprintf(b - len, last - b + len, ",%V=%.3f %T\n",
+                &series->param, series->value, ts);
+
+        if (b == last) {
+            /* the series goes to the next chunk, the line is restored */
+            ngx_memcpy(buffer - len, tail, len);
+        }
+
+        return b;
+    }
+
+    b = ngx_snprintf(b, last - b, "%V", &smcf->host);
+
+    if (series->split != SPLIT_INTERNAL) {
+        split = &((ngx_str_t *) smcf->splits->elts)[series->split];
+        b = ngx_snprintf(b, last - b, ",location=%V", split);
+    }
+
+    if (series->percentile) {
+        percentile.data = p;
+        percentile.len = ngx_snprintf(p, sizeof(p), "p%ui",
+                series->percentile) - p;
+
+        b = ngx_snprintf(b, last - b, ",percentile=%V", &percentile);
+
+    } else if (series->split != SPLIT_INTERNAL) {
+        b = ngx_snprintf(b, last - b, ",interval=%V", &series->interval);
+    }
+
+    return ngx_snprintf(b, last - b, " %V=%.3f %T\n", &series->param,
+            series->value, ts);
+}
+/** }}} */
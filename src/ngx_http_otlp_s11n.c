@@ -0,0 +1,639 @@
+
+/**
+ * (c) BSD-2-Cause, link: https://opensource.org/licenses/BSD-2-Clause
+ * (c) V. Soshnikov, mailto: dedok.mad@gmail.com
+ */
+
+#include "ngx_http_stat_module.h"
+
+
+/* protobuf wire types */
+#define PB_VARINT   0
+#define PB_FIXED64  1
+#define PB_LEN      2
+
+#define PB_VARINT_MAX_LEN  10
+
+/* field numbers of opentelemetry/proto/metrics/v1/metrics.proto */
+#define OTLP_REQUEST_RESOURCE_METRICS   1
+#define OTLP_RESOURCE_METRICS_RESOURCE  1
+#define OTLP_RESOURCE_METRICS_SCOPE     2
+#define OTLP_RESOURCE_ATTRIBUTES        1
+#define OTLP_SCOPE_METRICS_SCOPE        1
+#define OTLP_SCOPE_METRICS_METRICS      2
+#define OTLP_SCOPE_NAME                 1
+#define OTLP_METRIC_NAME                1
+#define OTLP_METRIC_GAUGE               5
+#define OTLP_METRIC_SUM                 7
+#define OTLP_METRIC_HISTOGRAM           9
+#define OTLP_DATA_POINTS                1
+#define OTLP_TEMPORALITY                2
+#define OTLP_SUM_IS_MONOTONIC           3
+#define OTLP_NUMBER_START_TIME          2
+#define OTLP_NUMBER_TIME                3
+#define OTLP_NUMBER_AS_DOUBLE           4
+#define OTLP_NUMBER_ATTRIBUTES          7
+#define OTLP_HISTOGRAM_START_TIME       2
+#define OTLP_HISTOGRAM_TIME             3
+#define OTLP_HISTOGRAM_COUNT            4
+#define OTLP_HISTOGRAM_BUCKET_COUNTS    6
+#define OTLP_HISTOGRAM_EXPLICIT_BOUNDS  7
+#define OTLP_HISTOGRAM_ATTRIBUTES       9
+#define OTLP_HISTOGRAM_MIN              11
+#define OTLP_HISTOGRAM_MAX              12
+#define OTLP_KEY_VALUE_KEY              1
+#define OTLP_KEY_VALUE_VALUE            2
+#define OTLP_ANY_VALUE_STRING           1
+
+#define OTLP_TEMPORALITY_DELTA          1
+
+#define OTLP_SCOPE "nginx-stat-module"
+
+/* request and resource metrics headers, the resource and the scope */
+#define OTLP_PREFIX_LEN(resource, scope) \
+    (2 * (1 + PB_VARINT_MAX_LEN) + (resource) + (scope))
+
+
+typedef struct {
+    ngx_str_t   resource;
+    ngx_str_t   scope;
+    ngx_str_t   prefix;
+} ngx_http_otlp_ctx_t;
+
+
+static size_t ngx_http_otlp_varint_len(uint64_t v);
+static u_char *ngx_http_otlp_varint(u_char *b, u_char *last, uint64_t v);
+static u_char *ngx_http_otlp_tag(u_char *b, u_char *last, ngx_uint_t field,
+        ngx_uint_t type);
+static u_char *ngx_http_otlp_fixed64(u_char *b, u_char *last, uint64_t v);
+static u_char *ngx_http_otlp_double(u_char *b, u_char *last, double v);
+static u_char *ngx_http_otlp_string(u_char *b, u_char *last,
+        ngx_uint_t field, ngx_str_t *value);
+static u_char *ngx_http_otlp_open(u_char *b, u_char *last, ngx_uint_t field);
+static u_char *ngx_http_otlp_close(u_char *start, u_char *b, u_char *last);
+static u_char *ngx_http_otlp_attribute(u_char *b, u_char *last,
+        ngx_uint_t field, char *key, ngx_str_t *value);
+static u_char *ngx_http_otlp_attributes(ngx_http_stat_sink_t *sink,
+        ngx_http_stat_series_t *series, ngx_uint_t field, u_char *b,
+        u_char *last);
+static u_char *ngx_http_otlp_number(ngx_http_stat_sink_t *sink,
+        ngx_http_stat_series_t *series, time_t ts, u_char *b, u_char *last);
+static u_char *ngx_http_otlp_histogram(ngx_http_stat_sink_t *sink,
+        ngx_http_stat_series_t *series, time_t ts, u_char *b, u_char *last);
+static u_char *ngx_http_otlp_batch(ngx_http_stat_sink_t *sink,
+        u_char *start, u_char *last, ngx_log_t *log);
+
+
+/** Protobuf writer {{{
+ *  Every function writes at "b" and returns the end of the written field
+ *  or "last" if the field does not fit, so the callers check the result
+ *  once per message.
+ */
+static size_t
+ngx_http_otlp_varint_len(uint64_t v)
+{
+    size_t n;
+
+    for (n = 1; v > 0x7f; n++) {
+        v >>= 7;
+    }
+
+    return n;
+}
+
+
+static u_char *
+ngx_http_otlp_varint(u_char *b, u_char *last, uint64_t v)
+{
+    if ((size_t) (last - b) < ngx_http_otlp_varint_len(v)) {
+        return last;
+    }
+
+    while (v > 0x7f) {
+        *b++ = (u_char) (v | 0x80);
+        v >>= 7;
+    }
+
+    *b++ = (u_char) v;
+
+    return b;
+}
+
+
+static u_char *
+ngx_http_otlp_tag(u_char *b, u_char *last, ngx_uint_t field,
+        ngx_uint_t type)
+{
+    return ngx_http_otlp_varint(b, last, field << 3 | type);
+}
+
+
+static u_char *
+ngx_http_otlp_fixed64(u_char *b, u_char *last, uint64_t v)
+{
+    ngx_uint_t i;
+
+    if (last - b < 8) {
+        return last;
+    }
+
+    /* fixed64 is little endian */
+
+    for (i = 0; i < 8; i++) {
+        *b++ = (u_char) (v >> (8 * i));
+    }
+
+    return b;
+}
+
+
+static u_char *
+ngx_http_otlp_double(u_char *b, u_char *last, double v)
+{
+    uint64_t bits;
+
+    ngx_memcpy(&bits, &v, sizeof(double));
+
+    return ngx_http_otlp_fixed64(b, last, bits);
+}
+
+
+static u_char *
+ngx_http_otlp_string(u_char *b, u_char *last, ngx_uint_t field,
+        ngx_str_t *value)
+{
+    b = ngx_http_otlp_tag(b, last, field, PB_LEN);
+    b = ngx_http_otlp_varint(b, last, value->len);
+
+    if ((size_t) (last - b) < value->len) {
+        return last;
+    }
+
+    return ngx_cpymem(b, value->data, value->len);
+}
+
+
+/** Starts a length delimited field of unknown length, one byte is reserved
+ *  for the length. Returns the start of the field content.
+ */
+static u_char *
+ngx_http_otlp_open(u_char *b, u_char *last, ngx_uint_t field)
+{
+    b = ngx_http_otlp_tag(b, last, field, PB_LEN);
+
+    if (b == last) {
+        return last;
+    }
+
+    return b + 1;
+}
+
+
+/** Writes the length of the field started by ngx_http_otlp_open, the
+ *  content is moved if the length takes more than the reserved byte.
+ */
+static u_char *
+ngx_http_otlp_close(u_char *start, u_char *b, u_char *last)
+{
+    size_t  len, n;
+
+    if (b == last) {
+        return last;
+    }
+
+    len = b - start;
+    n = ngx_http_otlp_varint_len(len);
+
+    if (n > 1) {
+
+        if ((size_t) (last - b) < n - 1) {
+            return last;
+        }
+
+        ngx_memmove(start + n - 1, start, len);
+    }
+
+    ngx_http_otlp_varint(start - 1, last, len);
+
+    return start - 1 + n + len;
+}
+
+
+/** KeyValue with a string value */
+static u_char *
+ngx_http_otlp_attribute(u_char *b, u_char *last, ngx_uint_t field,
+        char *key, ngx_str_t *value)
+{
+    u_char     *kv, *any;
+    ngx_str_t   name;
+
+    name.data = (u_char *) key;
+    name.len = ngx_strlen(key);
+
+    kv = ngx_http_otlp_open(b, last, field);
+    b = ngx_http_otlp_string(kv, last, OTLP_KEY_VALUE_KEY, &name);
+
+    any = ngx_http_otlp_open(b, last, OTLP_KEY_VALUE_VALUE);
+    b = ngx_http_otlp_string(any, last, OTLP_ANY_VALUE_STRING, value);
+    b = ngx_http_otlp_close(any, b, last);
+
+    return ngx_http_otlp_close(kv, b, last);
+}
+/** }}} */
+
+/** Serializer part {{{
+ */
+
+/** One Metric message per series, written as a "metrics" field of
+ *  ScopeMetrics, so the flush frames a batch without decoding it.
+ *  Params aggregated with "sum" are delta Sums over the export period,
+ *  other params are Gauges and percentiles are Histograms built from the
+ *  P2 markers: the marker heights are the bounds and their positions are
+ *  the cumulative counts.
+ */
+u_char *
+ngx_http_otlp_serialize(ngx_http_stat_sink_t *sink,
+        ngx_http_stat_series_t *series, time_t ts, u_char *buffer,
+        u_char *last)
+{
+    u_char  *metric, *name, *b;
+
+    metric = ngx_http_otlp_open(buffer, last, OTLP_SCOPE_METRICS_METRICS);
+
+    name = ngx_http_otlp_open(metric, last, OTLP_METRIC_NAME);
+
+    if (series->stt) {
+        b = ngx_snprintf(name, last - name, "nginx_stat_%V_histogram",
+                &series->param);
+
+    } else {
+        b = ngx_snprintf(name, last - name, "nginx_stat_%V", &series->param);
+    }
+
+    b = ngx_http_otlp_close(name, b, last);
+
+    if (series->stt) {
+        b = ngx_http_otlp_histogram(sink, series, ts, b, last);
+
+    } else {
+        b = ngx_http_otlp_number(sink, series, ts, b, last);
+    }
+
+    return ngx_http_otlp_close(metric, b, last);
+}
+
+
+static u_char *
+ngx_http_otlp_attributes(ngx_http_stat_sink_t *sink,
+        ngx_http_stat_series_t *series, ngx_uint_t field, u_char *b,
+        u_char *last)
+{
+    u_char                      p[4];
+    ngx_str_t                   percentile, *split;
+    ngx_http_stat_main_conf_t  *smcf;
+
+    smcf = sink->smcf;
+
+    if (series->split != SPLIT_INTERNAL) {
+        split = &((ngx_str_t *) smcf->splits->elts)[series->split];
+        b = ngx_http_otlp_attribute(b, last, field, "location", split);
+    }
+
+    if (series->percentile) {
+        percentile.data = p;
+        percentile.len = ngx_snprintf(p, sizeof(p), "p%ui",
+                series->percentile) - p;
+
+        b = ngx_http_otlp_attribute(b, last, field, "percentile",
+                &percentile);
+
+    } else if (series->interval.len) {
+        b = ngx_http_otlp_attribute(b, last, field, "interval",
+                &series->interval);
+    }
+
+    return b;
+}
+
+
+static u_char *
+ngx_http_otlp_number(ngx_http_stat_sink_t *sink,
+        ngx_http_stat_series_t *series, time_t ts, u_char *b, u_char *last)
+{
+    u_char      *data, *point;
+    double       value, period;
+    ngx_uint_t   sum;
+
+    value = series->value;
+    period = (double) sink->frequency / 1000;
+
+    sum = (series->aggregate == ngx_http_stat_aggregate_sum
+            && series->window);
+
+    if (sum) {
+        /* the share of the window sum that falls into the export period */
+        value = value * period / series->window;
+    }
+
+    data = ngx_http_otlp_open(b, last,
+            sum ? OTLP_METRIC_SUM : OTLP_METRIC_GAUGE);
+
+    point = ngx_http_otlp_open(data, last, OTLP_DATA_POINTS);
+
+    b = ngx_http_otlp_attributes(sink, series, OTLP_NUMBER_ATTRIBUTES,
+            point, last);
+
+    if (sum) {
+        b = ngx_http_otlp_tag(b, last, OTLP_NUMBER_START_TIME, PB_FIXED64);
+        b = ngx_http_otlp_fixed64(b, last,
+                (uint64_t) ((ts - period) * 1000000000));
+    }
+
+    b = ngx_http_otlp_tag(b, last, OTLP_NUMBER_TIME, PB_FIXED64);
+    b = ngx_http_otlp_fixed64(b, last, (uint64_t) ts * 1000000000);
+
+    b = ngx_http_otlp_tag(b, last, OTLP_NUMBER_AS_DOUBLE, PB_FIXED64);
+    b = ngx_http_otlp_double(b, last, value);
+
+    b = ngx_http_otlp_close(point, b, last);
+
+    if (sum) {
+        b = ngx_http_otlp_tag(b, last, OTLP_TEMPORALITY, PB_VARINT);
+        b = ngx_http_otlp_varint(b, last, OTLP_TEMPORALITY_DELTA);
+
+        b = ngx_http_otlp_tag(b, last, OTLP_SUM_IS_MONOTONIC, PB_VARINT);
+        b = ngx_http_otlp_varint(b, last, 1);
+    }
+
+    return ngx_http_otlp_close(data, b, last);
+}
+
+
+static u_char *
+ngx_http_otlp_histogram(ngx_http_stat_sink_t *sink,
+        ngx_http_stat_series_t *series, time_t ts, u_char *b, u_char *last)
+{
+    u_char               *data, *point, *packed;
+    double                bounds[P2_METRIC_COUNT];
+    uint64_t              counts[P2_METRIC_COUNT + 1], rank, total;
+    ngx_uint_t            i, k, n;
+    ngx_http_stat_stt_t  *stt;
+
+    stt = series->stt;
+
+    /* till the estimator is filled the markers are the samples */
+
+    k = ngx_min(stt->count, P2_METRIC_COUNT);
+    n = 0;
+    total = 0;
+
+    for (i = 0; i < k; i++) {
+
+        rank = (stt->count < P2_METRIC_COUNT) ? i + 1 : (uint64_t) stt->n[i];
+
+        /* the bounds must be strictly increasing */
+
+        if (n && bounds[n - 1] == stt->q[i]) {
+            counts[n - 1] += rank - total;
+
+        } else {
+            bounds[n] = stt->q[i];
+            counts[n] = rank - total;
+            n++;
+        }
+
+        total = rank;
+    }
+
+    /* the last marker is the maximum, nothing is above it */
+    counts[n] = 0;
+
+    data = ngx_http_otlp_open(b, last, OTLP_METRIC_HISTOGRAM);
+
+    point = ngx_http_otlp_open(data, last, OTLP_DATA_POINTS);
+
+    b = ngx_http_otlp_attributes(sink, series, OTLP_HISTOGRAM_ATTRIBUTES,
+            point, last);
+
+    b = ngx_http_otlp_tag(b, last, OTLP_HISTOGRAM_START_TIME, PB_FIXED64);
+    b = ngx_http_otlp_fixed64(b, last,
+            (uint64_t) ((ts - (double) sink->frequency / 1000) * 1000000000));
+
+    b = ngx_http_otlp_tag(b, last, OTLP_HISTOGRAM_TIME, PB_FIXED64);
+    b = ngx_http_otlp_fixed64(b, last, (uint64_t) ts * 1000000000);
+
+    b = ngx_http_otlp_tag(b, last, OTLP_HISTOGRAM_COUNT, PB_FIXED64);
+    b = ngx_http_otlp_fixed64(b, last, total);
+
+    if (n) {
+        packed = ngx_http_otlp_open(b, last, OTLP_HISTOGRAM_BUCKET_COUNTS);
+
+        for (b = packed, i = 0; i <= n; i++) {
+            b = ngx_http_otlp_fixed64(b, last, counts[i]);
+        }
+
+        b = ngx_http_otlp_close(packed, b, last);
+
+        packed = ngx_http_otlp_open(b, last, OTLP_HISTOGRAM_EXPLICIT_BOUNDS);
+
+        for (b = packed, i = 0; i < n; i++) {
+            b = ngx_http_otlp_double(b, last, bounds[i]);
+        }
+
+        b = ngx_http_otlp_close(packed, b, last);
+
+        b = ngx_http_otlp_tag(b, last, OTLP_HISTOGRAM_MIN, PB_FIXED64);
+        b = ngx_http_otlp_double(b, last, bounds[0]);
+
+        b = ngx_http_otlp_tag(b, last, OTLP_HISTOGRAM_MAX, PB_FIXED64);
+        b = ngx_http_otlp_double(b, last, bounds[n - 1]);
+    }
+
+    b = ngx_http_otlp_close(point, b, last);
+
+    b = ngx_http_otlp_tag(b, last, OTLP_TEMPORALITY, PB_VARINT);
+    b = ngx_http_otlp_varint(b, last, OTLP_TEMPORALITY_DELTA);
+
+    return ngx_http_otlp_close(data, b, last);
+}
+/** }}} */
+
+/** OTLP/HTTP transport {{{
+ */
+ngx_int_t
+ngx_http_otlp_init(ngx_http_stat_sink_t *sink, ngx_cycle_t *cycle)
+{
+    static ngx_str_t  content_type = ngx_string("application/x-protobuf");
+    static ngx_str_t  service = ngx_string("nginx");
+    static ngx_str_t  scope = ngx_string(OTLP_SCOPE);
+
+    size_t                      size;
+    u_char                     *p, *b, *last;
+    ngx_http_otlp_ctx_t        *ctx;
+    ngx_http_stat_main_conf_t  *smcf;
+
+    smcf = sink->smcf;
+
+    ctx = ngx_pcalloc(cycle->pool, sizeof(ngx_http_otlp_ctx_t));
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* the tags, the lengths and the keys take less than 96 bytes */
+
+    size = 96 + smcf->host.len + service.len + scope.len;
+
+    ctx->resource.data = ngx_palloc(cycle->pool, size);
+    if (ctx->resource.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    last = ctx->resource.data + size;
+
+    /* resource (1) { attributes (1) host.name, service.name } */
+
+    p = ngx_http_otlp_open(ctx->resource.data, last,
+            OTLP_RESOURCE_METRICS_RESOURCE);
+    b = ngx_http_otlp_attribute(p, last, OTLP_RESOURCE_ATTRIBUTES,
+            "host.name", &smcf->host);
+    b = ngx_http_otlp_attribute(b, last, OTLP_RESOURCE_ATTRIBUTES,
+            "service.name", &service);
+    b = ngx_http_otlp_close(p, b, last);
+
+    ctx->resource.len = b - ctx->resource.data;
+
+    /* scope (1) { name (1) } */
+
+    ctx->scope.data = b;
+
+    p = ngx_http_otlp_open(ctx->scope.data, last, OTLP_SCOPE_METRICS_SCOPE);
+    b = ngx_http_otlp_string(p, last, OTLP_SCOPE_NAME, &scope);
+    b = ngx_http_otlp_close(p, b, last);
+
+    if (b == last) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, 0,
+                "ngx_http_otlp_init: resource header is too long");
+        return NGX_ERROR;
+    }
+
+    ctx->scope.len = b - ctx->scope.data;
+
+    ctx->prefix.data = ngx_palloc(cycle->pool,
+            OTLP_PREFIX_LEN(ctx->resource.len, ctx->scope.len));
+    if (ctx->prefix.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    sink->ctx = ctx;
+
+    return ngx_http_stat_http_setup(sink, cycle, &content_type,
+            OTLP_PREFIX_LEN(ctx->resource.len, ctx->scope.len));
+}
+
+
+ngx_int_t
+ngx_http_otlp_flush(ngx_http_stat_sink_t *sink, u_char *start,
+        u_char *last, ngx_log_t *log)
+{
+    while (start < last) {
+
+        start = ngx_http_otlp_batch(sink, start, last, log);
+
+        if (start == NULL) {
+            break;
+        }
+    }
+
+    return ngx_http_stat_tcp_flush(sink, NULL, NULL, log);
+}
+
+
+/** Posts as many Metric messages as fit into "batch" bytes as one
+ *  ExportMetricsServiceRequest. Returns the first message left or NULL
+ *  if the request is not queued.
+ */
+static u_char *
+ngx_http_otlp_batch(ngx_http_stat_sink_t *sink, u_char *start,
+        u_char *last, ngx_log_t *log)
+{
+    u_char               *p, *q, *b, *end;
+    size_t                len, size, scope_metrics, resource_metrics;
+    uint64_t              n;
+    ngx_uint_t            shift;
+    ngx_http_otlp_ctx_t  *ctx;
+
+    ctx = sink->ctx;
+
+    p = start;
+    len = 0;
+    size = 0;
+
+    while (p < last) {
+
+        /* metrics (2) tag is one byte, then the varint length */
+
+        n = 0;
+        shift = 0;
+
+        for (q = p + 1; q < last; q++) {
+
+            n |= (uint64_t) (*q & 0x7f) << shift;
+            shift += 7;
+
+            if (!(*q & 0x80)) {
+                break;
+            }
+        }
+
+        len = q + 1 - p + n;
+
+        if (size + len > sink->batch_size) {
+            break;
+        }
+
+        size += len;
+        p += len;
+    }
+
+    if (p == start) {
+
+        /* a single series larger than the batch */
+
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                "ngx_http_otlp_flush: batch size too small, "
+                "need send %z to \"%V\"", len, &sink->server.name);
+
+        return start + len;
+    }
+
+    /*
+     * ExportMetricsServiceRequest {
+     *     resource_metrics (1) { resource (1), scope_metrics (2) {
+     *         scope (1), metrics (2) ... } } }
+     */
+
+    scope_metrics = ctx->scope.len + size;
+    resource_metrics = ctx->resource.len + 1
+            + ngx_http_otlp_varint_len(scope_metrics) + scope_metrics;
+
+    b = ctx->prefix.data;
+    end = b + OTLP_PREFIX_LEN(ctx->resource.len, ctx->scope.len);
+
+    b = ngx_http_otlp_tag(b, end, OTLP_REQUEST_RESOURCE_METRICS, PB_LEN);
+    b = ngx_http_otlp_varint(b, end, resource_metrics);
+    b = ngx_cpymem(b, ctx->resource.data, ctx->resource.len);
+    b = ngx_http_otlp_tag(b, end, OTLP_RESOURCE_METRICS_SCOPE, PB_LEN);
+    b = ngx_http_otlp_varint(b, end, scope_metrics);
+    b = ngx_cpymem(b, ctx->scope.data, ctx->scope.len);
+
+    ctx->prefix.len = b - ctx->prefix.data;
+
+    if (ngx_http_stat_http_post(sink, &ctx->prefix, start, p, log)
+            != NGX_OK)
+    {
+        return NULL;
+    }
+
+    return p;
+}
+/** }}} */
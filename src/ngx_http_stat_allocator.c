@@ -7,6 +7,18 @@
 #include "ngx_http_stat_allocator.h"
 
 
+#define NGX_HTTP_STAT_ARENA_MIN_SHIFT 4
+#define NGX_HTTP_STAT_ARENA_REGION    65536
+
+
+static ngx_uint_t ngx_http_stat_arena_class(ngx_http_stat_arena_t *arena,
+    size_t size);
+static size_t ngx_http_stat_arena_size(ngx_http_stat_arena_t *arena,
+    ngx_uint_t class);
+static ngx_int_t ngx_http_stat_arena_grow(ngx_http_stat_arena_t *arena,
+    ngx_uint_t hot);
+
+
 void
 ngx_http_stat_allocator_init(ngx_http_stat_allocator_t *allocator,
         void *pool, void* (*alloc)(void *, size_t),
@@ -16,6 +28,8 @@ ngx_http_stat_allocator_init(ngx_http_stat_allocator_t *allocator,
     allocator->alloc = alloc;
     allocator->free = free;
     allocator->nomemory = 0;
+    allocator->failures = 0;
+    allocator->largest_failure = 0;
 }
 
 
@@ -50,6 +64,244 @@ ngx_http_stat_allocator_slab_free(void *pool, void *p)
 }
 
 
+/** Arena {{{
+ *
+ * The shared memory is taken from the slab pool by large regions and cut
+ * into blocks by a bump pointer. A freed block goes to the free list of its
+ * class and is taken first by the next block of that class, so registering
+ * series at run time never scans the slab pages and leaves no holes. The
+ * acc rings and the percentile states are all of the same size and get a
+ * class of their own each. They are cut from regions of their own too, so
+ * the blocks written by every request share no cache line with the params
+ * and the series read beside them. The blocks larger than the classes go
+ * to the slab pool as is. Called under the lock of the zone, like the slab
+ * allocator.
+ */
+void
+ngx_http_stat_arena_init(ngx_http_stat_arena_t *arena,
+        ngx_slab_pool_t *shpool, size_t ring, size_t stt)
+{
+    ngx_memzero(arena, sizeof(ngx_http_stat_arena_t));
+
+    arena->shpool = shpool;
+    arena->ring = ring;
+    arena->stt = stt;
+    arena->region = ngx_http_stat_arena_region(ring);
+}
+
+
+/** Returns the size of the block taken for "size" bytes or 0 if they go to
+ *  the slab pool, for the zone to be sized before it exists.
+ */
+size_t
+ngx_http_stat_arena_block(size_t ring, size_t size)
+{
+    ngx_http_stat_arena_t  arena;
+
+    arena.ring = ring;
+    arena.stt = 0;
+
+    return ngx_http_stat_arena_size(&arena,
+            ngx_http_stat_arena_class(&arena, size));
+}
+
+
+size_t
+ngx_http_stat_arena_region(size_t ring)
+{
+    size_t  region;
+
+    /* a region holds a few rings at least */
+
+    region = NGX_HTTP_STAT_ARENA_REGION;
+
+    if (region < 4 * (ring + NGX_HTTP_STAT_ARENA_HEADER)) {
+        region = 4 * (ring + NGX_HTTP_STAT_ARENA_HEADER);
+    }
+
+    return ngx_align(region, ngx_pagesize);
+}
+
+
+void *
+ngx_http_stat_allocator_arena_alloc(void *pool, size_t size)
+{
+    ngx_http_stat_arena_t *arena = pool;
+
+    u_char      *p, **pos, **end;
+    size_t       block;
+    ngx_uint_t   class, hot;
+
+    class = ngx_http_stat_arena_class(arena, size);
+
+    if (class == NGX_HTTP_STAT_ARENA_LARGE) {
+
+        p = ngx_slab_alloc_locked(arena->shpool,
+                NGX_HTTP_STAT_ARENA_HEADER + size);
+        if (p == NULL) {
+            return NULL;
+        }
+
+        *(ngx_uint_t *) p = class;
+
+        return p + NGX_HTTP_STAT_ARENA_HEADER;
+    }
+
+    block = ngx_http_stat_arena_size(arena, class);
+
+    if (arena->free[class]) {
+
+        p = arena->free[class];
+        arena->free[class] = *(void **) (p + NGX_HTTP_STAT_ARENA_HEADER);
+        arena->free_bytes -= block;
+
+        return p + NGX_HTTP_STAT_ARENA_HEADER;
+    }
+
+    hot = (class >= NGX_HTTP_STAT_ARENA_RING);
+
+    pos = hot ? &arena->hot_pos : &arena->pos;
+    end = hot ? &arena->hot_end : &arena->end;
+
+    if ((size_t) (*end - *pos) < block
+            && ngx_http_stat_arena_grow(arena, hot) != NGX_OK)
+    {
+        return NULL;
+    }
+
+    p = *pos;
+    *pos += block;
+
+    *(ngx_uint_t *) p = class;
+
+    return p + NGX_HTTP_STAT_ARENA_HEADER;
+}
+
+
+void
+ngx_http_stat_allocator_arena_free(void *pool, void *p)
+{
+    ngx_http_stat_arena_t *arena = pool;
+
+    u_char      *block;
+    ngx_uint_t   class;
+
+    if (p == NULL) {
+        return;
+    }
+
+    block = (u_char *) p - NGX_HTTP_STAT_ARENA_HEADER;
+    class = *(ngx_uint_t *) block;
+
+    if (class == NGX_HTTP_STAT_ARENA_LARGE) {
+        ngx_slab_free_locked(arena->shpool, block);
+        return;
+    }
+
+    *(void **) p = arena->free[class];
+    arena->free[class] = block;
+    arena->free_bytes += ngx_http_stat_arena_size(arena, class);
+}
+
+
+static ngx_uint_t
+ngx_http_stat_arena_class(ngx_http_stat_arena_t *arena, size_t size)
+{
+    ngx_uint_t  class;
+
+    if (arena->ring && size == arena->ring) {
+        return NGX_HTTP_STAT_ARENA_RING;
+    }
+
+    if (arena->stt && size == arena->stt) {
+        return NGX_HTTP_STAT_ARENA_STT;
+    }
+
+    for (class = 0; class < NGX_HTTP_STAT_ARENA_CLASSES; class++) {
+        if (size <= (size_t) 1 << (NGX_HTTP_STAT_ARENA_MIN_SHIFT + class)) {
+            return class;
+        }
+    }
+
+    return NGX_HTTP_STAT_ARENA_LARGE;
+}
+
+
+static size_t
+ngx_http_stat_arena_size(ngx_http_stat_arena_t *arena, ngx_uint_t class)
+{
+    if (class == NGX_HTTP_STAT_ARENA_LARGE) {
+        return 0;
+    }
+
+    if (class == NGX_HTTP_STAT_ARENA_RING) {
+        return NGX_HTTP_STAT_ARENA_HEADER + ngx_align(arena->ring, 16);
+    }
+
+    if (class == NGX_HTTP_STAT_ARENA_STT) {
+        return NGX_HTTP_STAT_ARENA_HEADER + ngx_align(arena->stt, 16);
+    }
+
+    return NGX_HTTP_STAT_ARENA_HEADER
+        + ((size_t) 1 << (NGX_HTTP_STAT_ARENA_MIN_SHIFT + class));
+}
+
+
+/** Takes a new region, the rest of the current one is cut into the blocks
+ *  of the largest classes fitting it, the rings and the states for a hot
+ *  region.
+ */
+static ngx_int_t
+ngx_http_stat_arena_grow(ngx_http_stat_arena_t *arena, ngx_uint_t hot)
+{
+    u_char      *p, **pos, **end;
+    size_t       size;
+    ngx_uint_t   class, first;
+
+    p = ngx_slab_alloc_locked(arena->shpool, arena->region);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (hot) {
+        pos = &arena->hot_pos;
+        end = &arena->hot_end;
+        first = NGX_HTTP_STAT_ARENA_RING;
+        class = NGX_HTTP_STAT_ARENA_LARGE;
+
+    } else {
+        pos = &arena->pos;
+        end = &arena->end;
+        first = 0;
+        class = NGX_HTTP_STAT_ARENA_CLASSES;
+    }
+
+    while (class-- > first) {
+
+        size = ngx_http_stat_arena_size(arena, class);
+
+        while ((size_t) (*end - *pos) >= size) {
+
+            *(ngx_uint_t *) *pos = class;
+            *(void **) (*pos + NGX_HTTP_STAT_ARENA_HEADER) =
+                arena->free[class];
+
+            arena->free[class] = *pos;
+            arena->free_bytes += size;
+
+            *pos += size;
+        }
+    }
+
+    *pos = p;
+    *end = p + arena->region;
+    arena->regions++;
+
+    return NGX_OK;
+}
+/** }}} */
+
+
 void *
 ngx_http_stat_allocator_alloc(ngx_http_stat_allocator_t *allocator,
         size_t size)
@@ -58,6 +310,11 @@ ngx_http_stat_allocator_alloc(ngx_http_stat_allocator_t *allocator,
     p = allocator->alloc(allocator->pool, size);
     if (p == NULL) {
         allocator->nomemory = 1;
+        allocator->failures++;
+
+        if (size > allocator->largest_failure) {
+            allocator->largest_failure = size;
+        }
     }
     return p;
 }
@@ -13,11 +13,40 @@
 #include <ngx_http.h>
 
 
+/* the blocks of 16 to 2048 bytes, one class for the acc rings, one for the
+ * percentile states and others */
+#define NGX_HTTP_STAT_ARENA_CLASSES 8
+#define NGX_HTTP_STAT_ARENA_RING    NGX_HTTP_STAT_ARENA_CLASSES
+#define NGX_HTTP_STAT_ARENA_STT     (NGX_HTTP_STAT_ARENA_CLASSES + 1)
+#define NGX_HTTP_STAT_ARENA_LARGE   (NGX_HTTP_STAT_ARENA_CLASSES + 2)
+
+/* the class of a block is kept before it, the doubles stay aligned */
+#define NGX_HTTP_STAT_ARENA_HEADER  16
+
+
+typedef struct {
+    ngx_slab_pool_t *shpool;
+    u_char *pos;
+    u_char *end;
+    /* the regions of the rings and the states, written by every request */
+    u_char *hot_pos;
+    u_char *hot_end;
+    size_t region;
+    size_t ring;
+    size_t stt;
+    void *free[NGX_HTTP_STAT_ARENA_CLASSES + 2];
+    ngx_uint_t regions;
+    size_t free_bytes;
+} ngx_http_stat_arena_t;
+
+
 typedef struct {
     void *pool;
     void *(*alloc)(void *pool, size_t size);
     void (*free)(void *pool, void *p);
     ngx_int_t nomemory;
+    ngx_uint_t failures;
+    size_t largest_failure;
 } ngx_http_stat_allocator_t;
 
 
@@ -28,6 +57,13 @@ void ngx_http_stat_allocator_pool_free(void *pool, void *p);
 void *ngx_http_stat_allocator_slab_alloc(void *pool, size_t size);
 void ngx_http_stat_allocator_slab_free(void *pool, void *p);
 
+void ngx_http_stat_arena_init(ngx_http_stat_arena_t *arena,
+    ngx_slab_pool_t *shpool, size_t ring, size_t stt);
+size_t ngx_http_stat_arena_block(size_t ring, size_t size);
+size_t ngx_http_stat_arena_region(size_t ring);
+void *ngx_http_stat_allocator_arena_alloc(void *pool, size_t size);
+void ngx_http_stat_allocator_arena_free(void *pool, void *p);
+
 void *ngx_http_stat_allocator_alloc(ngx_http_stat_allocator_t *allocator,
     size_t size);
 void ngx_http_stat_allocator_free(ngx_http_stat_allocator_t *allocator,
@@ -20,6 +20,7 @@ ngx_http_stat_array_create(ngx_http_stat_allocator_t *allocator,
     }
 
     if (ngx_http_stat_array_init(array, allocator, n, size) != NGX_OK) {
+        ngx_http_stat_allocator_free(allocator, array);
         return NULL;
     }
 
@@ -32,13 +33,19 @@ ngx_http_stat_array_init(ngx_http_stat_array_t *array,
         ngx_http_stat_allocator_t *allocator, ngx_uint_t n,
         size_t size)
 {
+    ngx_memzero(array->segments, sizeof(array->segments));
+
     array->nelts = 0;
     array->size = size;
-    array->nalloc = n;
+    array->base = n ? n : 1;
+    array->nalloc = array->base;
+    array->nsegments = 1;
+    array->first = 0;
     array->allocator = allocator;
 
-    array->elts = ngx_http_stat_allocator_alloc(allocator, n * size);
-    if (array->elts == NULL) {
+    array->segments[0] = ngx_http_stat_allocator_alloc(allocator,
+            array->base * size);
+    if (array->segments[0] == NULL) {
         return NGX_ERROR;
     }
 
@@ -49,56 +56,65 @@ ngx_http_stat_array_init(ngx_http_stat_array_t *array,
 void
 ngx_http_stat_array_destroy(ngx_http_stat_array_t *array)
 {
-    ngx_http_stat_allocator_t *allocator;
+    ngx_uint_t                  k;
+    ngx_http_stat_allocator_t  *allocator;
 
     allocator = array->allocator;
 
-    ngx_http_stat_allocator_free(allocator, array->elts);
+    for (k = array->first; k < array->nsegments; k++) {
+        ngx_http_stat_allocator_free(allocator, array->segments[k]);
+    }
+
     ngx_http_stat_allocator_free(allocator, array);
 }
 
 
+/** Returns a zeroed element, a reader without the lock may see it zeroed
+ *  until the caller has filled it.
+ */
 void *
-ngx_http_stat_array_push(ngx_http_stat_array_t *a)
-{
-    return ngx_http_stat_array_push_n(a, 1);
-}
-
-void *
-ngx_http_stat_array_push_n(ngx_http_stat_array_t *array, ngx_uint_t n)
+ngx_http_stat_array_push(ngx_http_stat_array_t *array)
 {
-    ngx_http_stat_allocator_t *allocator;
-    ngx_uint_t                    nalloc;
-    void                         *new, *elt;
-
-    allocator = array->allocator;
+    void        *elt;
+    ngx_uint_t   n;
 
     if (array->nelts == array->nalloc) {
 
-        nalloc = 2 * ((n >= array->nalloc) ? n : array->nalloc);
+        if (array->nsegments == NGX_HTTP_STAT_ARRAY_SEGMENTS) {
+            return NULL;
+        }
+
+        n = array->base << array->nsegments;
 
-        new = ngx_http_stat_allocator_alloc(allocator, nalloc * array->size);
-        if (new == NULL) {
+        elt = ngx_http_stat_allocator_alloc(array->allocator,
+                n * array->size);
+        if (elt == NULL) {
             return NULL;
         }
 
-        ngx_memcpy(new, array->elts, array->nelts * array->size);
-        ngx_http_stat_allocator_free(allocator, array->elts);
-        array->elts = new;
-        array->nalloc = nalloc;
+        array->segments[array->nsegments++] = elt;
+        array->nalloc += n;
     }
 
-    elt = (u_char* )array->elts + array->size * array->nelts;
-    array->nelts += n;
+    elt = ngx_http_stat_array_get(array, array->nelts);
+    ngx_memzero(elt, array->size);
+
+    ngx_memory_barrier();
+
+    array->nelts++;
 
     return elt;
 }
 
+
+/** The copy has all the elements in its first segment */
 ngx_http_stat_array_t *
 ngx_http_stat_array_copy(ngx_http_stat_allocator_t *allocator,
         ngx_http_stat_array_t *array)
 {
-    ngx_http_stat_array_t *copy;
+    u_char                 *p;
+    ngx_uint_t              i;
+    ngx_http_stat_array_t  *copy;
 
     copy = ngx_http_stat_array_create(allocator, array->nalloc, array->size);
 
@@ -106,12 +122,63 @@ ngx_http_stat_array_copy(ngx_http_stat_allocator_t *allocator,
         return NULL;
     }
 
-    if (ngx_http_stat_array_push_n(copy, array->nelts) == NULL) {
-        return NULL;
+    p = copy->segments[0];
+
+    for (i = 0; i < array->nelts; i++) {
+        ngx_memcpy(p, ngx_http_stat_array_get(array, i), array->size);
+        p += array->size;
     }
 
-    ngx_memcpy(copy->elts, array->elts, array->nelts * array->size);
+    copy->nelts = array->nelts;
 
     return copy;
 }
 
+
+/** The copy is of the allocator, but its elements are copied to the memory
+ *  of "local" as the first segment, only the elements pushed later go to
+ *  the allocator. With the pool of the cycle as "local", a zone created by
+ *  the master refers to the memory every worker inherits.
+ */
+ngx_http_stat_array_t *
+ngx_http_stat_array_copy_private(ngx_http_stat_allocator_t *allocator,
+        ngx_http_stat_allocator_t *local, ngx_http_stat_array_t *array)
+{
+    u_char                 *p;
+    ngx_uint_t              i;
+    ngx_http_stat_array_t  *copy;
+
+    if (array->nelts == 0) {
+        return ngx_http_stat_array_copy(allocator, array);
+    }
+
+    copy = ngx_http_stat_allocator_alloc(allocator,
+            sizeof(ngx_http_stat_array_t));
+    if (copy == NULL) {
+        return NULL;
+    }
+
+    p = ngx_http_stat_allocator_alloc(local, array->nelts * array->size);
+    if (p == NULL) {
+        ngx_http_stat_allocator_free(allocator, copy);
+        return NULL;
+    }
+
+    ngx_memzero(copy->segments, sizeof(copy->segments));
+
+    copy->segments[0] = p;
+    copy->nsegments = 1;
+    copy->first = 1;
+    copy->base = array->nelts;
+    copy->nelts = array->nelts;
+    copy->size = array->size;
+    copy->nalloc = array->nelts;
+    copy->allocator = allocator;
+
+    for (i = 0; i < array->nelts; i++) {
+        ngx_memcpy(p, ngx_http_stat_array_get(array, i), array->size);
+        p += array->size;
+    }
+
+    return copy;
+}
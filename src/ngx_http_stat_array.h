@@ -1,4 +1,3 @@
-
 /**
  * (c) BSD-2-Cause, link: https://opensource.org/licenses/BSD-2-Clause
  * (c) V. Soshnikov, mailto: dedok.mad@gmail.com
@@ -10,9 +9,24 @@
 #include "ngx_http_stat_allocator.h"
 
 
+/* segment k holds (base << k) elements, so 24 of them are enough for
+ * 16M elements even when the array starts with a single one */
+#define NGX_HTTP_STAT_ARRAY_SEGMENTS 24
+
+
+/** The elements are never moved once pushed: a full array gets one more
+ *  segment twice as large as the previous one, the old ones stay in place.
+ *  A pointer to an element stays valid until the array is destroyed, and
+ *  the first nelts elements may be read without the lock, nelts is only
+ *  increased after the new element is written.
+ */
 typedef struct {
-    void                      *elts;
-    ngx_uint_t                 nelts;
+    void                      *segments[NGX_HTTP_STAT_ARRAY_SEGMENTS];
+    ngx_uint_t                 nsegments;
+    /* the segments before it are not of the allocator */
+    ngx_uint_t                 first;
+    ngx_uint_t                 base;
+    volatile ngx_uint_t        nelts;
     size_t                     size;
     ngx_uint_t                 nalloc;
     ngx_http_stat_allocator_t *allocator;
@@ -24,10 +38,30 @@ ngx_http_stat_array_t *ngx_http_stat_array_create(
 ngx_int_t ngx_http_stat_array_init(ngx_http_stat_array_t *array,
     ngx_http_stat_allocator_t *allocator, ngx_uint_t n, size_t size);
 void ngx_http_stat_array_destroy(ngx_http_stat_array_t *array);
-void *ngx_http_stat_array_push(ngx_http_stat_array_t *a);
-void *ngx_http_stat_array_push_n(ngx_http_stat_array_t *a, ngx_uint_t n);
+void *ngx_http_stat_array_push(ngx_http_stat_array_t *array);
 ngx_http_stat_array_t *ngx_http_stat_array_copy(
     ngx_http_stat_allocator_t *allocator, ngx_http_stat_array_t *array);
+ngx_http_stat_array_t *ngx_http_stat_array_copy_private(
+    ngx_http_stat_allocator_t *allocator, ngx_http_stat_allocator_t *local,
+    ngx_http_stat_array_t *array);
+
+
+static ngx_inline void *
+ngx_http_stat_array_get(ngx_http_stat_array_t *array, ngx_uint_t i)
+{
+    ngx_uint_t  k, n;
+
+    n = i / array->base + 1;
+
+#if (__GNUC__)
+    k = 8 * sizeof(unsigned long) - 1 - __builtin_clzl((unsigned long) n);
+#else
+    for (k = 0; n >> (k + 1); k++) { /* void */ }
+#endif
+
+    return (u_char *) array->segments[k]
+        + array->size * (i - array->base * ((1 << k) - 1));
+}
 
 #endif /** NGX_HTTP_STAT_ARRAY_H_INCLUDED */
 
@@ -0,0 +1,392 @@
+
+/**
+ * (c) BSD-2-Cause, link: https://opensource.org/licenses/BSD-2-Clause
+ * (c) V. Soshnikov, mailto: dedok.mad@gmail.com
+ */
+
+#include "ngx_http_stat_module.h"
+
+#include <sys/mman.h>
+
+
+#define NGX_HTTP_STAT_CHECKPOINT_MAGIC   0x74706b6374617473ULL /* "statckpt" */
+#define NGX_HTTP_STAT_CHECKPOINT_VERSION 1
+
+
+static uint32_t ngx_http_stat_checkpoint_layout(
+        ngx_http_stat_main_conf_t *smcf);
+static size_t ngx_http_stat_checkpoint_size(ngx_http_stat_main_conf_t *smcf);
+
+
+/** Checkpoint part {{{
+ *
+ * The file holds the configured metrics and statistics in the order of the
+ * config, so it is loaded as is when the layout hash matches. The rings are
+ * stored from the oldest second to the time of the checkpoint, the loader
+ * shifts them into the new ring and the seconds nginx was down read as zero.
+ */
+ngx_int_t
+ngx_http_stat_checkpoint_init(ngx_conf_t *cf,
+        ngx_http_stat_checkpoint_t *checkpoint)
+{
+    ngx_str_t  name;
+
+    name.len = checkpoint->path.len;
+    name.data = ngx_pnalloc(cf->pool, name.len + 1);
+    if (name.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_cpystrn(name.data, checkpoint->path.data, name.len + 1);
+
+    if (ngx_conf_full_name(cf->cycle, &name, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    checkpoint->path = name;
+
+    /* "<path>.<pid>", the pid is of the worker writing it */
+
+    checkpoint->temp = ngx_pnalloc(cf->pool, name.len + NGX_INT_T_LEN + 2);
+    if (checkpoint->temp == NULL) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+/** Loads the checkpoint into the storage just created by the master. On a
+ *  binary upgrade the old workers still run, so the file is the last
+ *  periodic checkpoint.
+ */
+void
+ngx_http_stat_checkpoint_load(ngx_http_stat_main_conf_t *smcf,
+        ngx_log_t *log)
+{
+    u_char                             *addr, *p;
+    size_t                              size, ring;
+    time_t                              now, from, t, first;
+    ngx_fd_t                            fd;
+    ngx_str_t                          *name;
+    ngx_uint_t                          m, s, max;
+    ngx_file_info_t                     fi;
+    ngx_slab_pool_t                    *shpool;
+    ngx_http_stat_acc_t                *acc;
+    ngx_http_stat_metric_t             *metric;
+    ngx_http_stat_storage_t            *storage;
+    ngx_http_stat_statistic_t          *statistic;
+    ngx_http_stat_checkpoint_header_t  *header;
+
+    name = &smcf->checkpoint.path;
+
+    fd = ngx_open_file(name->data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (fd == NGX_INVALID_FILE) {
+        if (ngx_errno != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_WARN, log, ngx_errno,
+                    ngx_open_file_n " \"%V\" failed", name);
+        }
+        return;
+    }
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_WARN, log, ngx_errno,
+                ngx_fd_info_n " \"%V\" failed", name);
+        ngx_close_file(fd);
+        return;
+    }
+
+    size = ngx_http_stat_checkpoint_size(smcf);
+
+    if (ngx_file_size(&fi) != (off_t) size) {
+        ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                "stat checkpoint \"%V\" does not match the config, ignored",
+                name);
+        ngx_close_file(fd);
+        return;
+    }
+
+    addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+
+    if (addr == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_WARN, log, ngx_errno,
+                "mmap() \"%V\" failed", name);
+        ngx_close_file(fd);
+        return;
+    }
+
+    ngx_close_file(fd);
+
+    header = (ngx_http_stat_checkpoint_header_t *) addr;
+    max = smcf->storage->max_interval;
+
+    if (header->magic != NGX_HTTP_STAT_CHECKPOINT_MAGIC
+            || header->version != NGX_HTTP_STAT_CHECKPOINT_VERSION
+            || header->layout != ngx_http_stat_checkpoint_layout(smcf)
+            || header->max_interval != max
+            || header->nmetrics != smcf->storage->metrics->nelts
+            || header->nstatistics != smcf->storage->statistics->nelts)
+    {
+        ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                "stat checkpoint \"%V\" does not match the config, ignored",
+                name);
+        goto done;
+    }
+
+    now = ngx_time();
+
+    if (header->time > now || header->time < now - (time_t) max) {
+        ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                "stat checkpoint \"%V\" of %T is out of the intervals, "
+                "ignored", name, (time_t) header->time);
+        goto done;
+    }
+
+    shpool = (ngx_slab_pool_t *) smcf->shared->shm.addr;
+    storage = (ngx_http_stat_storage_t *) shpool->data;
+
+    /* the new ring starts a whole interval back, before the checkpoint */
+
+    from = now - (time_t) max;
+    first = (time_t) header->time - (time_t) max;
+
+    storage->start_time = from;
+    storage->last_time = from;
+
+    ring = sizeof(ngx_http_stat_acc_t) * (max + 1);
+    p = addr + sizeof(ngx_http_stat_checkpoint_header_t);
+
+    for (m = 0; m < storage->metrics->nelts; m++) {
+
+        metric = ngx_http_stat_array_get(storage->metrics, m);
+        acc = (ngx_http_stat_acc_t *) (p + ring * m);
+
+        for (t = from; t <= (time_t) header->time; t++) {
+            metric->acc[(t - from) % (max + 1)] = acc[t - first];
+        }
+    }
+
+    p += ring * storage->metrics->nelts;
+
+    for (s = 0; s < storage->statistics->nelts; s++) {
+
+        statistic = ngx_http_stat_array_get(storage->statistics, s);
+
+        ngx_memcpy(statistic->stt, p + sizeof(ngx_http_stat_stt_t) * s,
+                sizeof(ngx_http_stat_stt_t));
+    }
+
+    ngx_log_error(NGX_LOG_NOTICE, log, 0,
+            "stat checkpoint \"%V\" of %T loaded, %ui metrics and "
+            "%ui statistics", name, (time_t) header->time,
+            storage->metrics->nelts, storage->statistics->nelts);
+
+done:
+
+    munmap(addr, size);
+}
+
+
+/** Writes the configured metrics and statistics to "<path>.<pid>" and
+ *  renames it, so the file is either the previous checkpoint or the new
+ *  one. The storage is locked per metric, one ring at a time. It blocks
+ *  the event loop of the exporter for the whole write. A zone taken over
+ *  by the next cycle is not written.
+ */
+ngx_int_t
+ngx_http_stat_checkpoint_write(ngx_http_stat_main_conf_t *smcf,
+        ngx_log_t *log)
+{
+    u_char                             *addr, *p, *temp;
+    size_t                              size, ring;
+    time_t                              now, first, t;
+    ngx_fd_t                            fd;
+    ngx_str_t                          *name;
+    ngx_uint_t                          m, s, max, nmetrics, nstatistics;
+    ngx_slab_pool_t                    *shpool;
+    ngx_http_stat_acc_t                *acc;
+    ngx_http_stat_metric_t             *metric;
+    ngx_http_stat_storage_t            *storage;
+    ngx_http_stat_statistic_t          *statistic;
+    ngx_http_stat_checkpoint_header_t  *header;
+
+    name = &smcf->checkpoint.path;
+    temp = smcf->checkpoint.temp;
+
+    shpool = (ngx_slab_pool_t *) smcf->shared->shm.addr;
+    storage = (ngx_http_stat_storage_t *) shpool->data;
+
+    /* the exporter of the next cycle writes the newer values */
+
+    if (storage->migrated) {
+        return NGX_DECLINED;
+    }
+
+    max = smcf->storage->max_interval;
+    nmetrics = smcf->storage->metrics->nelts;
+    nstatistics = smcf->storage->statistics->nelts;
+
+    size = ngx_http_stat_checkpoint_size(smcf);
+    ring = sizeof(ngx_http_stat_acc_t) * (max + 1);
+
+    (void) ngx_sprintf(temp, "%V.%P%Z", name, ngx_pid);
+
+    fd = ngx_open_file(temp, NGX_FILE_RDWR, NGX_FILE_TRUNCATE,
+            NGX_FILE_DEFAULT_ACCESS);
+
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                ngx_open_file_n " \"%s\" failed", temp);
+        return NGX_ERROR;
+    }
+
+    if (ftruncate(fd, size) == -1) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                "ftruncate() \"%s\" failed", temp);
+        ngx_close_file(fd);
+        goto failed;
+    }
+
+    addr = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (addr == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                "mmap() \"%s\" failed", temp);
+        ngx_close_file(fd);
+        goto failed;
+    }
+
+    ngx_close_file(fd);
+
+    /* the file is zero filled, the seconds out of the ring stay zero */
+
+    now = ngx_time();
+    first = now - (time_t) max;
+    p = addr + sizeof(ngx_http_stat_checkpoint_header_t);
+
+    for (m = 0; m < nmetrics; m++) {
+
+        acc = (ngx_http_stat_acc_t *) (p + ring * m);
+
+        /** Lock {{{ */
+        ngx_shmtx_lock(&shpool->mutex);
+
+        ngx_http_stat_gc(smcf, now);
+
+        metric = ngx_http_stat_array_get(storage->metrics, m);
+
+        for (t = ngx_max(first, storage->last_time); t <= now; t++) {
+            acc[t - first] = metric->acc[(t - storage->start_time)
+                % (max + 1)];
+        }
+
+        ngx_shmtx_unlock(&shpool->mutex);
+        /** }}} */
+    }
+
+    p += ring * nmetrics;
+
+    /** Lock {{{ */
+    ngx_shmtx_lock(&shpool->mutex);
+
+    for (s = 0; s < nstatistics; s++) {
+
+        statistic = ngx_http_stat_array_get(storage->statistics, s);
+
+        ngx_memcpy(p + sizeof(ngx_http_stat_stt_t) * s, statistic->stt,
+                sizeof(ngx_http_stat_stt_t));
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+    /** }}} */
+
+    /* the header goes last, a torn file never has the magic */
+
+    header = (ngx_http_stat_checkpoint_header_t *) addr;
+
+    header->version = NGX_HTTP_STAT_CHECKPOINT_VERSION;
+    header->layout = ngx_http_stat_checkpoint_layout(smcf);
+    header->time = now;
+    header->max_interval = max;
+    header->nmetrics = nmetrics;
+    header->nstatistics = nstatistics;
+    header->magic = NGX_HTTP_STAT_CHECKPOINT_MAGIC;
+
+    munmap(addr, size);
+
+    if (ngx_rename_file(temp, name->data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                ngx_rename_file_n " \"%s\" to \"%V\" failed", temp, name);
+        goto failed;
+    }
+
+    return NGX_OK;
+
+failed:
+
+    if (ngx_delete_file(temp) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                ngx_delete_file_n " \"%s\" failed", temp);
+    }
+
+    return NGX_ERROR;
+}
+
+
+/** Hash of the identities of the configured metrics and statistics in
+ *  their order, with everything the size of the file depends on.
+ */
+static uint32_t
+ngx_http_stat_checkpoint_layout(ngx_http_stat_main_conf_t *smcf)
+{
+    uint32_t                    crc, key;
+    uint64_t                    sizes[3];
+    ngx_uint_t                  i;
+    ngx_http_stat_storage_t    *storage;
+    ngx_http_stat_metric_t     *metric;
+    ngx_http_stat_statistic_t  *statistic;
+
+    storage = smcf->storage;
+
+    sizes[0] = storage->max_interval;
+    sizes[1] = sizeof(ngx_http_stat_acc_t);
+    sizes[2] = sizeof(ngx_http_stat_stt_t);
+
+    ngx_crc32_init(crc);
+
+    ngx_crc32_update(&crc, (u_char *) sizes, sizeof(sizes));
+
+    for (i = 0; i < storage->metrics->nelts; i++) {
+
+        metric = ngx_http_stat_array_get(storage->metrics, i);
+
+        key = ngx_http_stat_shared_key(smcf, storage, metric->split,
+                metric->param);
+        ngx_crc32_update(&crc, (u_char *) &key, sizeof(key));
+    }
+
+    for (i = 0; i < storage->statistics->nelts; i++) {
+
+        statistic = ngx_http_stat_array_get(storage->statistics, i);
+
+        key = ngx_http_stat_shared_key(smcf, storage, statistic->split,
+                statistic->param);
+        ngx_crc32_update(&crc, (u_char *) &key, sizeof(key));
+    }
+
+    ngx_crc32_final(crc);
+
+    return crc;
+}
+
+
+static size_t
+ngx_http_stat_checkpoint_size(ngx_http_stat_main_conf_t *smcf)
+{
+    return sizeof(ngx_http_stat_checkpoint_header_t)
+        + sizeof(ngx_http_stat_acc_t) * (smcf->storage->max_interval + 1)
+            * smcf->storage->metrics->nelts
+        + sizeof(ngx_http_stat_stt_t) * smcf->storage->statistics->nelts;
+}
+/** }}} */
@@ -7,6 +7,10 @@
 #include "ngx_http_stat_module.h"
 
 
+/* the smallest slot of the slab pool of a zone, see ngx_init_zone_pool() */
+#define NGX_HTTP_STAT_SLAB_MIN_SHIFT 3
+
+
 /** FWD {{{ */
 typedef char *(*ngx_http_stat_arg_handler_pt)(ngx_http_stat_ctx_t *,
         void *, ngx_str_t *);
@@ -17,6 +21,12 @@ typedef struct {
     ngx_str_t                    deflt;
 } ngx_http_stat_arg_t;
 
+/** Identity of a metric or a statistic of the previous zone */
+typedef struct {
+    uint32_t                     hash;
+    ngx_uint_t                   index;
+} ngx_http_stat_key_t;
+
 /** Sources (i.e. locations or...) {{{ */
 struct ngx_http_stat_source_s;
 
@@ -67,10 +77,24 @@ static ngx_http_complex_value_t *ngx_http_stat_complex_compile(
 static ngx_int_t ngx_http_stat_handler(ngx_http_request_t *r);
 static ngx_int_t ngx_http_stat_shared_init(ngx_shm_zone_t *shm_zone,
         void *data);
+static size_t ngx_http_stat_shared_size(ngx_http_stat_main_conf_t *smcf,
+        ngx_str_t *name);
+static void ngx_http_stat_shared_alloc(ngx_uint_t *chunks, ngx_uint_t *pages,
+        size_t size);
+static ngx_int_t ngx_http_stat_shared_migrate(ngx_shm_zone_t *shm_zone);
+static int ngx_libc_cdecl ngx_http_stat_shared_key_cmp(const void *one,
+        const void *two);
+static ngx_http_stat_key_t *ngx_http_stat_shared_lookup(
+        ngx_http_stat_key_t *keys, ngx_uint_t n,
+        ngx_http_stat_main_conf_t *smcf, ngx_http_stat_storage_t *storage,
+        ngx_uint_t split, ngx_uint_t param, ngx_http_stat_main_conf_t *osmcf,
+        ngx_http_stat_storage_t *ostorage, ngx_http_stat_array_t *olds);
 
 static ngx_int_t ngx_http_stat_add_variables(ngx_conf_t *cf);
 static ngx_int_t ngx_http_stat_init(ngx_conf_t *cf);
+static ngx_int_t ngx_http_stat_init_module(ngx_cycle_t *cycle);
 static ngx_int_t ngx_http_stat_process_init(ngx_cycle_t *cycle);
+static void ngx_http_stat_exit_process(ngx_cycle_t *cycle);
 
 static void *ngx_http_stat_create_main_conf(ngx_conf_t *cf);
 static void *ngx_http_stat_create_srv_conf(ngx_conf_t *cf);
@@ -88,6 +112,19 @@ static char *ngx_http_stat_data(ngx_conf_t *cf, ngx_command_t *cmd,
         void *conf);
 static char *ngx_http_stat_param(ngx_conf_t *cf, ngx_command_t *cmd,
         void *conf);
+static char *ngx_http_stat_status(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf);
+static char *ngx_http_stat_query(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf);
+static char *ngx_http_stat_memory(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf);
+static char *ngx_http_stat_sink(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf);
+
+static ngx_http_stat_sink_t *ngx_http_stat_add_sink(ngx_conf_t *cf,
+        ngx_array_t *vars);
+static ngx_int_t ngx_http_stat_add_shard(ngx_conf_t *cf,
+        ngx_http_stat_sink_t *sink);
 
 static char *ngx_http_stat_add_default_data(ngx_conf_t *cf, ngx_array_t *datas,
         ngx_str_t *location, ngx_array_t *template,  ngx_array_t *params,
@@ -97,27 +134,68 @@ static char *ngx_http_stat_add_data(ngx_conf_t *cf, ngx_array_t *datas,
 
 static char *ngx_http_stat_config_arg_host(ngx_http_stat_ctx_t *ctx,
         void *data, ngx_str_t *value);
-static char *ngx_http_stat_config_arg_server(ngx_http_stat_ctx_t *ctx,
-        void *data, ngx_str_t *value);
-static char *ngx_http_stat_config_arg_port(ngx_http_stat_ctx_t *ctx,
-        void *data, ngx_str_t *value);
-static char *ngx_http_stat_config_arg_frequency(ngx_http_stat_ctx_t *ctx,
-        void *data, ngx_str_t *value);
 static char *ngx_http_stat_config_arg_intervals(ngx_http_stat_ctx_t *ctx,
         void *data, ngx_str_t *value);
 static char *ngx_http_stat_config_arg_params(ngx_http_stat_ctx_t *ctx,
         void *data, ngx_str_t *value);
 static char *ngx_http_stat_config_arg_shared(ngx_http_stat_ctx_t *ctx,
         void *data, ngx_str_t *value);
-static char *ngx_http_stat_config_arg_buffer(ngx_http_stat_ctx_t *ctx,
+static char *ngx_http_stat_config_arg_shared_headroom(
+        ngx_http_stat_ctx_t *ctx, void *data, ngx_str_t *value);
+static char *ngx_http_stat_config_arg_thread_pool(ngx_http_stat_ctx_t *ctx,
+        void *data, ngx_str_t *value);
+static char *ngx_http_stat_config_arg_self(ngx_http_stat_ctx_t *ctx,
+        void *data, ngx_str_t *value);
+static char *ngx_http_stat_config_arg_checkpoint(ngx_http_stat_ctx_t *ctx,
+        void *data, ngx_str_t *value);
+static char *ngx_http_stat_config_arg_checkpoint_frequency(
+        ngx_http_stat_ctx_t *ctx, void *data, ngx_str_t *value);
+static char *ngx_http_stat_config_arg_exit_flush(ngx_http_stat_ctx_t *ctx,
+        void *data, ngx_str_t *value);
+
+static char *ngx_http_stat_sink_arg_server(ngx_http_stat_ctx_t *ctx,
+        void *data, ngx_str_t *value);
+static char *ngx_http_stat_sink_arg_port(ngx_http_stat_ctx_t *ctx,
+        void *data, ngx_str_t *value);
+static char *ngx_http_stat_sink_arg_frequency(ngx_http_stat_ctx_t *ctx,
+        void *data, ngx_str_t *value);
+static char *ngx_http_stat_sink_arg_buffer(ngx_http_stat_ctx_t *ctx,
+        void *data, ngx_str_t *value);
+static char *ngx_http_stat_sink_arg_package(ngx_http_stat_ctx_t *ctx,
+        void *data, ngx_str_t *value);
+static char *ngx_http_stat_sink_arg_template(ngx_http_stat_ctx_t *ctx,
+        void *data, ngx_str_t *value);
+static char *ngx_http_stat_sink_arg_protocol(ngx_http_stat_ctx_t *ctx,
+        void *data, ngx_str_t *value);
+static char *ngx_http_stat_sink_arg_timeout(ngx_http_stat_ctx_t *ctx,
+        void *data, ngx_str_t *value);
+static char *ngx_http_stat_sink_arg_queue(ngx_http_stat_ctx_t *ctx,
+        void *data, ngx_str_t *value);
+static char *ngx_http_stat_sink_arg_drop(ngx_http_stat_ctx_t *ctx,
+        void *data, ngx_str_t *value);
+static char *ngx_http_stat_sink_arg_backoff(ngx_http_stat_ctx_t *ctx,
+        void *data, ngx_str_t *value);
+static char *ngx_http_stat_sink_arg_uri(ngx_http_stat_ctx_t *ctx,
+        void *data, ngx_str_t *value);
+static char *ngx_http_stat_sink_arg_batch(ngx_http_stat_ctx_t *ctx,
+        void *data, ngx_str_t *value);
+static char *ngx_http_stat_sink_arg_inflight(ngx_http_stat_ctx_t *ctx,
+        void *data, ngx_str_t *value);
+static char *ngx_http_stat_sink_arg_gzip(ngx_http_stat_ctx_t *ctx,
+        void *data, ngx_str_t *value);
+static char *ngx_http_stat_sink_arg_fields(ngx_http_stat_ctx_t *ctx,
         void *data, ngx_str_t *value);
-static char *ngx_http_stat_config_arg_package(ngx_http_stat_ctx_t *ctx,
+static char *ngx_http_stat_sink_arg_suppress(ngx_http_stat_ctx_t *ctx,
         void *data, ngx_str_t *value);
-static char *ngx_http_stat_config_arg_template(ngx_http_stat_ctx_t *ctx,
+static char *ngx_http_stat_sink_arg_keyframe(ngx_http_stat_ctx_t *ctx,
         void *data, ngx_str_t *value);
-static char *ngx_http_stat_config_arg_protocol(ngx_http_stat_ctx_t *ctx,
+static char *ngx_http_stat_sink_arg_spool(ngx_http_stat_ctx_t *ctx,
         void *data, ngx_str_t *value);
-static char *ngx_http_stat_config_arg_timeout(ngx_http_stat_ctx_t *ctx,
+static char *ngx_http_stat_sink_arg_spool_size(ngx_http_stat_ctx_t *ctx,
+        void *data, ngx_str_t *value);
+static char *ngx_http_stat_sink_arg_spool_rate(ngx_http_stat_ctx_t *ctx,
+        void *data, ngx_str_t *value);
+static char *ngx_http_stat_sink_arg_resolve(ngx_http_stat_ctx_t *ctx,
         void *data, ngx_str_t *value);
 
 static char *ngx_http_stat_param_arg_name(ngx_http_stat_ctx_t *ctx,
@@ -149,6 +227,13 @@ static ngx_command_t ngx_http_stat_commands[] = {
       0,
       NULL },
 
+    { ngx_string("stat_sink"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_1MORE,
+      ngx_http_stat_sink,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
     { ngx_string("stat_param"),
       NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_TAKE2|NGX_CONF_TAKE3|
           NGX_CONF_TAKE4,
@@ -172,6 +257,27 @@ static ngx_command_t ngx_http_stat_commands[] = {
       0,
       NULL },
 
+    { ngx_string("stat_status"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_stat_status,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("stat_query"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_stat_query,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("stat_memory"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_stat_memory,
+      0,
+      0,
+      NULL },
+
       ngx_null_command
 };
 
@@ -197,11 +303,11 @@ ngx_module_t ngx_http_stat_module = {
     ngx_http_stat_commands,            /* module directives */
     NGX_HTTP_MODULE,                   /* module type */
     NULL,                              /* init master */
-    NULL,                              /* init module */
+    ngx_http_stat_init_module,         /* init module */
     ngx_http_stat_process_init,        /* init process */
     NULL,                              /* init thread */
     NULL,                              /* exit thread */
-    NULL,                              /* exit process */
+    ngx_http_stat_exit_process,        /* exit process */
     NULL,                              /* exit master */
     NGX_MODULE_V1_PADDING
 };
@@ -216,15 +322,6 @@ static  ngx_http_stat_arg_t ngx_http_stat_config_args[] = {
     { ngx_string("host"),
       ngx_http_stat_config_arg_host,
       ngx_null_string },
-    { ngx_string("server"),
-      ngx_http_stat_config_arg_server,
-      ngx_null_string },
-    { ngx_string("port"),
-      ngx_http_stat_config_arg_port,
-      ngx_string("8089") },
-    { ngx_string("frequency"),
-      ngx_http_stat_config_arg_frequency,
-      ngx_string("60") },
     { ngx_string("intervals"),
       ngx_http_stat_config_arg_intervals,
       ngx_string("1m") },
@@ -233,22 +330,95 @@ static  ngx_http_stat_arg_t ngx_http_stat_config_args[] = {
       ngx_string(DEFAULT_PARAMS)},
     { ngx_string("shared"),
       ngx_http_stat_config_arg_shared,
-      ngx_string("1m") },
+      ngx_string("auto") },
+    { ngx_string("shared_headroom"),
+      ngx_http_stat_config_arg_shared_headroom,
+      ngx_string("256k") },
+    { ngx_string("thread_pool"),
+      ngx_http_stat_config_arg_thread_pool,
+      ngx_null_string },
+    { ngx_string("self"),
+      ngx_http_stat_config_arg_self,
+      ngx_string("off") },
+    { ngx_string("checkpoint"),
+      ngx_http_stat_config_arg_checkpoint,
+      ngx_null_string },
+    { ngx_string("checkpoint_frequency"),
+      ngx_http_stat_config_arg_checkpoint_frequency,
+      ngx_string("5m") },
+    { ngx_string("exit_flush"),
+      ngx_http_stat_config_arg_exit_flush,
+      ngx_string("1s") }
+};
+
+
+static  ngx_http_stat_arg_t ngx_http_stat_sink_args[] = {
+    { ngx_string("server"),
+      ngx_http_stat_sink_arg_server,
+      ngx_null_string },
+    { ngx_string("port"),
+      ngx_http_stat_sink_arg_port,
+      ngx_null_string },
+    { ngx_string("frequency"),
+      ngx_http_stat_sink_arg_frequency,
+      ngx_string("60") },
     { ngx_string("buffer"),
-      ngx_http_stat_config_arg_buffer,
-      ngx_string("64k") },
+      ngx_http_stat_sink_arg_buffer,
+      ngx_null_string },
     { ngx_string("package"),
-      ngx_http_stat_config_arg_package,
+      ngx_http_stat_sink_arg_package,
       ngx_string("1400") },
     { ngx_string("template"),
-      ngx_http_stat_config_arg_template,
+      ngx_http_stat_sink_arg_template,
       ngx_null_string },
     { ngx_string("protocol"),
-      ngx_http_stat_config_arg_protocol,
+      ngx_http_stat_sink_arg_protocol,
       ngx_null_string },
     { ngx_string("timeout"),
-      ngx_http_stat_config_arg_timeout,
-      ngx_string("100") }
+      ngx_http_stat_sink_arg_timeout,
+      ngx_string("100") },
+    { ngx_string("queue"),
+      ngx_http_stat_sink_arg_queue,
+      ngx_string("1m") },
+    { ngx_string("drop"),
+      ngx_http_stat_sink_arg_drop,
+      ngx_string("newest") },
+    { ngx_string("backoff"),
+      ngx_http_stat_sink_arg_backoff,
+      ngx_string("30s") },
+    { ngx_string("uri"),
+      ngx_http_stat_sink_arg_uri,
+      ngx_null_string },
+    { ngx_string("batch"),
+      ngx_http_stat_sink_arg_batch,
+      ngx_string("64k") },
+    { ngx_string("inflight"),
+      ngx_http_stat_sink_arg_inflight,
+      ngx_string("1") },
+    { ngx_string("gzip"),
+      ngx_http_stat_sink_arg_gzip,
+      ngx_string("1") },
+    { ngx_string("fields"),
+      ngx_http_stat_sink_arg_fields,
+      ngx_string("single") },
+    { ngx_string("suppress"),
+      ngx_http_stat_sink_arg_suppress,
+      ngx_string("off") },
+    { ngx_string("keyframe"),
+      ngx_http_stat_sink_arg_keyframe,
+      ngx_null_string },
+    { ngx_string("spool"),
+      ngx_http_stat_sink_arg_spool,
+      ngx_null_string },
+    { ngx_string("spool_size"),
+      ngx_http_stat_sink_arg_spool_size,
+      ngx_string("16m") },
+    { ngx_string("spool_rate"),
+      ngx_http_stat_sink_arg_spool_rate,
+      ngx_string("100") },
+    { ngx_string("resolve"),
+      ngx_http_stat_sink_arg_resolve,
+      ngx_null_string }
 };
 
 
@@ -267,8 +437,6 @@ static  ngx_http_stat_arg_t ngx_http_stat_param_args[] = {
       ngx_null_string },
 };
 
-static ngx_event_t timer;
-
 /** Metrics & acc functions & statistics {{{ */
 static ngx_http_stat_aggregate_t ngx_http_stat_aggregates[] = {
 
@@ -380,11 +548,67 @@ static
 ngx_int_t
 ngx_http_stat_init(ngx_conf_t *cf)
 {
+    ngx_uint_t                 i;
     ngx_http_handler_pt       *h;
+    ngx_http_stat_sink_t      *sink, *slowest;
+    ngx_http_stat_main_conf_t *smcf;
+    ngx_http_core_loc_conf_t  *clcf;
     ngx_http_core_main_conf_t *cmcf;
 
     cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
 
+    /* "resolve" uses the resolver of the http block */
+
+    smcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_stat_module);
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+    smcf->resolver = clcf->resolver;
+    smcf->resolver_timeout = clcf->resolver_timeout;
+
+    /*
+     * the percentiles and the self counters cover the period of the slowest
+     * sink, the faster ones read them as they have grown since then
+     */
+
+    slowest = NULL;
+
+    for (i = 0; i < smcf->sinks->nelts; i++) {
+
+        sink = &((ngx_http_stat_sink_t *) smcf->sinks->elts)[i];
+
+        if (sink->resolve && sink->server.host.len
+                && (clcf->resolver == NULL
+                    || clcf->resolver->connections.nelts == 0))
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                    "no resolver defined to resolve \"%V\" at run time, "
+                    "set \"resolver\" in the http block",
+                    &sink->server.host);
+            return NGX_ERROR;
+        }
+
+        if (sink->shard == 0
+                && (slowest == NULL || sink->frequency > slowest->frequency))
+        {
+            slowest = sink;
+        }
+    }
+
+    if (slowest) {
+        slowest->restart = 1;
+    }
+
+    /* every location has added its series by now */
+
+    if (smcf->enable && smcf->shared_auto) {
+
+        smcf->shared->shm.size = ngx_http_stat_shared_size(smcf,
+                &smcf->shared->shm.name) + smcf->shared_headroom;
+
+        ngx_conf_log_error(NGX_LOG_INFO, cf, 0,
+                "stat shared memory size is %uz", smcf->shared->shm.size);
+    }
+
     h = ngx_array_push(&cmcf->phases[NGX_HTTP_LOG_PHASE].handlers);
     if (h == NULL) {
         return NGX_ERROR;
@@ -396,6 +620,37 @@ ngx_http_stat_init(ngx_conf_t *cf)
 }
 
 
+/** Called by the master once the cycle is committed: a reload may still fail
+ *  after the shared zones are initialised, and then the old workers keep the
+ *  old zone, so it is only marked as migrated here.
+ */
+static
+ngx_int_t
+ngx_http_stat_init_module(ngx_cycle_t *cycle)
+{
+    ngx_slab_pool_t            *oshpool;
+    ngx_http_stat_storage_t    *ostorage;
+    ngx_http_stat_main_conf_t  *smcf;
+
+    smcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_stat_module);
+
+    if (smcf == NULL || smcf->previous == NULL) {
+        return NGX_OK;
+    }
+
+    /* the old zone is still mapped, it is freed right after this */
+
+    oshpool = smcf->previous;
+    ostorage = (ngx_http_stat_storage_t *) oshpool->data;
+
+    ostorage->migrated = (ngx_atomic_uint_t) smcf->migrate_time;
+
+    smcf->previous = NULL;
+
+    return NGX_OK;
+}
+
+
 static
 ngx_int_t
 ngx_http_stat_process_init(ngx_cycle_t *cycle)
@@ -408,26 +663,37 @@ ngx_http_stat_process_init(ngx_cycle_t *cycle)
         return NGX_OK;
     }
 
-    ngx_memzero(&timer, sizeof(timer));
+    /* the cache manager and loader must not win the election */
 
-    if (smcf->protocol.len > sizeof("influx/") - 1 &&
-            ngx_strncmp(smcf->protocol.data, "influx/udp",
-                sizeof("influx/udp") - 1) == 0)
+    if (ngx_process != NGX_PROCESS_WORKER
+            && ngx_process != NGX_PROCESS_SINGLE)
     {
-        timer.handler = ngx_http_influx_udp_timer_handler;
-    } else {
-        ngx_log_error(NGX_LOG_CRIT, cycle->log, 0,
-            "a protocol does not supported \"%V\", for server \"%V\"",
-            &smcf->protocol, &smcf->server.name);
-        return NGX_ERROR;
+        return NGX_OK;
     }
 
-    timer.data = smcf;
-    timer.log = cycle->log;
+    return ngx_http_stat_sinks_init(smcf, cycle);
+}
 
-    ngx_add_timer(&timer, smcf->frequency);
 
-    return NGX_OK;
+static
+void
+ngx_http_stat_exit_process(ngx_cycle_t *cycle)
+{
+    ngx_http_stat_main_conf_t *smcf;
+
+    smcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_stat_module);
+
+    if (!smcf->enable) {
+        return;
+    }
+
+    if (ngx_process != NGX_PROCESS_WORKER
+            && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return;
+    }
+
+    ngx_http_stat_sinks_exit(smcf);
 }
 
 
@@ -447,19 +713,19 @@ ngx_http_stat_create_main_conf(ngx_conf_t *cf)
     smcf->splits = ngx_array_create(cf->pool, 1, sizeof(ngx_str_t));
     smcf->intervals = ngx_array_create(cf->pool, 1, sizeof(ngx_http_stat_interval_t));
     smcf->default_params = ngx_array_create(cf->pool, 1, sizeof(ngx_uint_t));
-    smcf->template = ngx_array_create(cf->pool, 1, sizeof(ngx_http_stat_template_t));
     smcf->default_data_template = ngx_array_create(cf->pool, 1, sizeof(ngx_http_stat_template_t));
     smcf->default_data_params = ngx_array_create(cf->pool, 1, sizeof(ngx_uint_t));
     smcf->datas = ngx_array_create(cf->pool, 1, sizeof(ngx_http_stat_data_t));
+    smcf->sinks = ngx_array_create(cf->pool, 1, sizeof(ngx_http_stat_sink_t));
 
     if (smcf->sources == NULL ||
         smcf->splits == NULL ||
         smcf->intervals == NULL ||
         smcf->default_params == NULL ||
-        smcf->template == NULL ||
         smcf->default_data_template == NULL ||
         smcf->default_data_params == NULL ||
-        smcf->datas == NULL)
+        smcf->datas == NULL ||
+        smcf->sinks == NULL)
     {
         return NULL;
     }
@@ -811,7 +1077,7 @@ ngx_http_stat_add_param_to_config(ngx_http_stat_ctx_t *ctx,
 
     for (p = 0; p < params->nelts; p++) {
 
-        old_param = &((ngx_http_stat_param_t*) params->elts)[p];
+        old_param = ngx_http_stat_array_get(params, p);
 
         if (param->name.len == old_param->name.len &&
                 ngx_strncmp(param->name.data, old_param->name.data,
@@ -854,18 +1120,20 @@ ngx_http_stat_add_param_to_data(ngx_http_stat_ctx_t *ctx,
     ngx_uint_t                   i, *m, *s;
     ngx_http_stat_storage_t     *storage;
     ngx_http_stat_param_t       *p;
+    ngx_http_stat_acc_t         *acc;
+    ngx_http_stat_stt_t         *stt;
     ngx_http_stat_metric_t      *metric;
     ngx_http_stat_statistic_t   *statistic;
 
     storage = ctx->storage;
 
-    p = &((ngx_http_stat_param_t*) storage->params->elts)[param];
+    p = ngx_http_stat_array_get(storage->params, param);
 
     if (p->percentile == 0) {
 
         for (i = 0; i < storage->metrics->nelts; i++) {
 
-            metric = &((ngx_http_stat_metric_t*) storage->metrics->elts)[i];
+            metric = ngx_http_stat_array_get(storage->metrics, i);
 
             if (metric->split == split && metric->param == param) {
                 break;
@@ -884,15 +1152,19 @@ ngx_http_stat_add_param_to_data(ngx_http_stat_ctx_t *ctx,
             metric->acc = NULL;
 
             if (ctx->phase == PHASE_REQUEST) {
-                metric->acc = ngx_http_stat_allocator_alloc(
-                        storage->allocator,
+                acc = ngx_http_stat_allocator_alloc(storage->allocator,
                         sizeof(ngx_http_stat_acc_t) * (storage->max_interval + 1));
-                if (metric->acc == NULL) {
+                if (acc == NULL) {
                     return NGX_CONF_ERROR;
                 }
 
-                ngx_memzero(metric->acc,
+                ngx_memzero(acc,
                         sizeof(ngx_http_stat_acc_t) * (storage->max_interval + 1));
+
+                /* the readers without the lock see a NULL or a zeroed ring */
+                ngx_memory_barrier();
+
+                metric->acc = acc;
             }
         }
 
@@ -907,7 +1179,7 @@ ngx_http_stat_add_param_to_data(ngx_http_stat_ctx_t *ctx,
         for (i = 0; i < storage->statistics->nelts; i++) {
 
             statistic =
-                &((ngx_http_stat_statistic_t*) storage->statistics->elts)[i];
+                ngx_http_stat_array_get(storage->statistics, i);
 
             if (statistic->split == split && statistic->param == param) {
                 break;
@@ -927,13 +1199,16 @@ ngx_http_stat_add_param_to_data(ngx_http_stat_ctx_t *ctx,
 
             if (ctx->phase == PHASE_REQUEST) {
 
-                statistic->stt = ngx_http_stat_allocator_alloc(
-                        storage->allocator, sizeof(ngx_http_stat_stt_t));
-                if (statistic->stt == NULL) {
+                stt = ngx_http_stat_allocator_alloc(storage->allocator,
+                        sizeof(ngx_http_stat_stt_t));
+                if (stt == NULL) {
                     return NGX_CONF_ERROR;
                 }
 
-                ngx_memzero(statistic->stt, sizeof(ngx_http_stat_stt_t));
+                ngx_memzero(stt, sizeof(ngx_http_stat_stt_t));
+                ngx_memory_barrier();
+
+                statistic->stt = stt;
             }
         }
 
@@ -968,8 +1243,7 @@ ngx_http_stat_add_param_to_params(ngx_http_stat_ctx_t *ctx,
             continue;
         }
 
-        old_param = &((ngx_http_stat_param_t*)
-                smcf->storage->params->elts)[p];
+        old_param = ngx_http_stat_array_get(smcf->storage->params, p);
 
         if (old_param->percentile == 0) {
             ngx_log_error(NGX_LOG_ERR, ctx->log, 0,
@@ -993,20 +1267,85 @@ ngx_http_stat_add_param_to_params(ngx_http_stat_ctx_t *ctx,
 }
 
 
+static
+ngx_uint_t
+ngx_http_stat_is_sink_arg(ngx_str_t *var)
+{
+    ngx_uint_t             i;
+    ngx_http_stat_arg_t   *arg;
+
+    for (i = 0; i < ARR_SIZE(ngx_http_stat_sink_args); i++) {
+
+        arg = &ngx_http_stat_sink_args[i];
+
+        if (var->len > arg->name.len
+                && ngx_strncmp(arg->name.data, var->data, arg->name.len) == 0
+                && var->data[arg->name.len] == '=')
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
 static
 char *
 ngx_http_stat_config(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     char                         *rc, host[HOST_LEN], *dot;
-    ngx_uint_t                    host_size;
+    ngx_uint_t                    host_size, i;
     ngx_http_stat_ctx_t           ctx;
-    ngx_url_t                     u;
-    ngx_str_t                     stat_shared_id;
+    ngx_str_t                    *value, *var;
+    ngx_array_t                  *config_vars, *sink_vars;
     ngx_http_stat_main_conf_t    *smcf;
 
+    smcf = conf;
+
+    if (smcf->enable) {
+        return "is duplicate";
+    }
+
     ctx = ngx_http_stat_ctx_from_config(cf);
 
-    rc = ngx_http_stat_parse_args(&ctx, cf->args, conf,
+    /* stat_config also describes the default sink */
+
+    config_vars = ngx_array_create(cf->pool, cf->args->nelts,
+            sizeof(ngx_str_t));
+    sink_vars = ngx_array_create(cf->pool, cf->args->nelts,
+            sizeof(ngx_str_t));
+
+    if (config_vars == NULL || sink_vars == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    value = cf->args->elts;
+
+    for (i = 0; i < cf->args->nelts; i++) {
+
+        if (i == 0 || !ngx_http_stat_is_sink_arg(&value[i])) {
+
+            var = ngx_array_push(config_vars);
+            if (var == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            *var = value[i];
+        }
+
+        if (i == 0 || ngx_http_stat_is_sink_arg(&value[i])) {
+
+            var = ngx_array_push(sink_vars);
+            if (var == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            *var = value[i];
+        }
+    }
+
+    rc = ngx_http_stat_parse_args(&ctx, config_vars, conf,
             ngx_http_stat_config_args,
             ARR_SIZE(ngx_http_stat_config_args));
 
@@ -1014,8 +1353,6 @@ ngx_http_stat_config(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
-    smcf = conf;
-
     if (smcf->host.len == 0) {
 
         gethostname(host, HOST_LEN);
@@ -1036,24 +1373,6 @@ ngx_http_stat_config(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         smcf->host.len = host_size;
     }
 
-    if (smcf->server.name.len == 0) {
-        ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
-                "stat config server not set");
-        return NGX_CONF_ERROR;
-    }
-
-    if (smcf->port < 1 || smcf->port > 65535) {
-        ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
-                "stat config port must be in range form 1 to 65535");
-        return NGX_CONF_ERROR;
-    }
-
-    if (smcf->frequency < 1 || smcf->frequency > 65535) {
-        ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
-                "stat config frequency must be in range form 1 to 65535");
-        return NGX_CONF_ERROR;
-    }
-
     if (smcf->intervals->nelts == 0) {
         ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
                 "stat config intervals not set");
@@ -1066,54 +1385,42 @@ ngx_http_stat_config(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
-    if (smcf->shared_size == 0 || smcf->buffer_size == 0) {
+    if (smcf->shared_size == 0) {
         ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
                 "stat config shared must be positive value");
         return NGX_CONF_ERROR;
     }
 
-    if (smcf->buffer_size == 0) {
-        ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
-                "stat config buffer must be positive value");
-        return NGX_CONF_ERROR;
-    }
-
-    if (smcf->package_size == 0) {
-        ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
-                "stat config package must be positive value");
-        return NGX_CONF_ERROR;
-    }
-
     if (smcf->shared_size < sizeof(ngx_slab_pool_t)) {
         ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
                 "stat too small shared memory");
         return NGX_CONF_ERROR;
     }
 
-    ngx_memzero(&u, sizeof(ngx_url_t));
-
-    u.url = smcf->server.name;
-    u.default_port = smcf->port;
-
-    if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
+    if (smcf->thread_pool_name.len) {
+#if (NGX_THREADS)
+        smcf->thread_pool = ngx_thread_pool_add(cf, &smcf->thread_pool_name);
+        if (smcf->thread_pool == NULL) {
+            return NGX_CONF_ERROR;
+        }
+#else
         ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
-                "\"%s\" in resolver \"%V\"", u.err, &u.url);
+                "stat config thread_pool requires nginx built with threads");
         return NGX_CONF_ERROR;
+#endif
     }
 
-    smcf->server.sockaddr = u.addrs[0].sockaddr;
-    smcf->server.socklen = u.addrs[0].socklen;
-
-    stat_shared_id.len = stat_shared_name.len + 32;
-    stat_shared_id.data = ngx_palloc(cf->pool, stat_shared_id.len);
-    if (stat_shared_id.data == NULL) {
+    if (smcf->checkpoint.path.len
+            && ngx_http_stat_checkpoint_init(cf, &smcf->checkpoint) != NGX_OK)
+    {
         return NGX_CONF_ERROR;
     }
 
-    ngx_snprintf(stat_shared_id.data, stat_shared_id.len,
-            "%V.%T", &stat_shared_name, ngx_time());
+    if (ngx_http_stat_add_sink(cf, sink_vars) == NULL) {
+        return NGX_CONF_ERROR;
+    }
 
-    smcf->shared = ngx_shared_memory_add(cf, &stat_shared_id,
+    smcf->shared = ngx_shared_memory_add(cf, &stat_shared_name,
             smcf->shared_size, &ngx_http_stat_module);
     if (smcf->shared == NULL) {
         return NGX_CONF_ERROR;
@@ -1123,15 +1430,16 @@ ngx_http_stat_config(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
                 "stat shared memory is used");
         return NGX_CONF_ERROR;
     }
+
+    /*
+     * the layout changes with the config, so the zone is never reused:
+     * the new one is created on every reload, takes over the values of
+     * the old one in ngx_http_stat_shared_init and the old one is freed
+     */
+    smcf->shared->noreuse = 1;
     smcf->shared->init = ngx_http_stat_shared_init;
     smcf->shared->data = smcf;
 
-    smcf->buffer.start = ngx_palloc(cf->pool, smcf->buffer_size);
-    if (smcf->buffer.start == NULL) {
-        return NGX_CONF_ERROR;
-    }
-    smcf->buffer.end = smcf->buffer.start + smcf->buffer_size;
-
     smcf->enable = 1;
 
     return NGX_CONF_OK;
@@ -1140,46 +1448,315 @@ ngx_http_stat_config(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
 static
 char *
-ngx_http_stat_default_data(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+ngx_http_stat_sink(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_http_stat_ctx_t              ctx;
-    ngx_http_stat_main_conf_t       *smcf;
-    ngx_http_stat_srv_conf_t        *sscf;
-    ngx_str_t                       *args, v, value;
-    ngx_array_t                     *template, *params;
-    ngx_http_complex_value_t        **filter;
-    ngx_uint_t                       i;
-
-    ctx = ngx_http_stat_ctx_from_config(cf);
-
-    smcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_stat_module);
-    sscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_stat_module);
+    ngx_http_stat_main_conf_t *smcf = conf;
 
     if (!smcf->enable) {
         ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "stat config not set");
         return NGX_CONF_ERROR;
     }
 
-    args = cf->args->elts;
-
-    template = NULL;
-    params = NULL;
-
-    if (cf->cmd_type == NGX_HTTP_MAIN_CONF) {
-        template = smcf->default_data_template;
-        params = smcf->default_data_params;
-        filter = &smcf->default_data_filter;
-    }
-    else if (cf->cmd_type == NGX_HTTP_SRV_CONF) {
-        template = sscf->default_data_template;
-        params = sscf->default_data_params;
-        filter = &sscf->default_data_filter;
-    }
-    else {
+    if (ngx_http_stat_add_sink(cf, cf->args) == NULL) {
         return NGX_CONF_ERROR;
     }
 
-    if (ngx_http_stat_template_compile(&ctx, template,
+    return NGX_CONF_OK;
+}
+
+
+static
+ngx_http_stat_sink_t *
+ngx_http_stat_add_sink(ngx_conf_t *cf, ngx_array_t *vars)
+{
+    char                         *rc;
+    u_char                       *p, *last;
+    ngx_str_t                     servers;
+    ngx_uint_t                    k, first;
+    ngx_http_stat_ctx_t           ctx;
+    ngx_http_stat_sink_t         *sink, *shard;
+    ngx_http_stat_main_conf_t    *smcf;
+
+    ctx = ngx_http_stat_ctx_from_config(cf);
+    smcf = ctx.smcf;
+
+    sink = ngx_array_push(smcf->sinks);
+    if (sink == NULL) {
+        return NULL;
+    }
+
+    ngx_memzero(sink, sizeof(ngx_http_stat_sink_t));
+
+    sink->index = smcf->sinks->nelts - 1;
+    sink->smcf = smcf;
+
+    sink->template = ngx_array_create(cf->pool, 1,
+            sizeof(ngx_http_stat_template_t));
+    if (sink->template == NULL) {
+        return NULL;
+    }
+
+    rc = ngx_http_stat_parse_args(&ctx, vars, sink, ngx_http_stat_sink_args,
+            ARR_SIZE(ngx_http_stat_sink_args));
+
+    if (rc == NGX_CONF_ERROR) {
+        return NULL;
+    }
+
+    sink->backend = ngx_http_stat_backend(&sink->protocol);
+
+    if (sink->backend == NULL) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
+                "stat config protocol \"%V\" is not supported",
+                &sink->protocol);
+        return NULL;
+    }
+
+    if (sink->server.name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
+                "stat config server not set");
+        return NULL;
+    }
+
+    if (sink->port == 0) {
+        sink->port = sink->backend->port;
+    }
+
+    if (sink->uri.len == 0) {
+        sink->uri = sink->backend->uri;
+    }
+
+    if (sink->port < 1 || sink->port > 65535) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
+                "stat config port must be in range form 1 to 65535");
+        return NULL;
+    }
+
+    if (sink->frequency < 1 || sink->frequency > 65535) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
+                "stat config frequency must be in range form 1 to 65535");
+        return NULL;
+    }
+
+    if (sink->package_size == 0) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
+                "stat config package must be positive value");
+        return NULL;
+    }
+
+    if (sink->queue_size < sink->package_size) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
+                "stat config queue must not be less than package");
+        return NULL;
+    }
+
+    if (sink->batch_size == 0) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
+                "stat config batch must be positive value");
+        return NULL;
+    }
+
+    if (sink->inflight < 1 || sink->inflight > 64) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
+                "stat config inflight must be in range form 1 to 64");
+        return NULL;
+    }
+
+    if (sink->gzip < 0 || sink->gzip > 9) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
+                "stat config gzip must be in range form 0 to 9");
+        return NULL;
+    }
+
+    if (sink->spool.path.len) {
+
+        if (sink->backend->connect != ngx_http_stat_tcp_connect) {
+            ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
+                    "stat config spool is not supported by \"%V\"",
+                    &sink->protocol);
+            return NULL;
+        }
+
+        if (sink->spool.size < sink->queue_size) {
+            ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
+                    "stat config spool_size must not be less than queue");
+            return NULL;
+        }
+
+        if (sink->spool.rate < 1 || sink->spool.rate > 65535) {
+            ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
+                    "stat config spool_rate must be in range form 1 to 65535");
+            return NULL;
+        }
+
+    }
+
+    /* every server of a list is a shard of its own, next to the first one */
+
+    first = sink->index;
+    servers = sink->server.name;
+
+    sink->nshards = 1;
+
+    for (p = servers.data; p < servers.data + servers.len; p++) {
+        if (*p == '|') {
+            sink->nshards++;
+        }
+    }
+
+    p = servers.data;
+
+    for (k = 0; k < sink->nshards; k++) {
+
+        sink = &((ngx_http_stat_sink_t *) smcf->sinks->elts)[first];
+
+        if (k > 0) {
+
+            shard = ngx_array_push(smcf->sinks);
+            if (shard == NULL) {
+                return NULL;
+            }
+
+            sink = &((ngx_http_stat_sink_t *) smcf->sinks->elts)[first];
+
+            *shard = *sink;
+            shard->index = smcf->sinks->nelts - 1;
+
+        } else {
+            shard = sink;
+        }
+
+        last = ngx_strlchr(p, servers.data + servers.len, '|');
+        if (last == NULL) {
+            last = servers.data + servers.len;
+        }
+
+        shard->shard = k;
+        shard->server.name.data = p;
+        shard->server.name.len = last - p;
+
+        p = last + 1;
+
+        if (ngx_http_stat_add_shard(cf, shard) != NGX_OK) {
+            return NULL;
+        }
+    }
+
+    sink = &((ngx_http_stat_sink_t *) smcf->sinks->elts)[first];
+
+    if (sink->nshards > 1 && ngx_http_stat_sink_ring(cf, sink) != NGX_OK) {
+        return NULL;
+    }
+
+    return sink;
+}
+
+
+static
+ngx_int_t
+ngx_http_stat_add_shard(ngx_conf_t *cf, ngx_http_stat_sink_t *sink)
+{
+    u_char      *p;
+    ngx_url_t    u;
+    ngx_addr_t   addr;
+
+    if (sink->server.name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
+                "stat config server list has an empty entry");
+        return NGX_ERROR;
+    }
+
+    if (sink->spool.path.len) {
+
+        if (sink->shard > 0) {
+
+            /* every shard has its own spool, "<spool>.<shard>" */
+
+            p = ngx_pnalloc(cf->pool, sink->spool.path.len + NGX_INT_T_LEN + 1);
+            if (p == NULL) {
+                return NGX_ERROR;
+            }
+
+            sink->spool.path.len = ngx_sprintf(p, "%V.%ui", &sink->spool.path,
+                    sink->shard) - p;
+            sink->spool.path.data = p;
+        }
+
+        if (ngx_http_stat_spool_open(cf, &sink->spool) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    u.url = sink->server.name;
+    u.default_port = sink->port;
+
+    if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
+                "\"%s\" in resolver \"%V\"", u.err, &u.url);
+        return NGX_ERROR;
+    }
+
+    sink->server.sockaddr = u.addrs[0].sockaddr;
+    sink->server.socklen = u.addrs[0].socklen;
+
+    /* only a name is resolved again, the first address is used meanwhile */
+
+    if (sink->resolve && u.host.len && u.host.data[0] != '['
+            && ngx_parse_addr(cf->pool, &addr, u.host.data, u.host.len)
+               != NGX_OK)
+    {
+        sink->server.host = u.host;
+        sink->server.port = u.port;
+    }
+
+    return NGX_OK;
+}
+
+
+static
+char *
+ngx_http_stat_default_data(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_stat_ctx_t              ctx;
+    ngx_http_stat_main_conf_t       *smcf;
+    ngx_http_stat_srv_conf_t        *sscf;
+    ngx_str_t                       *args, v, value;
+    ngx_array_t                     *template, *params;
+    ngx_http_complex_value_t        **filter;
+    ngx_uint_t                       i;
+
+    ctx = ngx_http_stat_ctx_from_config(cf);
+
+    smcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_stat_module);
+    sscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_stat_module);
+
+    if (!smcf->enable) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "stat config not set");
+        return NGX_CONF_ERROR;
+    }
+
+    args = cf->args->elts;
+
+    template = NULL;
+    params = NULL;
+
+    if (cf->cmd_type == NGX_HTTP_MAIN_CONF) {
+        template = smcf->default_data_template;
+        params = smcf->default_data_params;
+        filter = &smcf->default_data_filter;
+    }
+    else if (cf->cmd_type == NGX_HTTP_SRV_CONF) {
+        template = sscf->default_data_template;
+        params = sscf->default_data_params;
+        filter = &sscf->default_data_filter;
+    }
+    else {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_http_stat_template_compile(&ctx, template,
                 ngx_http_stat_default_data_args,
                 ARR_SIZE(ngx_http_stat_default_data_args),
                 &args[1]) != NGX_CONF_OK)
@@ -1331,7 +1908,7 @@ ngx_http_stat_search_param(ngx_http_stat_array_t *internals,
 
     for (i = 0; i < internals->nelts; i++) {
 
-        internal = &((ngx_http_stat_internal_t*) internals->elts)[i];
+        internal = ngx_http_stat_array_get(internals, i);
 
         min_len = internal->name.len < name->len ?
             internal->name.len : name->len;
@@ -1503,8 +2080,8 @@ ngx_http_stat_add_internal(ngx_http_stat_ctx_t *ctx,
             return NGX_ERROR;
         }
     } else {
-        data = ((ngx_http_stat_internal_t*)
-                storage->internals->elts)[i].data;
+        internal = ngx_http_stat_array_get(storage->internals, i);
+        data = internal->data;
     }
 
     new_param = *param;
@@ -1516,8 +2093,8 @@ ngx_http_stat_add_internal(ngx_http_stat_ctx_t *ctx,
                 continue;
             }
         } else {
-            new_param.percentile = ((ngx_uint_t*)
-                    new_param.percentiles->elts)[n - 1];
+            new_param.percentile = *(ngx_uint_t *) ngx_http_stat_array_get(
+                    new_param.percentiles, n - 1);
         }
 
         p = ngx_http_stat_add_param_to_config(ctx, &new_param);
@@ -1539,12 +2116,16 @@ ngx_http_stat_add_internal(ngx_http_stat_ctx_t *ctx,
             return NGX_ERROR;
         }
 
-        ngx_memmove(
-            &((ngx_http_stat_internal_t*) storage->internals->elts)[i + 1],
-            &((ngx_http_stat_internal_t*)storage->internals->elts)[i],
-            (storage->internals->nelts - i - 1) * sizeof(ngx_http_stat_internal_t));
+        /* the internals are kept sorted by name, unlike the other arrays
+         * they are shifted and so only read under the lock */
+
+        for (n = storage->internals->nelts - 1; n > i; n--) {
+            ngx_memcpy(ngx_http_stat_array_get(storage->internals, n),
+                    ngx_http_stat_array_get(storage->internals, n - 1),
+                    sizeof(ngx_http_stat_internal_t));
+        }
 
-        internal = &((ngx_http_stat_internal_t*)storage->internals->elts)[i];
+        internal = ngx_http_stat_array_get(storage->internals, i);
         internal->name = param->name;
         internal->data = data;
     }
@@ -1583,83 +2164,363 @@ ngx_http_stat_param(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
 static
 char *
-ngx_http_stat_config_arg_host(ngx_http_stat_ctx_t *ctx,
-        void *data, ngx_str_t *value)
+ngx_http_stat_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_http_stat_main_conf_t *smcf = data;
-    return ngx_http_stat_parse_string(ctx, value, &smcf->host);
+    ngx_http_stat_main_conf_t     *smcf;
+    ngx_http_core_loc_conf_t      *clcf;
+
+    smcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_stat_module);
+
+    if (!smcf->enable) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "stat config not set");
+        return NGX_CONF_ERROR;
+    }
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_stat_status_handler;
+
+    return NGX_CONF_OK;
 }
 
+
 static
 char *
-ngx_http_stat_config_arg_protocol(ngx_http_stat_ctx_t *ctx,
-        void *data, ngx_str_t *value)
+ngx_http_stat_query(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_http_stat_main_conf_t *smcf = data;
-    return ngx_http_stat_parse_string(ctx, value, &smcf->protocol);
+    ngx_http_stat_main_conf_t     *smcf;
+    ngx_http_core_loc_conf_t      *clcf;
+
+    smcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_stat_module);
+
+    if (!smcf->enable) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "stat config not set");
+        return NGX_CONF_ERROR;
+    }
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_stat_query_handler;
+
+    return NGX_CONF_OK;
 }
 
 
 static
 char *
-ngx_http_stat_config_arg_timeout(ngx_http_stat_ctx_t *ctx,
-        void *data, ngx_str_t *value)
+ngx_http_stat_memory(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_http_stat_main_conf_t *smcf = data;
-    smcf->timeout = ngx_atoi(value->data, value->len) * 1000;
+    ngx_http_stat_main_conf_t     *smcf;
+    ngx_http_core_loc_conf_t      *clcf;
+
+    smcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_stat_module);
+
+    if (!smcf->enable) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "stat config not set");
+        return NGX_CONF_ERROR;
+    }
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_stat_memory_handler;
+
     return NGX_CONF_OK;
 }
 
 
 static
 char *
-ngx_http_stat_config_arg_server(ngx_http_stat_ctx_t *ctx,
+ngx_http_stat_config_arg_host(ngx_http_stat_ctx_t *ctx,
         void *data, ngx_str_t *value)
 {
     ngx_http_stat_main_conf_t *smcf = data;
-    return ngx_http_stat_parse_string(ctx, value, &smcf->server.name);
+    return ngx_http_stat_parse_string(ctx, value, &smcf->host);
 }
 
-
 static
 char *
-ngx_http_stat_config_arg_port(ngx_http_stat_ctx_t *ctx,
+ngx_http_stat_sink_arg_protocol(ngx_http_stat_ctx_t *ctx,
         void *data, ngx_str_t *value)
 {
-    ngx_http_stat_main_conf_t *smcf = data;
-    smcf->port = ngx_atoi(value->data, value->len);
-
-    return NGX_CONF_OK;
+    ngx_http_stat_sink_t *sink = data;
+    return ngx_http_stat_parse_string(ctx, value, &sink->protocol);
 }
 
 
 static
 char *
-ngx_http_stat_config_arg_frequency(ngx_http_stat_ctx_t *ctx,
+ngx_http_stat_sink_arg_timeout(ngx_http_stat_ctx_t *ctx,
         void *data, ngx_str_t *value)
 {
-    ngx_http_stat_main_conf_t *smcf = data;
-    smcf->frequency = ngx_atoi(value->data, value->len) * 1000;
-
+    ngx_http_stat_sink_t *sink = data;
+    sink->timeout = ngx_atoi(value->data, value->len) * 1000;
     return NGX_CONF_OK;
 }
 
 
 static
 char *
-ngx_http_stat_config_arg_intervals(ngx_http_stat_ctx_t *ctx,
+ngx_http_stat_sink_arg_queue(ngx_http_stat_ctx_t *ctx,
         void *data, ngx_str_t *value)
 {
-    ngx_http_stat_main_conf_t   *smcf;
-    ngx_http_stat_allocator_t   *allocator;
-    ngx_uint_t                   i, s;
-    ngx_http_stat_interval_t    *interval;
+    ngx_http_stat_sink_t *sink = data;
+    return ngx_http_stat_parse_size(ctx, value, &sink->queue_size);
+}
 
-    smcf = data;
-    allocator = ctx->storage->allocator;
-    s = 0;
 
-    for (i = 0; i <= value->len; i++) {
+static
+char *
+ngx_http_stat_sink_arg_drop(ngx_http_stat_ctx_t *ctx,
+        void *data, ngx_str_t *value)
+{
+    ngx_http_stat_sink_t *sink = data;
+
+    if (value->len == sizeof("newest") - 1 &&
+            ngx_strncmp(value->data, "newest", value->len) == 0)
+    {
+        sink->drop = DROP_NEWEST;
+
+    } else if (value->len == sizeof("oldest") - 1 &&
+            ngx_strncmp(value->data, "oldest", value->len) == 0)
+    {
+        sink->drop = DROP_OLDEST;
+
+    } else {
+        ngx_log_error(NGX_LOG_ERR, ctx->log, 0,
+                "stat config drop must be \"newest\" or \"oldest\"");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static
+char *
+ngx_http_stat_sink_arg_backoff(ngx_http_stat_ctx_t *ctx,
+        void *data, ngx_str_t *value)
+{
+    ngx_http_stat_sink_t *sink = data;
+
+    if (ngx_http_stat_parse_time(ctx, value, &sink->backoff)
+            == NGX_CONF_ERROR)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    sink->backoff *= 1000;
+
+    return NGX_CONF_OK;
+}
+
+
+static
+char *
+ngx_http_stat_sink_arg_uri(ngx_http_stat_ctx_t *ctx,
+        void *data, ngx_str_t *value)
+{
+    ngx_http_stat_sink_t *sink = data;
+    return ngx_http_stat_parse_string(ctx, value, &sink->uri);
+}
+
+
+static
+char *
+ngx_http_stat_sink_arg_batch(ngx_http_stat_ctx_t *ctx,
+        void *data, ngx_str_t *value)
+{
+    ngx_http_stat_sink_t *sink = data;
+    return ngx_http_stat_parse_size(ctx, value, &sink->batch_size);
+}
+
+
+static
+char *
+ngx_http_stat_sink_arg_inflight(ngx_http_stat_ctx_t *ctx,
+        void *data, ngx_str_t *value)
+{
+    ngx_http_stat_sink_t *sink = data;
+    sink->inflight = ngx_atoi(value->data, value->len);
+
+    return NGX_CONF_OK;
+}
+
+
+static
+char *
+ngx_http_stat_sink_arg_gzip(ngx_http_stat_ctx_t *ctx,
+        void *data, ngx_str_t *value)
+{
+    ngx_http_stat_sink_t *sink = data;
+    sink->gzip = ngx_atoi(value->data, value->len);
+
+    return NGX_CONF_OK;
+}
+
+
+static
+char *
+ngx_http_stat_sink_arg_fields(ngx_http_stat_ctx_t *ctx,
+        void *data, ngx_str_t *value)
+{
+    ngx_http_stat_sink_t *sink = data;
+
+    if (value->len == sizeof("single") - 1 &&
+            ngx_strncmp(value->data, "single", value->len) == 0)
+    {
+        sink->fields = FIELDS_SINGLE;
+
+    } else if (value->len == sizeof("multi") - 1 &&
+            ngx_strncmp(value->data, "multi", value->len) == 0)
+    {
+        sink->fields = FIELDS_MULTI;
+
+    } else {
+        ngx_log_error(NGX_LOG_ERR, ctx->log, 0,
+                "stat config fields must be \"single\" or \"multi\"");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static
+char *
+ngx_http_stat_sink_arg_suppress(ngx_http_stat_ctx_t *ctx,
+        void *data, ngx_str_t *value)
+{
+    ngx_http_stat_sink_t *sink = data;
+
+    if (value->len == sizeof("off") - 1 &&
+            ngx_strncmp(value->data, "off", value->len) == 0)
+    {
+        sink->suppress = SUPPRESS_OFF;
+
+    } else if (value->len == sizeof("zero") - 1 &&
+            ngx_strncmp(value->data, "zero", value->len) == 0)
+    {
+        sink->suppress = SUPPRESS_ZERO;
+
+    } else if (value->len == sizeof("unchanged") - 1 &&
+            ngx_strncmp(value->data, "unchanged", value->len) == 0)
+    {
+        sink->suppress = SUPPRESS_UNCHANGED;
+
+    } else {
+        ngx_log_error(NGX_LOG_ERR, ctx->log, 0,
+                "stat config suppress must be \"off\", \"zero\" "
+                "or \"unchanged\"");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static
+char *
+ngx_http_stat_sink_arg_keyframe(ngx_http_stat_ctx_t *ctx,
+        void *data, ngx_str_t *value)
+{
+    ngx_http_stat_sink_t *sink = data;
+    return ngx_http_stat_parse_time(ctx, value, &sink->keyframe);
+}
+
+static
+char *
+ngx_http_stat_sink_arg_spool(ngx_http_stat_ctx_t *ctx,
+        void *data, ngx_str_t *value)
+{
+    ngx_http_stat_sink_t *sink = data;
+    return ngx_http_stat_parse_string(ctx, value, &sink->spool.path);
+}
+
+static
+char *
+ngx_http_stat_sink_arg_spool_size(ngx_http_stat_ctx_t *ctx,
+        void *data, ngx_str_t *value)
+{
+    ngx_http_stat_sink_t *sink = data;
+    return ngx_http_stat_parse_size(ctx, value, &sink->spool.size);
+}
+
+static
+char *
+ngx_http_stat_sink_arg_spool_rate(ngx_http_stat_ctx_t *ctx,
+        void *data, ngx_str_t *value)
+{
+    ngx_http_stat_sink_t *sink = data;
+    sink->spool.rate = ngx_atoi(value->data, value->len);
+
+    return NGX_CONF_OK;
+}
+
+static
+char *
+ngx_http_stat_sink_arg_resolve(ngx_http_stat_ctx_t *ctx,
+        void *data, ngx_str_t *value)
+{
+    ngx_http_stat_sink_t *sink = data;
+
+    if (ngx_http_stat_parse_time(ctx, value, &sink->resolve)
+            == NGX_CONF_ERROR)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    sink->resolve *= 1000;
+
+    return NGX_CONF_OK;
+}
+
+
+static
+char *
+ngx_http_stat_sink_arg_server(ngx_http_stat_ctx_t *ctx,
+        void *data, ngx_str_t *value)
+{
+    ngx_http_stat_sink_t *sink = data;
+    return ngx_http_stat_parse_string(ctx, value, &sink->server.name);
+}
+
+
+static
+char *
+ngx_http_stat_sink_arg_port(ngx_http_stat_ctx_t *ctx,
+        void *data, ngx_str_t *value)
+{
+    ngx_http_stat_sink_t *sink = data;
+    sink->port = ngx_atoi(value->data, value->len);
+
+    return NGX_CONF_OK;
+}
+
+
+static
+char *
+ngx_http_stat_sink_arg_frequency(ngx_http_stat_ctx_t *ctx,
+        void *data, ngx_str_t *value)
+{
+    ngx_http_stat_sink_t *sink = data;
+    sink->frequency = ngx_atoi(value->data, value->len) * 1000;
+
+    return NGX_CONF_OK;
+}
+
+
+static
+char *
+ngx_http_stat_config_arg_intervals(ngx_http_stat_ctx_t *ctx,
+        void *data, ngx_str_t *value)
+{
+    ngx_http_stat_main_conf_t   *smcf;
+    ngx_http_stat_allocator_t   *allocator;
+    ngx_uint_t                   i, s;
+    ngx_http_stat_interval_t    *interval;
+
+    smcf = data;
+    allocator = ctx->storage->allocator;
+    s = 0;
+
+    for (i = 0; i <= value->len; i++) {
 
         if (i == value->len || value->data[i] == '|') {
 
@@ -1718,35 +2579,141 @@ ngx_http_stat_config_arg_shared(ngx_http_stat_ctx_t *ctx, void *conf,
         ngx_str_t *value)
 {
     ngx_http_stat_main_conf_t *smcf = conf;
+
+    if (value->len == sizeof("auto") - 1 &&
+            ngx_strncmp(value->data, "auto", value->len) == 0)
+    {
+        /* sized in postconfiguration, when all the series are known */
+        smcf->shared_auto = 1;
+        smcf->shared_size = 8 * ngx_pagesize;
+
+        return NGX_CONF_OK;
+    }
+
+    smcf->shared_auto = 0;
+
     return ngx_http_stat_parse_size(ctx, value, &smcf->shared_size);
 }
 
 static
 char *
-ngx_http_stat_config_arg_buffer(ngx_http_stat_ctx_t *ctx, void *conf,
+ngx_http_stat_config_arg_shared_headroom(ngx_http_stat_ctx_t *ctx,
+        void *conf, ngx_str_t *value)
+{
+    ngx_http_stat_main_conf_t *smcf = conf;
+    return ngx_http_stat_parse_size(ctx, value, &smcf->shared_headroom);
+}
+
+static
+char *
+ngx_http_stat_config_arg_thread_pool(ngx_http_stat_ctx_t *ctx, void *conf,
         ngx_str_t *value)
 {
     ngx_http_stat_main_conf_t *smcf = conf;
-    return ngx_http_stat_parse_size(ctx, value, &smcf->buffer_size);
+    return ngx_http_stat_parse_string(ctx, value, &smcf->thread_pool_name);
 }
 
 static
 char *
-ngx_http_stat_config_arg_package(ngx_http_stat_ctx_t *ctx, void *conf,
+ngx_http_stat_config_arg_self(ngx_http_stat_ctx_t *ctx, void *conf,
         ngx_str_t *value)
 {
     ngx_http_stat_main_conf_t *smcf = conf;
-    return ngx_http_stat_parse_size(ctx, value, &smcf->package_size);
+
+    if (value->len == sizeof("on") - 1 &&
+            ngx_strncmp(value->data, "on", value->len) == 0)
+    {
+        smcf->self = 1;
+
+    } else if (value->len == sizeof("off") - 1 &&
+            ngx_strncmp(value->data, "off", value->len) == 0)
+    {
+        smcf->self = 0;
+
+    } else {
+        ngx_log_error(NGX_LOG_ERR, ctx->log, 0,
+                "stat config self must be \"on\" or \"off\"");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
 }
 
 static
 char *
-ngx_http_stat_config_arg_template(ngx_http_stat_ctx_t *ctx, void *conf,
+ngx_http_stat_config_arg_checkpoint(ngx_http_stat_ctx_t *ctx, void *conf,
         ngx_str_t *value)
 {
     ngx_http_stat_main_conf_t *smcf = conf;
+    return ngx_http_stat_parse_string(ctx, value, &smcf->checkpoint.path);
+}
+
+static
+char *
+ngx_http_stat_config_arg_checkpoint_frequency(ngx_http_stat_ctx_t *ctx,
+        void *conf, ngx_str_t *value)
+{
+    ngx_http_stat_main_conf_t *smcf = conf;
+
+    if (ngx_http_stat_parse_time(ctx, value, &smcf->checkpoint.frequency)
+            == NGX_CONF_ERROR || smcf->checkpoint.frequency == 0)
+    {
+        ngx_log_error(NGX_LOG_ERR, ctx->log, 0,
+                "stat config checkpoint_frequency must be positive time");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+static
+char *
+ngx_http_stat_config_arg_exit_flush(ngx_http_stat_ctx_t *ctx, void *conf,
+        ngx_str_t *value)
+{
+    ngx_uint_t                  timeout;
+    ngx_http_stat_main_conf_t  *smcf = conf;
+
+    if (ngx_http_stat_parse_time(ctx, value, &timeout) == NGX_CONF_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, ctx->log, 0,
+                "stat config exit_flush must be time");
+        return NGX_CONF_ERROR;
+    }
+
+    smcf->exit_flush = timeout * 1000;
+
+    return NGX_CONF_OK;
+}
+
+static
+char *
+ngx_http_stat_sink_arg_buffer(ngx_http_stat_ctx_t *ctx, void *conf,
+        ngx_str_t *value)
+{
+    ngx_log_error(NGX_LOG_WARN, ctx->log, 0,
+            "stat config buffer is obsolete, series are serialized "
+            "in package or batch sized chunks");
 
-    return ngx_http_stat_template_compile(ctx, smcf->template,
+    return NGX_CONF_OK;
+}
+
+static
+char *
+ngx_http_stat_sink_arg_package(ngx_http_stat_ctx_t *ctx, void *conf,
+        ngx_str_t *value)
+{
+    ngx_http_stat_sink_t *sink = conf;
+    return ngx_http_stat_parse_size(ctx, value, &sink->package_size);
+}
+
+static
+char *
+ngx_http_stat_sink_arg_template(ngx_http_stat_ctx_t *ctx, void *conf,
+        ngx_str_t *value)
+{
+    ngx_http_stat_sink_t *sink = conf;
+
+    return ngx_http_stat_template_compile(ctx, sink->template,
             ngx_http_stat_template_args,
             ARR_SIZE(ngx_http_stat_template_args),
             value);
@@ -1994,7 +2961,7 @@ ngx_http_stat_add_data(ngx_conf_t *cf, ngx_array_t *datas,
 
         p = ((ngx_uint_t*)params->elts)[i];
 
-        param = &((ngx_http_stat_param_t*)smcf->storage->params->elts)[p];
+        param = ngx_http_stat_array_get(smcf->storage->params, p);
 
         if (param->source != SOURCE_INTERNAL) {
 
@@ -2528,161 +3495,663 @@ ngx_http_stat_complex_compile(ngx_conf_t *cf, ngx_str_t *value)
 {
     ngx_http_compile_complex_value_t ccv;
 
-    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+    ccv.cf = cf;
+    ccv.value = value;
+    ccv.complex_value = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+    if (ccv.complex_value == NULL) {
+        return NULL;
+    }
+
+    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+        return NULL;
+    }
+
+    return ccv.complex_value;
+}
+
+
+/** Returns the zone size the allocations of ngx_http_stat_shared_init take:
+ *  small ones are rounded up to the slot sizes of the slab allocator and
+ *  packed into the pages of their slot, the others take whole pages.
+ */
+static
+size_t
+ngx_http_stat_shared_size(ngx_http_stat_main_conf_t *smcf, ngx_str_t *name)
+{
+    size_t                       ring, region, left, block, sizes[8];
+    ngx_uint_t                   i, n, nslots, shift, pages, per_page;
+    ngx_uint_t                   nmetrics, nstatistics, chunks[64];
+    ngx_http_stat_sink_t        *sink;
+    ngx_http_stat_array_t       *arrays[4];
+    ngx_http_stat_storage_t     *storage;
+
+    storage = smcf->storage;
+
+    nslots = ngx_pagesize_shift - NGX_HTTP_STAT_SLAB_MIN_SHIFT;
+    nmetrics = smcf->intervals->nelts * storage->metrics->nelts;
+    nstatistics = storage->statistics->nelts;
+
+    ngx_memzero(chunks, sizeof(chunks));
+    pages = 0;
+
+    /* the name of the zone for the "no memory" messages */
+    ngx_http_stat_shared_alloc(chunks, &pages,
+            sizeof(" in zone \"\"") + name->len);
+
+    ngx_http_stat_shared_alloc(chunks, &pages,
+            sizeof(ngx_http_stat_storage_t));
+    ngx_http_stat_shared_alloc(chunks, &pages,
+            sizeof(ngx_atomic_t) * smcf->sinks->nelts);
+    ngx_http_stat_shared_alloc(chunks, &pages,
+            sizeof(ngx_http_stat_history_t) * smcf->sinks->nelts);
+
+    for (i = 0; i < smcf->sinks->nelts; i++) {
+
+        sink = &((ngx_http_stat_sink_t *) smcf->sinks->elts)[i];
+
+        if (sink->suppress != SUPPRESS_OFF) {
+            ngx_http_stat_shared_alloc(chunks, &pages,
+                    sizeof(ngx_http_stat_sent_t) * (nmetrics + 1));
+            ngx_http_stat_shared_alloc(chunks, &pages,
+                    sizeof(ngx_http_stat_sent_t) * (nstatistics + 1));
+        }
+    }
+
+    ngx_http_stat_shared_alloc(chunks, &pages,
+            sizeof(ngx_http_stat_allocator_t));
+    ngx_http_stat_shared_alloc(chunks, &pages,
+            sizeof(ngx_http_stat_arena_t));
+
+    arrays[0] = storage->metrics;
+    arrays[1] = storage->statistics;
+    arrays[2] = storage->params;
+    arrays[3] = storage->internals;
+
+    /*
+     * the arrays are the first blocks of the arena, the elements of all but
+     * the internals stay out of the zone unless there are none of them
+     */
+
+    for (i = 0; i < 4; i++) {
+
+        sizes[2 * i] = sizeof(ngx_http_stat_array_t);
+        sizes[2 * i + 1] = (i == 3 || arrays[i]->nelts == 0)
+                           ? arrays[i]->nalloc * arrays[i]->size : 0;
+    }
+
+    ring = sizeof(ngx_http_stat_acc_t) * (storage->max_interval + 1);
+    region = ngx_http_stat_arena_region(ring);
+    left = 0;
+
+    for (n = 0; n < 8; n++) {
+
+        if (sizes[n] == 0) {
+            continue;
+        }
+
+        block = ngx_http_stat_arena_block(ring, sizes[n]);
+
+        if (block == 0) {
+            ngx_http_stat_shared_alloc(chunks, &pages,
+                    NGX_HTTP_STAT_ARENA_HEADER + sizes[n]);
+            continue;
+        }
+
+        if (block > left) {
+            ngx_http_stat_shared_alloc(chunks, &pages, region);
+            left = region;
+        }
+
+        left -= block;
+    }
+
+    ngx_http_stat_shared_alloc(chunks, &pages, ngx_align(ring
+            * storage->metrics->nelts, ngx_pagesize));
+    ngx_http_stat_shared_alloc(chunks, &pages,
+            ngx_align(sizeof(ngx_http_stat_stt_t) * nstatistics, ngx_pagesize));
+
+    for (i = 0; i < nslots; i++) {
+
+        if (chunks[i] == 0) {
+            continue;
+        }
+
+        shift = NGX_HTTP_STAT_SLAB_MIN_SHIFT + i;
+        per_page = ngx_pagesize >> shift;
+
+        /* the slots smaller than a bitmap word keep the bitmap in the page */
+        if (per_page > 8 * sizeof(uintptr_t)) {
+            n = per_page / ((1 << shift) * 8);
+            per_page -= n ? n : 1;
+        }
+
+        pages += (chunks[i] + per_page - 1) / per_page;
+    }
+
+    /* the pool, its slots and statistics, a page kept for the alignment */
+    return sizeof(ngx_slab_pool_t)
+        + nslots * (sizeof(ngx_slab_page_t) + sizeof(ngx_slab_stat_t))
+        + (pages + 1) * (ngx_pagesize + sizeof(ngx_slab_page_t));
+}
+
+
+static
+void
+ngx_http_stat_shared_alloc(ngx_uint_t *chunks, ngx_uint_t *pages,
+        size_t size)
+{
+    ngx_uint_t shift;
+
+    if (size > ngx_pagesize / 2) {
+        *pages += (size + ngx_pagesize - 1) / ngx_pagesize;
+        return;
+    }
+
+    for (shift = NGX_HTTP_STAT_SLAB_MIN_SHIFT;
+         ((size_t) 1 << shift) < size;
+         shift++)
+    {
+        /* void */
+    }
+
+    chunks[shift - NGX_HTTP_STAT_SLAB_MIN_SHIFT]++;
+}
+
+
+static
+ngx_int_t
+ngx_http_stat_shared_init(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_stat_main_conf_t *smcf = shm_zone->data;
+
+    size_t                       shared_required_size;
+    ngx_uint_t                   m, s, i, nmetrics;
+    ngx_slab_pool_t             *shpool;
+    ngx_http_stat_sink_t        *sink;
+    ngx_http_stat_storage_t     *storage;
+    ngx_http_stat_history_t     *history;
+    ngx_http_stat_allocator_t   *allocator;
+    ngx_http_stat_arena_t       *arena;
+    u_char                      *accs, *stts;
+    ngx_http_stat_metric_t      *metric;
+    ngx_http_stat_statistic_t   *statistic;
+    ngx_http_stat_param_t       *param;
+
+    if (data) {
+        ngx_log_error(NGX_LOG_ERR, shm_zone->shm.log, 0,
+                "stat shared memory data set");
+        return NGX_ERROR;
+    }
+
+    nmetrics = smcf->intervals->nelts * smcf->storage->metrics->nelts;
+
+    shared_required_size = ngx_http_stat_shared_size(smcf,
+            &shm_zone->shm.name);
+
+    if (shared_required_size > shm_zone->shm.size) {
+        ngx_log_error(NGX_LOG_ERR, shm_zone->shm.log, 0,
+                "stat too small shared memory (minimum size is %uzb)",
+                shared_required_size);
+        return NGX_ERROR;
+    }
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        ngx_log_error(NGX_LOG_ERR, shm_zone->shm.log, 0,
+                "stat shared memory exists");
+        return NGX_ERROR;
+    }
+
+    storage = ngx_slab_alloc(shpool, sizeof(ngx_http_stat_storage_t));
+    if (storage == NULL) {
+        return NGX_ERROR;
+    }
+
+    shpool->data = storage;
+
+    ngx_memzero(storage, sizeof(ngx_http_stat_storage_t));
+
+    storage->max_interval = smcf->storage->max_interval;
+
+    storage->start_time = ngx_time();
+    storage->last_time = storage->start_time;
+    storage->checkpoint_time = storage->start_time;
+
+    storage->event_times = ngx_slab_alloc(shpool,
+            sizeof(ngx_atomic_t) * smcf->sinks->nelts);
+    if (storage->event_times == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < smcf->sinks->nelts; i++) {
+        storage->event_times[i] = storage->start_time;
+    }
+
+    storage->histories = ngx_slab_calloc(shpool,
+            sizeof(ngx_http_stat_history_t) * smcf->sinks->nelts);
+    if (storage->histories == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < smcf->sinks->nelts; i++) {
+
+        sink = &((ngx_http_stat_sink_t *) smcf->sinks->elts)[i];
+
+        if (sink->suppress == SUPPRESS_OFF) {
+            continue;
+        }
+
+        history = &storage->histories[i];
+
+        /* the series registered at runtime extend the tables on export */
+
+        history->metrics = ngx_slab_calloc(shpool,
+                sizeof(ngx_http_stat_sent_t) * (nmetrics + 1));
+        history->statistics = ngx_slab_calloc(shpool,
+                sizeof(ngx_http_stat_sent_t) *
+                (smcf->storage->statistics->nelts + 1));
+
+        if (history->metrics == NULL || history->statistics == NULL) {
+            return NGX_ERROR;
+        }
+
+        history->nmetrics = nmetrics;
+        history->nstatistics = smcf->storage->statistics->nelts;
+    }
+
+    allocator = ngx_slab_alloc(shpool, sizeof(ngx_http_stat_allocator_t));
+    arena = ngx_slab_alloc(shpool, sizeof(ngx_http_stat_arena_t));
+    if (allocator == NULL || arena == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* the acc rings and the states of the series registered at run time
+     * get a class */
+
+    ngx_http_stat_arena_init(arena, shpool,
+            sizeof(ngx_http_stat_acc_t) * (smcf->storage->max_interval + 1),
+            sizeof(ngx_http_stat_stt_t));
+
+    ngx_http_stat_allocator_init(allocator,
+            arena, ngx_http_stat_allocator_arena_alloc,
+            ngx_http_stat_allocator_arena_free);
+
+    /*
+     * the params, metrics and statistics of the config are never written
+     * after the zone is created, they stay in the pool of the cycle, which
+     * every worker inherits, and only those registered at run time go to
+     * the zone; the internals are kept sorted, so they are copied as is
+     */
+
+    storage->allocator = allocator;
+    storage->metrics = ngx_http_stat_array_copy_private(storage->allocator,
+            smcf->storage->allocator, smcf->storage->metrics);
+    storage->statistics = ngx_http_stat_array_copy_private(
+            storage->allocator, smcf->storage->allocator,
+            smcf->storage->statistics);
+    storage->params = ngx_http_stat_array_copy_private(storage->allocator,
+            smcf->storage->allocator, smcf->storage->params);
+    storage->internals = ngx_http_stat_array_copy(storage->allocator,
+            smcf->storage->internals);
+
+    if (!storage->metrics || !storage->statistics || !storage->params ||
+            !storage->internals)
+    {
+        return NGX_ERROR;
+    }
+
+    /* whole pages, so no other block shares the lines written by requests */
+
+    accs = ngx_slab_calloc(shpool, ngx_align(sizeof(ngx_http_stat_acc_t) *
+            (smcf->storage->max_interval + 1) * smcf->storage->metrics->nelts,
+            ngx_pagesize));
+    if (accs == NULL) {
+        return NGX_ERROR;
+    }
+
+    stts = ngx_slab_calloc(shpool, ngx_align(sizeof(ngx_http_stat_stt_t)
+            * smcf->storage->statistics->nelts, ngx_pagesize));
+    if (stts == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (m = 0; m < storage->metrics->nelts; m++) {
+
+        metric = ngx_http_stat_array_get(storage->metrics, m);
+        metric->acc = (ngx_http_stat_acc_t *)(accs +
+            sizeof(ngx_http_stat_acc_t) * (smcf->storage->max_interval + 1) *
+            m);
+    }
+
+    for (s = 0; s < storage->statistics->nelts; s++) {
+
+        statistic = ngx_http_stat_array_get(storage->statistics, s);
+
+        param = ngx_http_stat_array_get(storage->params, statistic->param);
+
+        statistic->stt = (ngx_http_stat_stt_t*)(
+                stts + sizeof(ngx_http_stat_stt_t) * s);
+
+        ngx_http_stat_statistic_init(statistic->stt, param->percentile);
+    }
+
+    /* a reload takes the values over, a start loads the checkpoint */
+
+    if (ngx_http_stat_shared_migrate(shm_zone) == NGX_DECLINED
+            && smcf->checkpoint.path.len)
+    {
+        ngx_http_stat_checkpoint_load(smcf, shm_zone->shm.log);
+    }
+
+    return NGX_OK;
+}
+
+
+/** Takes over the values of the zone of the previous cycle, the metrics and
+ *  the statistics are matched by split and param, so a reload neither loses
+ *  the accumulated intervals nor depends on the order of the config.
+ *  The old workers keep writing to the old zone till they exit. Once
+ *  ngx_http_stat_init_module marks it as migrated, the old exporter neither
+ *  exports nor checkpoints it, but its final export sends the seconds
+ *  recorded after the copy.
+ */
+static ngx_int_t
+ngx_http_stat_shared_migrate(ngx_shm_zone_t *shm_zone)
+{
+    ngx_http_stat_main_conf_t *smcf = shm_zone->data;
+
+    time_t                       now, from, t;
+    ngx_uint_t                   i, m, s, nmetrics, nstatistics, max, omax;
+    ngx_pool_t                  *pool;
+    ngx_list_part_t             *part;
+    ngx_shm_zone_t              *zone;
+    ngx_slab_pool_t             *shpool, *oshpool;
+    ngx_http_stat_key_t         *keys, *key;
+    ngx_http_stat_metric_t      *metric, *ometric;
+    ngx_http_stat_storage_t     *storage, *ostorage;
+    ngx_http_stat_statistic_t   *statistic, *ostatistic;
+    ngx_http_stat_main_conf_t   *osmcf;
+
+    /* the cycle is not switched yet, so it is still the previous one */
+
+    part = (ngx_list_part_t *) &ngx_cycle->shared_memory.part;
+    zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                return NGX_DECLINED;
+            }
+
+            part = part->next;
+            zone = part->elts;
+            i = 0;
+        }
+
+        if (zone[i].tag == shm_zone->tag
+                && zone[i].shm.name.len == shm_zone->shm.name.len
+                && ngx_strncmp(zone[i].shm.name.data, shm_zone->shm.name.data,
+                    shm_zone->shm.name.len) == 0)
+        {
+            break;
+        }
+    }
+
+    osmcf = zone[i].data;
+    oshpool = (ngx_slab_pool_t *) zone[i].shm.addr;
+    ostorage = (ngx_http_stat_storage_t *) oshpool->data;
+
+    if (osmcf == NULL || ostorage == NULL) {
+        return NGX_DECLINED;
+    }
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    storage = (ngx_http_stat_storage_t *) shpool->data;
+
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, shm_zone->shm.log);
+    if (pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    keys = ngx_palloc(pool, sizeof(ngx_http_stat_key_t) *
+            (ostorage->metrics->nelts + ostorage->statistics->nelts + 1));
+    if (keys == NULL) {
+        ngx_destroy_pool(pool);
+        return NGX_ERROR;
+    }
+
+    nmetrics = 0;
+    nstatistics = 0;
+    now = ngx_time();
+
+    /** Lock {{{ */
+    ngx_shmtx_lock(&oshpool->mutex);
+
+    ngx_http_stat_gc(osmcf, now);
+
+    /* the params and the metrics of a storage grow only under its lock */
+
+    for (m = 0; m < ostorage->metrics->nelts; m++) {
+
+        ometric = ngx_http_stat_array_get(ostorage->metrics, m);
+
+        key = &keys[m];
+        key->index = m;
+        key->hash = ngx_http_stat_shared_key(osmcf, ostorage, ometric->split,
+                ometric->param);
+    }
+
+    ngx_qsort(keys, ostorage->metrics->nelts, sizeof(ngx_http_stat_key_t),
+            ngx_http_stat_shared_key_cmp);
+
+    max = storage->max_interval;
+    omax = ostorage->max_interval;
+
+    /* both rings cover the same seconds, only the length differs */
+
+    from = ostorage->last_time;
+
+    if (from < now - (time_t) max) {
+        from = now - (time_t) max;
+    }
+
+    storage->start_time = ostorage->start_time;
+    storage->last_time = from;
+
+    for (m = 0; m < storage->metrics->nelts; m++) {
+
+        metric = ngx_http_stat_array_get(storage->metrics, m);
+
+        key = ngx_http_stat_shared_lookup(keys, ostorage->metrics->nelts,
+                smcf, storage, metric->split, metric->param,
+                osmcf, ostorage, ostorage->metrics);
+        if (key == NULL) {
+            continue;
+        }
+
+        ometric = ngx_http_stat_array_get(ostorage->metrics, key->index);
+
+        if (ometric->acc == NULL) {
+            continue;
+        }
+
+        for (t = from; t <= now; t++) {
+            metric->acc[(t - storage->start_time) % (max + 1)] =
+                ometric->acc[(t - ostorage->start_time) % (omax + 1)];
+        }
+
+        nmetrics++;
+    }
+
+    for (s = 0; s < ostorage->statistics->nelts; s++) {
+
+        ostatistic = ngx_http_stat_array_get(ostorage->statistics, s);
+
+        key = &keys[s];
+        key->index = s;
+        key->hash = ngx_http_stat_shared_key(osmcf, ostorage,
+                ostatistic->split, ostatistic->param);
+    }
+
+    ngx_qsort(keys, ostorage->statistics->nelts, sizeof(ngx_http_stat_key_t),
+            ngx_http_stat_shared_key_cmp);
+
+    for (s = 0; s < storage->statistics->nelts; s++) {
+
+        statistic = ngx_http_stat_array_get(storage->statistics, s);
+
+        key = ngx_http_stat_shared_lookup(keys, ostorage->statistics->nelts,
+                smcf, storage, statistic->split, statistic->param,
+                osmcf, ostorage, ostorage->statistics);
+        if (key == NULL) {
+            continue;
+        }
+
+        ostatistic = ngx_http_stat_array_get(ostorage->statistics, key->index);
+
+        if (ostatistic->stt == NULL) {
+            continue;
+        }
+
+        *statistic->stt = *ostatistic->stt;
 
-    ccv.cf = cf;
-    ccv.value = value;
-    ccv.complex_value = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
-    if (ccv.complex_value == NULL) {
-        return NULL;
+        nstatistics++;
     }
 
-    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
-        return NULL;
-    }
+    /* the old zone is marked once the new cycle is committed */
 
-    return ccv.complex_value;
+    smcf->previous = oshpool;
+    smcf->migrate_time = now;
+
+    ngx_shmtx_unlock(&oshpool->mutex);
+    /** }}} */
+
+    ngx_destroy_pool(pool);
+
+    ngx_log_error(NGX_LOG_NOTICE, shm_zone->shm.log, 0,
+            "stat took over %ui of %ui metrics and %ui of %ui statistics "
+            "of the previous zone", nmetrics, storage->metrics->nelts,
+            nstatistics, storage->statistics->nelts);
+
+    return NGX_OK;
 }
 
 
-static
-ngx_int_t
-ngx_http_stat_shared_init(ngx_shm_zone_t *shm_zone, void *data)
+/** The identity of a metric or a statistic of a storage: the name of its
+ *  split, the name of its param and the percentile.
+ */
+uint32_t
+ngx_http_stat_shared_key(ngx_http_stat_main_conf_t *smcf,
+        ngx_http_stat_storage_t *storage, ngx_uint_t split, ngx_uint_t param)
 {
-    ngx_http_stat_main_conf_t *smcf = shm_zone->data;
+    uint32_t                crc;
+    ngx_str_t              *name;
+    ngx_http_stat_param_t  *p;
 
-    ngx_uint_t                   shared_required_size, buffer_required_size, m,
-                                 s;
-    ngx_slab_pool_t             *shpool;
-    ngx_http_stat_storage_t     *storage;
-    ngx_http_stat_allocator_t   *allocator;
-    u_char                      *accs, *stts;
-    ngx_http_stat_metric_t      *metric;
-    ngx_http_stat_statistic_t   *statistic;
-    ngx_http_stat_param_t       *param;
+    p = ngx_http_stat_array_get(storage->params, param);
 
-    if (data) {
-        ngx_log_error(NGX_LOG_ERR, shm_zone->shm.log, 0,
-                "stat shared memory data set");
-        return NGX_ERROR;
-    }
+    ngx_crc32_init(crc);
 
-    shared_required_size =
-        2 *
-        (sizeof(ngx_slab_pool_t) +
-        sizeof(ngx_http_stat_storage_t) +
-        sizeof(ngx_array_t) * 4 +
-        sizeof(ngx_http_stat_metric_t) * (smcf->storage->metrics->nelts) +
-        sizeof(ngx_http_stat_statistic_t) * (smcf->storage->statistics->nelts) +
-        sizeof(ngx_http_stat_param_t) * (smcf->storage->params->nelts) +
-        sizeof(ngx_http_stat_internal_t) * (smcf->storage->internals->nelts) +
-        sizeof(ngx_http_stat_acc_t) * (smcf->storage->max_interval + 1) *
-        smcf->storage->metrics->nelts +
-        sizeof(ngx_http_stat_stt_t) * smcf->storage->statistics->nelts);
+    if (split == SPLIT_INTERNAL) {
+        ngx_crc32_update(&crc, (u_char *) "\1", 1);
 
-    if (shared_required_size > shm_zone->shm.size) {
-        ngx_log_error(NGX_LOG_ERR, shm_zone->shm.log, 0,
-                "stat too small shared memory (minimum size is %uzb)",
-                shared_required_size);
-        return NGX_ERROR;
+    } else {
+        name = &((ngx_str_t *) smcf->splits->elts)[split];
+        ngx_crc32_update(&crc, name->data, name->len);
+        ngx_crc32_update(&crc, (u_char *) "\0", 1);
     }
 
-    /*
-     * 128 is the approximate size of the one record
-     */
-    buffer_required_size = (smcf->intervals->nelts *
-            smcf->storage->metrics->nelts + smcf->storage->statistics->nelts) *
-            128;
-    if (buffer_required_size > smcf->buffer_size) {
-        ngx_log_error(NGX_LOG_ERR, shm_zone->shm.log, 0,
-                "stat too small buffer size (minimum size is %uzb)",
-                buffer_required_size);
-        return NGX_ERROR;
-    }
+    ngx_crc32_update(&crc, p->name.data, p->name.len);
+    ngx_crc32_update(&crc, (u_char *) &p->percentile, sizeof(ngx_uint_t));
 
-    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    ngx_crc32_final(crc);
 
-    if (shm_zone->shm.exists) {
-        ngx_log_error(NGX_LOG_ERR, shm_zone->shm.log, 0,
-                "stat shared memory exists");
-        return NGX_ERROR;
-    }
+    return crc;
+}
 
-    storage = ngx_slab_alloc(shpool, sizeof(ngx_http_stat_storage_t));
-    if (storage == NULL) {
-        return NGX_ERROR;
+
+static int ngx_libc_cdecl
+ngx_http_stat_shared_key_cmp(const void *one, const void *two)
+{
+    const ngx_http_stat_key_t *a = one, *b = two;
+
+    if (a->hash != b->hash) {
+        return a->hash < b->hash ? -1 : 1;
     }
 
-    shpool->data = storage;
+    return 0;
+}
 
-    ngx_memzero(storage, sizeof(ngx_http_stat_storage_t));
 
-    storage->max_interval = smcf->storage->max_interval;
+/** Finds the old metric (or statistic, both start with split and param)
+ *  of the same identity, the names are compared on every hash match.
+ */
+static ngx_http_stat_key_t *
+ngx_http_stat_shared_lookup(ngx_http_stat_key_t *keys, ngx_uint_t n,
+        ngx_http_stat_main_conf_t *smcf, ngx_http_stat_storage_t *storage,
+        ngx_uint_t split, ngx_uint_t param, ngx_http_stat_main_conf_t *osmcf,
+        ngx_http_stat_storage_t *ostorage, ngx_http_stat_array_t *olds)
+{
+    uint32_t                 hash;
+    ngx_str_t               *name, *oname;
+    ngx_uint_t               lo, hi, mid, osplit;
+    ngx_http_stat_param_t   *p, *op;
+    ngx_http_stat_metric_t  *old;
 
-    storage->start_time = ngx_time();
-    storage->last_time = storage->start_time;
-    storage->event_time = storage->start_time;
+    hash = ngx_http_stat_shared_key(smcf, storage, split, param);
 
-    allocator = ngx_slab_alloc(shpool, sizeof(ngx_http_stat_allocator_t));
-    if (allocator == NULL) {
-        return NGX_ERROR;
-    }
+    lo = 0;
+    hi = n;
 
-    ngx_http_stat_allocator_init(allocator,
-            shpool, ngx_http_stat_allocator_slab_alloc,
-            ngx_http_stat_allocator_slab_free);
+    while (lo < hi) {
 
-    storage->allocator = allocator;
-    storage->metrics = ngx_http_stat_array_copy(storage->allocator,
-            smcf->storage->metrics);
-    storage->statistics = ngx_http_stat_array_copy(storage->allocator,
-            smcf->storage->statistics);
-    storage->params = ngx_http_stat_array_copy(storage->allocator,
-            smcf->storage->params);
-    storage->internals = ngx_http_stat_array_copy(storage->allocator,
-            smcf->storage->internals);
+        mid = lo + (hi - lo) / 2;
 
-    if (!storage->metrics || !storage->statistics || !storage->params ||
-            !storage->internals)
-    {
-        return NGX_ERROR;
-    }
+        if (keys[mid].hash < hash) {
+            lo = mid + 1;
 
-    accs = ngx_slab_calloc(shpool, sizeof(ngx_http_stat_acc_t) *
-            (smcf->storage->max_interval + 1) * smcf->storage->metrics->nelts);
-    if (accs == NULL) {
-        return NGX_ERROR;
+        } else {
+            hi = mid;
+        }
     }
 
-    stts = ngx_slab_calloc(shpool,
-            sizeof(ngx_http_stat_stt_t) * smcf->storage->statistics->nelts);
-    if (stts == NULL) {
-        return NGX_ERROR;
-    }
+    p = ngx_http_stat_array_get(storage->params, param);
 
-    for (m = 0; m < storage->metrics->nelts; m++) {
+    for ( /* void */ ; lo < n && keys[lo].hash == hash; lo++) {
 
-        metric = &((ngx_http_stat_metric_t *) storage->metrics->elts)[m];
-        metric->acc = (ngx_http_stat_acc_t *)(accs +
-            sizeof(ngx_http_stat_acc_t) * (smcf->storage->max_interval + 1) *
-            m);
-    }
+        old = ngx_http_stat_array_get(olds, keys[lo].index);
 
-    for (s = 0; s < storage->statistics->nelts; s++) {
+        osplit = old->split;
+        op = ngx_http_stat_array_get(ostorage->params, old->param);
+
+        if ((split == SPLIT_INTERNAL) != (osplit == SPLIT_INTERNAL)
+                || p->percentile != op->percentile
+                || p->name.len != op->name.len
+                || ngx_strncmp(p->name.data, op->name.data, p->name.len) != 0)
+        {
+            continue;
+        }
 
-        statistic = &(((ngx_http_stat_statistic_t*)
-                    storage->statistics->elts)[s]);
+        if (split != SPLIT_INTERNAL) {
 
-        param = &((ngx_http_stat_param_t*)
-                smcf->storage->params)[statistic->param];
+            name = &((ngx_str_t *) smcf->splits->elts)[split];
+            oname = &((ngx_str_t *) osmcf->splits->elts)[osplit];
 
-        statistic->stt = (ngx_http_stat_stt_t*)(
-                stts + sizeof(ngx_http_stat_stt_t) * s);
+            if (name->len != oname->len
+                    || ngx_strncmp(name->data, oname->data, name->len) != 0)
+            {
+                continue;
+            }
+        }
 
-        ngx_http_stat_statistic_init(statistic->stt, param->percentile);
+        return &keys[lo];
     }
 
-    return NGX_OK;
+    return NULL;
 }
 
 
@@ -2830,9 +4299,9 @@ ngx_http_stat_add_data_values(ngx_http_request_t *r,
 
     for (i = 0; i < data->metrics->nelts; i++) {
 
-        m = ((ngx_uint_t*) data->metrics->elts)[i];
-        metric = &((ngx_http_stat_metric_t*)storage->metrics->elts)[m];
-        param = &((ngx_http_stat_param_t*)storage->params->elts)[metric->param];
+        m = *(ngx_uint_t *) ngx_http_stat_array_get(data->metrics, i);
+        metric = ngx_http_stat_array_get(storage->metrics, m);
+        param = ngx_http_stat_array_get(storage->params, metric->param);
         value = (param->source != SOURCE_INTERNAL) ? values[param->source] :
             values[0];
         ngx_http_stat_add_metric(r, storage, metric, ts, value);
@@ -2840,9 +4309,9 @@ ngx_http_stat_add_data_values(ngx_http_request_t *r,
 
     for (i = 0; i < data->statistics->nelts; i++) {
 
-        s = ((ngx_uint_t*)data->statistics->elts)[i];
-        statistic = &((ngx_http_stat_statistic_t*)storage->statistics->elts)[s];
-        param = &((ngx_http_stat_param_t*)storage->params->elts)[statistic->param];
+        s = *(ngx_uint_t *) ngx_http_stat_array_get(data->statistics, i);
+        statistic = ngx_http_stat_array_get(storage->statistics, s);
+        param = ngx_http_stat_array_get(storage->params, statistic->param);
         value = (param->source != SOURCE_INTERNAL) ? values[param->source] :
             values[0];
         ngx_http_stat_add_statistic(r, storage, statistic, ts, value, param->percentile);
@@ -2878,6 +4347,7 @@ ngx_http_stat_handler(ngx_http_request_t *r)
     ngx_http_stat_storage_t       *storage;
     double                        *values;
     time_t                         ts;
+    uint64_t                       start, locked;
 
     smcf = ngx_http_get_module_main_conf(r, ngx_http_stat_module);
     sscf = ngx_http_get_module_srv_conf(r, ngx_http_stat_module);
@@ -2898,6 +4368,7 @@ ngx_http_stat_handler(ngx_http_request_t *r)
     storage = (ngx_http_stat_storage_t*) shpool->data;
 
     ts = ngx_time();
+    start = smcf->self ? ngx_http_stat_self_clock() : 0;
 
     values = ngx_http_stat_get_sources_values(smcf, r);
     if (values == NULL) {
@@ -2905,6 +4376,8 @@ ngx_http_stat_handler(ngx_http_request_t *r)
     }
 
     ngx_shmtx_lock(&shpool->mutex);
+    locked = smcf->self ? ngx_http_stat_self_clock() : 0;
+
     ngx_http_stat_gc(smcf, ts);
 
     if (r == r->main) {
@@ -2916,6 +4389,11 @@ ngx_http_stat_handler(ngx_http_request_t *r)
 
     ngx_shmtx_unlock(&shpool->mutex);
 
+    if (smcf->self) {
+        ngx_http_stat_self_record(smcf, start, locked,
+                ngx_http_stat_self_clock());
+    }
+
     return NGX_OK;
 }
 
@@ -2933,6 +4411,7 @@ ngx_http_stat(ngx_http_request_t *r, ngx_str_t *name, double value,
     ngx_array_t                   *args;
     ngx_http_stat_param_t          param;
     ngx_http_stat_internal_t      *internal;
+    uint64_t                       start, locked;
 
     ctx = ngx_http_stat_ctx_from_request(r);
     smcf = ctx.smcf;
@@ -2945,8 +4424,10 @@ ngx_http_stat(ngx_http_request_t *r, ngx_str_t *name, double value,
     storage = (ngx_http_stat_storage_t*) shpool->data;
 
     ts = ngx_time();
+    start = smcf->self ? ngx_http_stat_self_clock() : 0;
 
     ngx_shmtx_lock(&shpool->mutex);
+    locked = smcf->self ? ngx_http_stat_self_clock() : 0;
 
     ngx_http_stat_gc(smcf, ts);
 
@@ -2979,11 +4460,16 @@ ngx_http_stat(ngx_http_request_t *r, ngx_str_t *name, double value,
         }
     }
 
-    internal = &((ngx_http_stat_internal_t*) storage->internals->elts)[i];
+    internal = ngx_http_stat_array_get(storage->internals, i);
     ngx_http_stat_add_data_values(r, storage, ts, &internal->data, &value);
 
     ngx_shmtx_unlock(&shpool->mutex);
 
+    if (smcf->self) {
+        ngx_http_stat_self_record(smcf, start, locked,
+                ngx_http_stat_self_clock());
+    }
+
     return NGX_OK;
 }
 
@@ -3005,8 +4491,7 @@ ngx_http_stat_gc(ngx_http_stat_main_conf_t *smcf, time_t ts)
     {
         for (m = 0; m < storage->metrics->nelts; m++) {
 
-            metric = &(((ngx_http_stat_metric_t*)
-                        storage->metrics->elts)[m]);
+            metric = ngx_http_stat_array_get(storage->metrics, m);
 
             a = ((storage->last_time - storage->start_time) % (
                         storage->max_interval + 1));
@@ -3022,6 +4507,248 @@ ngx_http_stat_gc(ngx_http_stat_main_conf_t *smcf, time_t ts)
 }
 
 
+static
+ngx_uint_t
+ngx_http_stat_snapshot_match(ngx_http_stat_filter_t *filter, u_char *match,
+        ngx_uint_t split, ngx_str_t *name)
+{
+    if (filter == NULL) {
+        return 1;
+    }
+
+    if (match && (split == SPLIT_INTERNAL || !match[split])) {
+        return 0;
+    }
+
+    if (filter->param.len && (filter->param.len != name->len
+                || ngx_strncmp(filter->param.data, name->data, name->len)
+                != 0))
+    {
+        return 0;
+    }
+
+    return 1;
+}
+
+
+ngx_http_stat_series_t *
+ngx_http_stat_snapshot(ngx_http_stat_main_conf_t *smcf, ngx_pool_t *pool,
+        ngx_http_stat_filter_t *filter, ngx_uint_t reset, ngx_uint_t restart,
+        ngx_uint_t *n)
+{
+    time_t                       ts, from;
+    ngx_msec_t                   elapsed;
+    ngx_uint_t                   m, i, s, k, max, nintervals, nstts;
+    u_char                      *match;
+    ngx_time_t                  *tp;
+    ngx_str_t                   *split;
+    ngx_slab_pool_t             *shpool;
+    ngx_http_stat_storage_t     *storage;
+    ngx_http_stat_metric_t      *metric;
+    ngx_http_stat_statistic_t   *statistic;
+    ngx_http_stat_param_t       *param;
+    ngx_http_stat_interval_t    *interval;
+    ngx_http_stat_series_t      *series, *sr;
+    ngx_http_stat_stt_t         *stts;
+    uint64_t                     start, locked;
+
+    shpool = (ngx_slab_pool_t *) smcf->shared->shm.addr;
+    storage = (ngx_http_stat_storage_t *) shpool->data;
+
+    nintervals = (filter && filter->interval) ? 1 : smcf->intervals->nelts;
+
+    /*
+     * the sizes are read without the lock, so the series registered
+     * in between are skipped till the next snapshot
+     */
+    max = storage->metrics->nelts * nintervals + storage->statistics->nelts;
+
+    series = ngx_palloc(pool, sizeof(ngx_http_stat_series_t) * (max + 1));
+    if (series == NULL) {
+        return NULL;
+    }
+
+    /* estimator states of the statistics, encoders export them as is */
+
+    nstts = storage->statistics->nelts;
+
+    stts = ngx_palloc(pool, sizeof(ngx_http_stat_stt_t) * (nstts + 1));
+    if (stts == NULL) {
+        return NULL;
+    }
+
+    /* splits are known at config time, so they are matched before lock */
+
+    match = NULL;
+
+    if (filter && filter->split.len) {
+
+        match = ngx_pcalloc(pool, smcf->splits->nelts + 1);
+        if (match == NULL) {
+            return NULL;
+        }
+
+        for (i = 0; i < smcf->splits->nelts; i++) {
+
+            split = &((ngx_str_t *) smcf->splits->elts)[i];
+
+            match[i] = (split->len >= filter->split.len
+                    && ngx_strncmp(split->data, filter->split.data,
+                        filter->split.len) == 0);
+        }
+    }
+
+    k = 0;
+    tp = ngx_timeofday();
+    ts = tp->sec;
+    start = smcf->self ? ngx_http_stat_self_clock() : 0;
+
+    /*
+     * the exporter sends whole seconds only, a request also sees the
+     * current second so far
+     */
+    elapsed = reset ? 0 : tp->msec;
+
+    /*
+     * the final export of a zone taken over by a reload only sends what
+     * the old workers recorded after the copy, the new zone has the rest
+     */
+    from = (reset && storage->migrated) ? (time_t) storage->migrated : 0;
+
+    /** Lock {{{ */
+    ngx_shmtx_lock(&shpool->mutex);
+
+    locked = smcf->self ? ngx_http_stat_self_clock() : 0;
+
+    ngx_http_stat_gc(smcf, ts);
+
+    for (m = 0; m < storage->metrics->nelts; m++) {
+
+        metric = ngx_http_stat_array_get(storage->metrics, m);
+        param = ngx_http_stat_array_get(storage->params, metric->param);
+
+        if (metric->acc == NULL
+                || !ngx_http_stat_snapshot_match(filter, match,
+                    metric->split, &param->name))
+        {
+            continue;
+        }
+
+        for (i = 0; i < nintervals; i++) {
+
+            if (filter && filter->interval) {
+                interval = filter->interval;
+
+            } else if (metric->split == SPLIT_INTERNAL) {
+                if (i != 0) {
+                    break;
+                }
+
+                interval = &param->interval;
+
+            } else {
+                interval = &((ngx_http_stat_interval_t *)
+                        smcf->intervals->elts)[i];
+            }
+
+            if (k == max) {
+                goto done;
+            }
+
+            sr = &series[k++];
+
+            sr->split = metric->split;
+            sr->param = param->name;
+            sr->interval = interval->name;
+            sr->window = interval->value;
+            sr->percentile = 0;
+            sr->aggregate = param->aggregate;
+            sr->value = ngx_http_stat_metric_value(storage, metric->acc,
+                    param->aggregate, interval, ts, elapsed, from);
+            sr->stt = NULL;
+            sr->index = m * smcf->intervals->nelts + i;
+        }
+    }
+
+    for (s = 0; s < storage->statistics->nelts; s++) {
+
+        /* percentiles are not windowed, nor split at the copy */
+        if ((filter && filter->interval) || from) {
+            break;
+        }
+
+        statistic = ngx_http_stat_array_get(storage->statistics, s);
+        param = ngx_http_stat_array_get(storage->params, statistic->param);
+
+        if (statistic->stt == NULL
+                || !ngx_http_stat_snapshot_match(filter, match,
+                    statistic->split, &param->name))
+        {
+            continue;
+        }
+
+        if (k == max || s == nstts) {
+            break;
+        }
+
+        sr = &series[k++];
+
+        sr->split = statistic->split;
+        sr->param = param->name;
+        ngx_str_null(&sr->interval);
+        sr->window = 0;
+        sr->percentile = param->percentile;
+        sr->aggregate = NULL;
+        sr->value = statistic->stt->q[P2_METRIC_COUNT / 2];
+        sr->stt = &stts[s];
+        sr->index = s;
+
+        *sr->stt = *statistic->stt;
+    }
+
+done:
+
+    /*
+     * the export of the slowest sink restarts the percentiles, so every
+     * sink gets them over at least its own period
+     */
+
+    for (s = 0; restart && s < storage->statistics->nelts; s++) {
+
+        statistic = ngx_http_stat_array_get(storage->statistics, s);
+        param = ngx_http_stat_array_get(storage->params, statistic->param);
+
+        if (statistic->stt) {
+            ngx_http_stat_statistic_init(statistic->stt, param->percentile);
+        }
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+    /** Lock }}} */
+
+    /* only the exporter resets, the status requests are not flushes */
+    if (smcf->self && reset) {
+        ngx_http_stat_self_snapshot(smcf, start, locked,
+                ngx_http_stat_self_clock());
+    }
+
+    *n = k;
+
+    return series;
+}
+
+
+ngx_int_t
+ngx_http_stat_parse_interval(ngx_str_t *value, ngx_uint_t *result)
+{
+    if (ngx_http_stat_parse_time(NULL, value, result) == NGX_CONF_ERROR) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
 static
 double
 ngx_http_stat_source_request_time( ngx_http_stat_source_t *source,
@@ -3205,6 +4932,53 @@ ngx_http_stat_aggregate_sum( ngx_http_stat_interval_t *interval,
 }
 
 
+/** Aggregates the last "interval" seconds before "ts". With "elapsed"
+ *  milliseconds of the current second, the window ends with it instead:
+ *  the sums take the rest of the window from the second before it, so a
+ *  rate stays steady through the second, the average takes it whole.
+ *  The seconds up to "from" are left out.
+ */
+double
+ngx_http_stat_metric_value(ngx_http_stat_storage_t *storage,
+        ngx_http_stat_acc_t *acc, ngx_http_stat_aggregate_pt aggregate,
+        ngx_http_stat_interval_t *interval, time_t ts, ngx_msec_t elapsed,
+        time_t from)
+{
+    time_t               end, t;
+    ngx_uint_t           l, a;
+    ngx_http_stat_acc_t  sum;
+
+    sum.value = 0;
+    sum.count = 0;
+
+    end = elapsed ? ts + 1 : ts;
+
+    for (l = 0; l < interval->value; l++) {
+
+        t = end - (time_t) l - 1;
+
+        if (t >= storage->start_time && t > from) {
+            a = (t - storage->start_time) % (storage->max_interval + 1);
+            sum.value += acc[a].value;
+            sum.count += acc[a].count;
+        }
+    }
+
+    /* a weighted count would skew the average, so only values are taken */
+
+    t = end - (time_t) interval->value - 1;
+
+    if (elapsed && aggregate != ngx_http_stat_aggregate_avg
+            && t >= storage->start_time && t > from)
+    {
+        a = (t - storage->start_time) % (storage->max_interval + 1);
+        sum.value += acc[a].value * (1000 - elapsed) / 1000;
+    }
+
+    return aggregate(interval, &sum);
+}
+
+
 void
 ngx_http_stat_statistic_init(ngx_http_stat_stt_t *stt, ngx_uint_t percentile)
 {
@@ -10,6 +10,12 @@
 #include "ngx_http_stat_array.h"
 #include "ngx_http_stat_allocator.h"
 
+#include <zlib.h>
+
+#if (NGX_THREADS)
+#include <ngx_thread_pool.h>
+#endif
+
 
 #define HOST_LEN 256
 
@@ -20,6 +26,16 @@
 #define SPLIT_INTERNAL ((ngx_uint_t) - 2)
 #define SOURCE_INTERNAL ((ngx_uint_t) - 1)
 
+#define DROP_NEWEST 0
+#define DROP_OLDEST 1
+
+#define FIELDS_SINGLE 0
+#define FIELDS_MULTI  1
+
+#define SUPPRESS_OFF       0
+#define SUPPRESS_ZERO      1
+#define SUPPRESS_UNCHANGED 2
+
 #define ARR_SIZE(struct_) \
     (sizeof((struct_)) / sizeof(struct_[0]))
 
@@ -39,14 +55,66 @@
     {host, split, param, interval}
 
 
+/** The last exported value of a series */
+typedef struct {
+    double                      value;
+    ngx_uint_t                  sent;
+} ngx_http_stat_sent_t;
+
+/** Values exported by a suppressing sink, indexed by the series index */
+typedef struct {
+    ngx_http_stat_sent_t       *metrics;
+    ngx_uint_t                  nmetrics;
+    ngx_http_stat_sent_t       *statistics;
+    ngx_uint_t                  nstatistics;
+    time_t                      keyframe;
+} ngx_http_stat_history_t;
+
+
+/** Counters of the module itself, see ngx_http_stat_self.c */
+typedef struct {
+    ngx_atomic_t                records;
+    ngx_atomic_t                record_time;
+    ngx_atomic_t                handler_wait;
+    ngx_atomic_t                handler_hold;
+    ngx_atomic_t                snapshots;
+    ngx_atomic_t                flush_wait;
+    ngx_atomic_t                flush_hold;
+    ngx_atomic_t                flushes;
+    ngx_atomic_t                flush_time;
+    ngx_atomic_t                bytes;
+    ngx_atomic_t                sent;
+    ngx_atomic_t                failed;
+} ngx_http_stat_self_t;
+
+
 /** Shm mem struct */
 typedef struct {
-    time_t                      start_time, last_time, event_time;
+    time_t                      start_time, last_time;
+
+    /* the time of the last export of each sink */
+    ngx_atomic_t               *event_times;
+    ngx_http_stat_history_t    *histories;
+
+    /* the pid of the worker running the sinks and its last sign of life */
+    ngx_atomic_t                leader;
+    ngx_atomic_t                heartbeat;
 
     ngx_uint_t                  max_interval;
 
+    /* the time of the last checkpoint written by the exporter */
+    time_t                      checkpoint_time;
+
+    /* the time the zone of the next cycle took the values over at, set
+     * once that cycle is committed */
+    ngx_atomic_t                migrated;
+
     ngx_http_stat_allocator_t  *allocator;
 
+    /* the counters of all workers, taken by the exporter */
+    ngx_http_stat_self_t        self;
+    ngx_uint_t                  nomemory;
+
     ngx_http_stat_array_t      *metrics;
     ngx_http_stat_array_t      *statistics;
 
@@ -60,37 +128,240 @@ typedef struct {
     struct sockaddr   *sockaddr;
     socklen_t          socklen;
     ngx_str_t          name;
+
+    /* a name to resolve again at run time, empty for an address */
+    ngx_str_t          host;
+    in_port_t          port;
+    ngx_sockaddr_t     addr;
 } ngx_http_stat_server_t;
 
 
-/** Main conf */
+/** Point of the consistent hash ring of a server list */
 typedef struct {
+    uint32_t                   hash;
+    ngx_uint_t                 shard;
+} ngx_http_stat_ring_point_t;
 
-    ngx_uint_t                 enable;
+
+/** Spool file header, the offsets are relative to the ring after it */
+typedef struct {
+    uint64_t                   magic;
+    uint64_t                   size;
+    uint64_t                   head;
+    uint64_t                   tail;
+    uint64_t                   records;
+    uint64_t                   dropped;
+
+    /* the pid of the process updating the header, of any cycle */
+    ngx_atomic_t               lock;
+} ngx_http_stat_spool_header_t;
+
+
+/** On-disk overflow of a stream queue, a ring of packages in a mapped file */
+typedef struct {
+    ngx_str_t                      path;
+    size_t                         size;
+    ngx_uint_t                     rate;
+
+    ngx_http_stat_spool_header_t  *header;
+    u_char                        *data;
+
+    /* kept open by a worker, with a shared lock on the file */
+    ngx_fd_t                       fd;
+
+    ngx_event_t                    replay;
+} ngx_http_stat_spool_t;
+
+
+/** Checkpoint file header, the rings of the metrics oldest second first
+ *  and the estimator states of the statistics follow it
+ */
+typedef struct {
+    uint64_t                   magic;
+    uint32_t                   version;
+    uint32_t                   layout;
+    int64_t                    time;
+    uint64_t                   max_interval;
+    uint64_t                   nmetrics;
+    uint64_t                   nstatistics;
+} ngx_http_stat_checkpoint_header_t;
+
+
+/** Copy of the storage in a file, loaded when nginx starts */
+typedef struct {
+    ngx_str_t                  path;
+    ngx_uint_t                 frequency;
+
+    /* the file is written next to it and renamed */
+    u_char                    *temp;
+} ngx_http_stat_checkpoint_t;
+
+
+/** Stream transport state (tcp, http) */
+typedef struct {
+    ngx_peer_connection_t      peer;
+    ngx_event_t                reconnect;
+    ngx_pool_t                *pool;
+
+    ngx_chain_t               *out;
+    ngx_chain_t               *free;
+    ngx_uint_t                 nbufs;
+    ngx_uint_t                 max_bufs;
+    size_t                     buf_size;
+
+    ngx_uint_t                 connected;
+    ngx_msec_t                 backoff;
+    ngx_uint_t                 dropped;
+
+    /** http {{{ */
+    ngx_uint_t                 http;
+    ngx_uint_t                 awaiting;
+    ngx_str_t                  content_type;
+    z_stream                   zstream;
+    u_char                    *scratch;
+    size_t                     scratch_size;
+
+    ngx_uint_t                 state;
+    ngx_uint_t                 status;
+    off_t                      rest;
+    ngx_uint_t                 close;
+    ngx_uint_t                 chunked;
+    u_char                     line[128];
+    size_t                     line_len;
+    /** }}} */
+} ngx_http_stat_stream_t;
+
+
+typedef struct ngx_http_stat_main_conf_s  ngx_http_stat_main_conf_t;
+typedef struct ngx_http_stat_sink_s       ngx_http_stat_sink_t;
+typedef struct ngx_http_stat_series_s     ngx_http_stat_series_t;
+
+
+/** Backend interface, a serializer bound to a transport {{{ */
+typedef ngx_int_t (*ngx_http_stat_backend_init_pt)(ngx_http_stat_sink_t *sink,
+        ngx_cycle_t *cycle);
+typedef u_char *(*ngx_http_stat_backend_serialize_pt)(
+        ngx_http_stat_sink_t *sink, ngx_http_stat_series_t *series,
+        time_t ts, u_char *buffer, u_char *last);
+typedef ngx_int_t (*ngx_http_stat_backend_flush_pt)(
+        ngx_http_stat_sink_t *sink, u_char *start, u_char *last,
+        ngx_log_t *log);
+typedef ngx_int_t (*ngx_http_stat_backend_connect_pt)(
+        ngx_http_stat_sink_t *sink, ngx_log_t *log);
+typedef void (*ngx_http_stat_backend_close_pt)(ngx_http_stat_sink_t *sink);
+typedef void (*ngx_http_stat_backend_drain_pt)(ngx_http_stat_sink_t *sink,
+        ngx_msec_t timeout, ngx_log_t *log);
+
+typedef struct {
+    ngx_str_t                             name;
+    int                                   port;
+    ngx_str_t                             uri;
+    ngx_http_stat_backend_init_pt         init;
+    ngx_http_stat_backend_serialize_pt    serialize;
+    ngx_http_stat_backend_flush_pt        flush;
+    ngx_http_stat_backend_connect_pt      connect;
+    ngx_http_stat_backend_close_pt        close;
+    ngx_http_stat_backend_drain_pt        drain;
+} ngx_http_stat_backend_t;
+/** }}} */
+
+
+/** Export destination, stat_config sets the first one */
+struct ngx_http_stat_sink_s {
+    ngx_uint_t                 index;
+    ngx_http_stat_backend_t   *backend;
+    ngx_http_stat_main_conf_t *smcf;
 
     ngx_str_t                  protocol;
-    ngx_str_t                  host;
     int                        port;
     ngx_http_stat_server_t     server;
 
-    ngx_shm_zone_t            *shared;
-    ngx_buf_t                  buffer;
+    /* the servers of a list are adjacent sinks sharing a hash ring */
+    ngx_uint_t                 shard;
+    ngx_uint_t                 nshards;
+    ngx_http_stat_ring_point_t *ring;
+    ngx_uint_t                 npoints;
+    ngx_uint_t                 failed;
+
+    ngx_uint_t                 resolve;
+    ngx_event_t                resolve_timer;
+    ngx_resolver_ctx_t        *resolve_ctx;
 
     ngx_uint_t                 frequency;
+    ngx_uint_t                 timeout;
+
+    /* the slowest sink restarts the percentiles and the self counters */
+    ngx_uint_t                 restart;
+
+    size_t                     package_size;
+    size_t                     queue_size;
+
+    ngx_uint_t                 drop;
+    ngx_uint_t                 backoff;
+
+    ngx_str_t                  uri;
+    size_t                     batch_size;
+    ngx_uint_t                 inflight;
+    ngx_int_t                  gzip;
+
+    ngx_array_t               *template;
+    ngx_uint_t                 fields;
+
+    ngx_uint_t                 suppress;
+    ngx_uint_t                 keyframe;
+
+    /* series are serialized in chunks of a datagram, package or batch */
+    ngx_buf_t                  buffer;
+    size_t                     chunk_size;
+    ngx_event_t                timer;
+
+    /* the last series serialized in the current tick */
+    ngx_http_stat_series_t    *prev;
+
+    ngx_connection_t          *connection;
+    ngx_http_stat_stream_t     stream;
+    ngx_http_stat_spool_t      spool;
+
+    void                      *ctx;
+
+#if (NGX_THREADS)
+    /* chunks encoded by a thread and sent by the event loop */
+    ngx_uint_t                 pending;
+    ngx_pool_t                *chunks_pool;
+    ngx_chain_t               *chunks;
+    ngx_chain_t              **last_chunk;
+#endif
+};
+
+
+/** Series copied out of the storage once per tick, shared by all sinks */
+typedef struct {
+    time_t                     time;
+    ngx_pool_t                *pool;
+    ngx_http_stat_series_t    *series;
+    ngx_uint_t                 nseries;
+    ngx_uint_t                 restart;
+} ngx_http_stat_snapshot_t;
+
+
+/** Main conf */
+struct ngx_http_stat_main_conf_s {
+
+    ngx_uint_t                 enable;
+
+    ngx_str_t                  host;
+
+    ngx_shm_zone_t            *shared;
 
     ngx_array_t               *sources;
     ngx_array_t               *intervals;
     ngx_array_t               *splits;
 
-    ngx_uint_t timeout;
-
     ngx_array_t               *default_params;
 
     size_t                     shared_size;
-    size_t                     buffer_size;
-    size_t                     package_size;
-
-    ngx_array_t               *template;
+    ngx_uint_t                 shared_auto;
+    size_t                     shared_headroom;
 
     ngx_array_t               *default_data_template;
     ngx_array_t               *default_data_params;
@@ -100,9 +371,36 @@ typedef struct {
 
     ngx_http_stat_storage_t   *storage;
 
-    ngx_connection_t          *connection;
+    ngx_array_t               *sinks;
+    ngx_http_stat_snapshot_t   snapshot;
+
+    ngx_event_t                election;
+    ngx_uint_t                 leading;
+
+    /* the worker exits, the sinks are exported once more at most this long */
+    ngx_uint_t                 exiting;
+    ngx_msec_t                 exit_flush;
+
+    /* worker-local, added to the storage every election tick */
+    ngx_uint_t                 self;
+    ngx_http_stat_self_t       counters;
+
+    ngx_resolver_t            *resolver;
+    ngx_msec_t                 resolver_timeout;
 
-} ngx_http_stat_main_conf_t;
+    ngx_http_stat_checkpoint_t checkpoint;
+
+    /* the zone of the previous cycle, marked when this one is committed */
+    ngx_slab_pool_t           *previous;
+    time_t                     migrate_time;
+
+    ngx_str_t                  thread_pool_name;
+#if (NGX_THREADS)
+    ngx_thread_pool_t         *thread_pool;
+    ngx_thread_task_t         *task;
+#endif
+
+};
 
 /** Srv conf */
 typedef struct {
@@ -164,6 +462,10 @@ double ngx_http_stat_aggregate_sum(ngx_http_stat_interval_t *interval,
     ngx_http_stat_acc_t *acc);
 void ngx_http_stat_statistic_init(ngx_http_stat_stt_t *stt,
     ngx_uint_t percentile);
+double ngx_http_stat_metric_value(ngx_http_stat_storage_t *storage,
+    ngx_http_stat_acc_t *acc, ngx_http_stat_aggregate_pt aggregate,
+    ngx_http_stat_interval_t *interval, time_t ts, ngx_msec_t elapsed,
+    time_t from);
 /** }}} */
 
 /** Variables, Stats and metric API {{{ */
@@ -210,6 +512,33 @@ typedef struct {
     ngx_http_stat_data_t  data;
 } ngx_http_stat_internal_t;
 
+
+/** Series selection, empty fields match everything */
+typedef struct {
+    ngx_str_t                 split;
+    ngx_str_t                 param;
+    ngx_http_stat_interval_t *interval;
+} ngx_http_stat_filter_t;
+
+
+/** A value of the series copied out of the storage */
+struct ngx_http_stat_series_s {
+    ngx_uint_t                  split;
+    ngx_str_t                   param;
+    ngx_str_t                   interval;
+    ngx_uint_t                  window;
+    ngx_uint_t                  percentile;
+    ngx_http_stat_aggregate_pt  aggregate;
+    double                      value;
+    ngx_http_stat_stt_t        *stt;
+
+    /* metric * intervals + interval, or the statistic if stt is set */
+    ngx_uint_t                  index;
+};
+
+/* series of the module itself are not indexed, so never suppressed */
+#define NGX_HTTP_STAT_NO_INDEX  ((ngx_uint_t) -1)
+
 typedef struct {
     ngx_str_t   name;
     int         variable;
@@ -229,13 +558,121 @@ ngx_uint_t ngx_http_stat_template_len( ngx_array_t *template,
     ngx_str_t *variables[]);
 /** }}} */
 
-/** Backend timed handlers {{{ */
-void ngx_http_influx_udp_timer_handler(ngx_event_t *ev);
+/** Sinks {{{ */
+ngx_http_stat_backend_t *ngx_http_stat_backend(ngx_str_t *protocol);
+ngx_int_t ngx_http_stat_sinks_init(ngx_http_stat_main_conf_t *smcf,
+    ngx_cycle_t *cycle);
+void ngx_http_stat_sinks_exit(ngx_http_stat_main_conf_t *smcf);
+ngx_int_t ngx_http_stat_sink_ring(ngx_conf_t *cf, ngx_http_stat_sink_t *sink);
+ngx_http_stat_snapshot_t *ngx_http_stat_sink_snapshot(
+    ngx_http_stat_sink_t *sink, ngx_log_t *log);
+/** }}} */
+
+/** Self-instrumentation {{{ */
+uint64_t ngx_http_stat_self_clock(void);
+void ngx_http_stat_self_record(ngx_http_stat_main_conf_t *smcf,
+    uint64_t start, uint64_t locked, uint64_t unlocked);
+void ngx_http_stat_self_snapshot(ngx_http_stat_main_conf_t *smcf,
+    uint64_t start, uint64_t locked, uint64_t unlocked);
+void ngx_http_stat_self_export(ngx_http_stat_main_conf_t *smcf,
+    uint64_t start, size_t bytes);
+void ngx_http_stat_self_merge(ngx_http_stat_main_conf_t *smcf);
+ngx_int_t ngx_http_stat_self_series(ngx_http_stat_main_conf_t *smcf,
+    ngx_http_stat_snapshot_t *snapshot);
+/** }}} */
+
+/** Transports {{{ */
+ngx_int_t ngx_http_stat_udp_init(ngx_http_stat_sink_t *sink,
+    ngx_cycle_t *cycle);
+ngx_int_t ngx_http_stat_udp_flush(ngx_http_stat_sink_t *sink, u_char *start,
+    u_char *last, ngx_log_t *log);
+ngx_int_t ngx_http_stat_udp_connect(ngx_http_stat_sink_t *sink,
+    ngx_log_t *log);
+void ngx_http_stat_udp_close(ngx_http_stat_sink_t *sink);
+
+ngx_int_t ngx_http_stat_tcp_init(ngx_http_stat_sink_t *sink,
+    ngx_cycle_t *cycle);
+ngx_int_t ngx_http_stat_tcp_flush(ngx_http_stat_sink_t *sink, u_char *start,
+    u_char *last, ngx_log_t *log);
+ngx_int_t ngx_http_stat_tcp_connect(ngx_http_stat_sink_t *sink,
+    ngx_log_t *log);
+void ngx_http_stat_tcp_close(ngx_http_stat_sink_t *sink);
+void ngx_http_stat_tcp_drain(ngx_http_stat_sink_t *sink, ngx_msec_t timeout,
+    ngx_log_t *log);
+ngx_buf_t *ngx_http_stat_tcp_append(ngx_http_stat_sink_t *sink);
+
+ngx_int_t ngx_http_stat_http_init(ngx_http_stat_sink_t *sink,
+    ngx_cycle_t *cycle);
+ngx_int_t ngx_http_stat_http_flush(ngx_http_stat_sink_t *sink,
+    u_char *start, u_char *last, ngx_log_t *log);
+ngx_int_t ngx_http_stat_http_setup(ngx_http_stat_sink_t *sink,
+    ngx_cycle_t *cycle, ngx_str_t *content_type, size_t prefix_size);
+ngx_int_t ngx_http_stat_http_post(ngx_http_stat_sink_t *sink,
+    ngx_str_t *prefix, u_char *start, u_char *last, ngx_log_t *log);
+
+void ngx_http_stat_resolve_init(ngx_http_stat_sink_t *sink,
+    ngx_cycle_t *cycle);
+void ngx_http_stat_resolve_start(ngx_http_stat_sink_t *sink);
+void ngx_http_stat_resolve_stop(ngx_http_stat_sink_t *sink);
+
+ngx_int_t ngx_http_stat_spool_open(ngx_conf_t *cf,
+    ngx_http_stat_spool_t *spool);
+ngx_int_t ngx_http_stat_spool_write(ngx_http_stat_spool_t *spool,
+    u_char *start, size_t len);
+u_char *ngx_http_stat_spool_peek(ngx_http_stat_spool_t *spool, size_t *len);
+void ngx_http_stat_spool_pop(ngx_http_stat_spool_t *spool);
+void ngx_http_stat_spool_attach(ngx_http_stat_spool_t *spool, ngx_log_t *log);
+ngx_int_t ngx_http_stat_spool_lock(ngx_http_stat_spool_t *spool);
+void ngx_http_stat_spool_unlock(ngx_http_stat_spool_t *spool);
+/** }}} */
+
+/** Checkpoint {{{ */
+ngx_int_t ngx_http_stat_checkpoint_init(ngx_conf_t *cf,
+    ngx_http_stat_checkpoint_t *checkpoint);
+void ngx_http_stat_checkpoint_load(ngx_http_stat_main_conf_t *smcf,
+    ngx_log_t *log);
+ngx_int_t ngx_http_stat_checkpoint_write(ngx_http_stat_main_conf_t *smcf,
+    ngx_log_t *log);
+/** }}} */
+
+/** Serializers {{{ */
+u_char *ngx_http_influx_serialize(ngx_http_stat_sink_t *sink,
+    ngx_http_stat_series_t *series, time_t ts, u_char *buffer, u_char *last);
+u_char *ngx_http_graphite_serialize(ngx_http_stat_sink_t *sink,
+    ngx_http_stat_series_t *series, time_t ts, u_char *buffer, u_char *last);
+u_char *ngx_http_graphite_pickle_serialize(ngx_http_stat_sink_t *sink,
+    ngx_http_stat_series_t *series, time_t ts, u_char *buffer, u_char *last);
+ngx_int_t ngx_http_graphite_pickle_init(ngx_http_stat_sink_t *sink,
+    ngx_cycle_t *cycle);
+ngx_int_t ngx_http_graphite_pickle_flush(ngx_http_stat_sink_t *sink,
+    u_char *start, u_char *last, ngx_log_t *log);
+u_char *ngx_http_statsd_serialize(ngx_http_stat_sink_t *sink,
+    ngx_http_stat_series_t *series, time_t ts, u_char *buffer, u_char *last);
+u_char *ngx_http_otlp_serialize(ngx_http_stat_sink_t *sink,
+    ngx_http_stat_series_t *series, time_t ts, u_char *buffer, u_char *last);
+ngx_int_t ngx_http_otlp_init(ngx_http_stat_sink_t *sink, ngx_cycle_t *cycle);
+ngx_int_t ngx_http_otlp_flush(ngx_http_stat_sink_t *sink, u_char *start,
+    u_char *last, ngx_log_t *log);
+/** }}} */
+
+extern ngx_module_t ngx_http_stat_module;
+
+/** Status handlers {{{ */
+ngx_int_t ngx_http_stat_status_handler(ngx_http_request_t *r);
+ngx_int_t ngx_http_stat_query_handler(ngx_http_request_t *r);
+ngx_int_t ngx_http_stat_memory_handler(ngx_http_request_t *r);
 /** }}} */
 
 ngx_int_t ngx_http_stat(ngx_http_request_t *r, ngx_str_t *name,
     double value, char *config);
 void ngx_http_stat_gc(ngx_http_stat_main_conf_t *smcf, time_t ts);
+uint32_t ngx_http_stat_shared_key(ngx_http_stat_main_conf_t *smcf,
+    ngx_http_stat_storage_t *storage, ngx_uint_t split, ngx_uint_t param);
+ngx_http_stat_series_t *ngx_http_stat_snapshot(
+    ngx_http_stat_main_conf_t *smcf, ngx_pool_t *pool,
+    ngx_http_stat_filter_t *filter, ngx_uint_t reset, ngx_uint_t restart,
+    ngx_uint_t *n);
+ngx_int_t ngx_http_stat_parse_interval(ngx_str_t *value, ngx_uint_t *result);
 
 #endif /** NGX_HTTP_STAT_MODULE_H_INCLUDED */
 
@@ -0,0 +1,1721 @@
+
+/**
+ * (c) BSD-2-Cause, link: https://opensource.org/licenses/BSD-2-Clause
+ * (c) V. Soshnikov, mailto: dedok.mad@gmail.com
+ */
+
+#include "ngx_http_stat_module.h"
+
+
+#define NGX_HTTP_STAT_BACKOFF_MIN 500
+
+/* the spool is replayed by "spool_rate" packages per, ms */
+#define NGX_HTTP_STAT_REPLAY 1000
+
+
+static void ngx_http_stat_net_reconnect_tcp(ngx_http_stat_sink_t *sink);
+static ngx_int_t ngx_http_stat_net_flush_tcp(ngx_http_stat_sink_t *sink,
+        ngx_log_t *log);
+static void ngx_http_stat_net_enqueue_tcp(ngx_http_stat_sink_t *sink,
+        u_char *start, u_char *last, ngx_log_t *log);
+static ngx_chain_t *ngx_http_stat_net_get_buf_tcp(
+        ngx_http_stat_sink_t *sink);
+static ngx_chain_t *ngx_http_stat_net_alloc_buf_tcp(
+        ngx_http_stat_sink_t *sink);
+static void ngx_http_stat_net_spool_tcp(ngx_http_stat_sink_t *sink,
+        ngx_buf_t *b, ngx_log_t *log);
+static void ngx_http_stat_net_replay_tcp(ngx_http_stat_sink_t *sink);
+static void ngx_http_stat_tcp_replay_handler(ngx_event_t *ev);
+static void ngx_http_stat_resolve_handler(ngx_event_t *ev);
+static void ngx_http_stat_resolve_done(ngx_resolver_ctx_t *ctx);
+static void ngx_http_stat_tcp_write_handler(ngx_event_t *wev);
+static void ngx_http_stat_tcp_read_handler(ngx_event_t *rev);
+static void ngx_http_stat_tcp_reconnect_handler(ngx_event_t *ev);
+static void ngx_http_stat_net_send_stream(ngx_http_stat_sink_t *sink,
+        ngx_log_t *log);
+static void ngx_http_stat_net_enqueue_http(ngx_http_stat_sink_t *sink,
+        u_char *start, u_char *last, ngx_log_t *log);
+static ngx_int_t ngx_http_stat_net_parse_http(ngx_http_stat_sink_t *sink,
+        u_char *p, u_char *last, ngx_log_t *log);
+
+
+/** UDP part {{{
+ */
+ngx_int_t
+ngx_http_stat_udp_init(ngx_http_stat_sink_t *sink, ngx_cycle_t *cycle)
+{
+    sink->connection = NULL;
+    sink->chunk_size = sink->package_size;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_stat_udp_flush(ngx_http_stat_sink_t *sink, u_char *start,
+        u_char *last, ngx_log_t *log)
+{
+    u_char    *part, *next, *nl;
+    ssize_t    n;
+
+    if (start == last) {
+        return NGX_OK;
+    }
+
+    if (sink->connection) {
+        ngx_log_error(NGX_LOG_NOTICE, log, 0, "re-init connection");
+        ngx_http_stat_udp_close(sink);
+    }
+
+    if (ngx_http_stat_udp_connect(sink, log) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                "ngx_http_stat_udp_connect: connect to \"%V\" failed",
+                &sink->server.name);
+        sink->failed = 1;
+        sink->smcf->counters.failed++;
+        return NGX_ERROR;
+    }
+
+    sink->connection->data = sink;
+
+    part = start;
+
+    while (part < last) {
+
+        next = part;
+        nl = part;
+
+        while ((next = ngx_strlchr(next, last, '\n'))
+                && ((size_t) (next - part) <= sink->package_size))
+        {
+            nl = next;
+            next++;
+        }
+
+        if (nl > part) {
+
+            n = ngx_send(sink->connection, part, nl - part + 1);
+
+            if (n == -1) {
+                ngx_log_error(NGX_LOG_ERR, log, n,
+                        "ngx_http_stat_udp_flush: "
+                        "udp send to \"%V\" error",
+                        &sink->server.name);
+                goto failed;
+            }
+
+            if (n != nl - part + 1) {
+                ngx_log_error(NGX_LOG_ERR, log, 0,
+                        "ngx_http_stat_udp_flush: udp send to \"%V\" "
+                        "incomplete", &sink->server.name);
+                goto failed;
+            }
+
+            sink->smcf->counters.sent++;
+        }
+        else {
+            nl = next ? next : last - 1;
+
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                    "ngx_http_stat_udp_flush: package size too small, "
+                    "need send %z to \"%V\"",
+                    (size_t) (nl - part + 1), &sink->server.name);
+        }
+
+        part = nl + 1;
+    }
+
+    ngx_http_stat_udp_close(sink);
+
+    sink->failed = 0;
+
+    return NGX_OK;
+
+failed:
+
+    ngx_http_stat_udp_close(sink);
+
+    sink->failed = 1;
+    sink->smcf->counters.failed++;
+
+    return NGX_ERROR;
+}
+
+
+ngx_int_t
+ngx_http_stat_udp_connect(ngx_http_stat_sink_t *sink, ngx_log_t *log)
+{
+    ngx_int_t         rc, event;
+    ngx_socket_t      s;
+    ngx_connection_t *c;
+    ngx_event_t      *rev, *wev;
+
+    s = ngx_socket(sink->server.sockaddr->sa_family, SOCK_DGRAM, 0);
+
+    if (s == (ngx_socket_t) -1) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_socket_errno,
+                "ngx_http_stat_udp_connect: " ngx_socket_n " failed");
+        return NGX_ERROR;
+    }
+
+    c = ngx_get_connection(s, log);
+
+    if (c == NULL) {
+        if (ngx_close_socket(s) == -1) {
+            ngx_log_error(NGX_LOG_ERR, log, ngx_socket_errno,
+                    "ngx_http_stat_udp_connect: " ngx_close_socket_n
+                    " failed");
+        }
+
+        return NGX_ERROR;
+    }
+
+    rev = c->read;
+    wev = c->write;
+
+    rev->log = log;
+    wev->log = log;
+
+    sink->connection = c;
+
+    c->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
+
+    rc = connect(s, sink->server.sockaddr, sink->server.socklen);
+
+    if (rc == -1) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_socket_errno,
+                "ngx_http_stat_udp_connect: connect failed");
+        goto failed;
+    }
+
+    wev->ready = 1;
+
+    event = (ngx_event_flags & NGX_USE_CLEAR_EVENT) ?
+            NGX_CLEAR_EVENT: NGX_LEVEL_EVENT;
+
+    if (ngx_add_event(rev, NGX_READ_EVENT, event) != NGX_OK) {
+        goto failed;
+    }
+
+    return NGX_OK;
+
+failed:
+
+    ngx_close_connection(c);
+    sink->connection = NULL;
+
+    return NGX_ERROR;
+}
+
+
+void
+ngx_http_stat_udp_close(ngx_http_stat_sink_t *sink)
+{
+    if (sink->connection) {
+        ngx_close_connection(sink->connection);
+        sink->connection = NULL;
+    }
+}
+/** }}} */
+
+/** TCP part {{{
+ */
+ngx_int_t
+ngx_http_stat_tcp_init(ngx_http_stat_sink_t *sink, ngx_cycle_t *cycle)
+{
+    ngx_http_stat_stream_t *stream;
+
+    stream = &sink->stream;
+
+    ngx_memzero(stream, sizeof(ngx_http_stat_stream_t));
+
+    stream->pool = cycle->pool;
+
+    stream->peer.sockaddr = sink->server.sockaddr;
+    stream->peer.socklen = sink->server.socklen;
+    stream->peer.name = &sink->server.name;
+    stream->peer.get = ngx_event_get_peer;
+    stream->peer.log = cycle->log;
+    stream->peer.log_error = NGX_ERROR_ERR;
+
+    stream->reconnect.handler = ngx_http_stat_tcp_reconnect_handler;
+    stream->reconnect.data = sink;
+    stream->reconnect.log = cycle->log;
+    stream->reconnect.cancelable = 1;
+
+    stream->buf_size = sink->package_size;
+    stream->max_bufs = sink->queue_size / sink->package_size;
+
+    sink->chunk_size = sink->package_size;
+
+    if (sink->spool.header) {
+        sink->spool.replay.handler = ngx_http_stat_tcp_replay_handler;
+        sink->spool.replay.data = sink;
+        sink->spool.replay.log = cycle->log;
+        sink->spool.replay.cancelable = 1;
+
+        ngx_http_stat_spool_attach(&sink->spool, cycle->log);
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_stat_tcp_flush(ngx_http_stat_sink_t *sink, u_char *start,
+        u_char *last, ngx_log_t *log)
+{
+    if (start != last) {
+        ngx_http_stat_net_enqueue_tcp(sink, start, last, log);
+    }
+
+    ngx_http_stat_net_send_stream(sink, log);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_stat_net_send_stream(ngx_http_stat_sink_t *sink, ngx_log_t *log)
+{
+    ngx_http_stat_stream_t *stream;
+
+    stream = &sink->stream;
+
+    if (stream->out == NULL) {
+        return;
+    }
+
+    if (stream->peer.connection == NULL) {
+
+        if (!stream->reconnect.timer_set) {
+            ngx_http_stat_tcp_connect(sink, log);
+        }
+
+    } else if (stream->connected) {
+        ngx_http_stat_net_flush_tcp(sink, log);
+    }
+}
+
+
+ngx_int_t
+ngx_http_stat_tcp_connect(ngx_http_stat_sink_t *sink, ngx_log_t *log)
+{
+    ngx_int_t                rc;
+    ngx_connection_t        *c;
+    ngx_http_stat_stream_t  *stream;
+
+    stream = &sink->stream;
+
+    stream->connected = 0;
+    stream->peer.log = log;
+
+    /* the address could be resolved again since the last connect */
+    stream->peer.sockaddr = sink->server.sockaddr;
+    stream->peer.socklen = sink->server.socklen;
+
+    rc = ngx_event_connect_peer(&stream->peer);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                "ngx_http_stat_tcp_connect: connect to \"%V\" failed",
+                &sink->server.name);
+        stream->peer.connection = NULL;
+        ngx_http_stat_net_reconnect_tcp(sink);
+        return NGX_ERROR;
+    }
+
+    c = stream->peer.connection;
+
+    c->data = sink;
+    c->read->handler = ngx_http_stat_tcp_read_handler;
+    c->write->handler = ngx_http_stat_tcp_write_handler;
+
+    if (rc == NGX_AGAIN) {
+        ngx_add_timer(c->write, sink->timeout);
+        return NGX_AGAIN;
+    }
+
+    stream->connected = 1;
+    stream->backoff = 0;
+    sink->failed = 0;
+
+    ngx_http_stat_net_replay_tcp(sink);
+
+    return ngx_http_stat_net_flush_tcp(sink, log);
+}
+
+
+void
+ngx_http_stat_tcp_close(ngx_http_stat_sink_t *sink)
+{
+    ngx_chain_t             *cl;
+    ngx_http_stat_stream_t  *stream;
+
+    stream = &sink->stream;
+
+    if (stream->peer.connection) {
+        ngx_close_connection(stream->peer.connection);
+        stream->peer.connection = NULL;
+    }
+
+    stream->connected = 0;
+
+    if (stream->awaiting) {
+        ngx_log_error(NGX_LOG_WARN, stream->peer.log, 0,
+                "ngx_http_stat_tcp_close: %ui requests to \"%V\" "
+                "were not answered", stream->awaiting, &sink->server.name);
+    }
+
+    stream->awaiting = 0;
+    stream->state = 0;
+    stream->line_len = 0;
+
+    if (sink->spool.replay.timer_set) {
+        ngx_del_timer(&sink->spool.replay);
+    }
+
+    /*
+     * the head buffer could be sent partially, its tail is not a valid line
+     * protocol anymore, so it is dropped or spooled to be sent again whole
+     */
+    cl = stream->out;
+
+    if (cl && cl->buf->pos != cl->buf->start) {
+        stream->out = cl->next;
+
+        if (sink->spool.header) {
+            ngx_http_stat_net_spool_tcp(sink, cl->buf, stream->peer.log);
+
+        } else {
+            stream->dropped++;
+            sink->smcf->counters.failed++;
+        }
+
+        cl->buf->pos = cl->buf->start;
+        cl->buf->last = cl->buf->start;
+
+        cl->next = stream->free;
+        stream->free = cl;
+    }
+}
+
+
+/** Sends the queue out on worker exit. The event loop does not run anymore,
+ *  so the socket is polled here and its handlers are called directly, for
+ *  at most "timeout" ms. What is left is spooled or dropped.
+ */
+void
+ngx_http_stat_tcp_drain(ngx_http_stat_sink_t *sink, ngx_msec_t timeout,
+        ngx_log_t *log)
+{
+    int                      n;
+    ngx_msec_t               start, elapsed;
+    ngx_chain_t             *cl;
+    struct pollfd            pfd;
+    ngx_connection_t        *c;
+    ngx_http_stat_stream_t  *stream;
+
+    stream = &sink->stream;
+
+    ngx_time_update();
+    start = ngx_current_msec;
+
+    while (stream->out || stream->awaiting) {
+
+        c = stream->peer.connection;
+
+        if (c == NULL) {
+
+            if (stream->out == NULL
+                    || ngx_http_stat_tcp_connect(sink, log) == NGX_ERROR)
+            {
+                break;
+            }
+
+            continue;
+        }
+
+        ngx_time_update();
+        elapsed = ngx_current_msec - start;
+
+        if (elapsed >= timeout) {
+            ngx_log_error(NGX_LOG_WARN, log, 0,
+                    "ngx_http_stat_tcp_drain: send to \"%V\" timed out",
+                    &sink->server.name);
+            break;
+        }
+
+        pfd.fd = c->fd;
+        pfd.events = stream->connected ? POLLIN : 0;
+        pfd.revents = 0;
+
+        if (!stream->connected || stream->out) {
+            pfd.events |= POLLOUT;
+        }
+
+        n = poll(&pfd, 1, (int) (timeout - elapsed));
+
+        if (n == -1) {
+
+            if (ngx_errno == NGX_EINTR) {
+                continue;
+            }
+
+            ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                    "ngx_http_stat_tcp_drain: poll() failed");
+            break;
+        }
+
+        if (n == 0) {
+            continue;
+        }
+
+        if (stream->connected && (pfd.revents & (POLLIN|POLLERR|POLLHUP))) {
+            c->read->ready = 1;
+            c->read->handler(c->read);
+        }
+
+        if (stream->peer.connection == c
+                && (pfd.revents & (POLLOUT|POLLERR|POLLHUP)))
+        {
+            c->write->ready = 1;
+            c->write->handler(c->write);
+        }
+    }
+
+    ngx_http_stat_tcp_close(sink);
+
+    while (stream->out) {
+
+        cl = stream->out;
+        stream->out = cl->next;
+
+        if (sink->spool.header) {
+            ngx_http_stat_net_spool_tcp(sink, cl->buf, log);
+
+        } else {
+            stream->dropped++;
+            sink->smcf->counters.failed++;
+        }
+
+        cl->buf->pos = cl->buf->start;
+        cl->buf->last = cl->buf->start;
+
+        cl->next = stream->free;
+        stream->free = cl;
+    }
+}
+
+
+static void
+ngx_http_stat_net_reconnect_tcp(ngx_http_stat_sink_t *sink)
+{
+    ngx_http_stat_stream_t *stream;
+
+    stream = &sink->stream;
+
+    /* the series of a server list go to the next server meanwhile */
+    sink->failed = 1;
+
+    if (ngx_quit || ngx_terminate || ngx_exiting) {
+        return;
+    }
+
+    if (stream->backoff == 0) {
+        stream->backoff = NGX_HTTP_STAT_BACKOFF_MIN;
+    } else {
+        stream->backoff *= 2;
+    }
+
+    if (stream->backoff > sink->backoff) {
+        stream->backoff = sink->backoff;
+    }
+
+    if (!stream->reconnect.timer_set) {
+        ngx_add_timer(&stream->reconnect, stream->backoff);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_stat_net_flush_tcp(ngx_http_stat_sink_t *sink, ngx_log_t *log)
+{
+    off_t                    limit;
+    ngx_uint_t               n;
+    ngx_chain_t             *cl;
+    ngx_connection_t        *c;
+    ngx_http_stat_stream_t  *stream;
+
+    stream = &sink->stream;
+    c = stream->peer.connection;
+
+    if (stream->out == NULL) {
+        return NGX_OK;
+    }
+
+    limit = 0;
+
+    if (stream->http) {
+
+        /* only "inflight" requests may wait for a response at once */
+
+        if (stream->awaiting >= sink->inflight) {
+            return NGX_AGAIN;
+        }
+
+        n = sink->inflight - stream->awaiting;
+
+        for (cl = stream->out; cl && n; cl = cl->next, n--) {
+            limit += ngx_buf_size(cl->buf);
+        }
+    }
+
+    cl = c->send_chain(c, stream->out, limit);
+
+    if (cl == NGX_CHAIN_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                "ngx_http_stat_net_flush_tcp: tcp send to \"%V\" error",
+                &sink->server.name);
+        ngx_http_stat_tcp_close(sink);
+        ngx_http_stat_net_reconnect_tcp(sink);
+        return NGX_ERROR;
+    }
+
+    while (stream->out && ngx_buf_size(stream->out->buf) == 0) {
+
+        cl = stream->out;
+        stream->out = cl->next;
+
+        cl->buf->pos = cl->buf->start;
+        cl->buf->last = cl->buf->start;
+
+        cl->next = stream->free;
+        stream->free = cl;
+
+        sink->smcf->counters.sent++;
+
+        if (stream->http) {
+            stream->awaiting++;
+        }
+    }
+
+    if (stream->out == NULL
+            || (stream->http && stream->awaiting >= sink->inflight))
+    {
+        return NGX_OK;
+    }
+
+    if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+        ngx_http_stat_tcp_close(sink);
+        ngx_http_stat_net_reconnect_tcp(sink);
+        return NGX_ERROR;
+    }
+
+    return NGX_AGAIN;
+}
+
+
+static void
+ngx_http_stat_net_enqueue_tcp(ngx_http_stat_sink_t *sink,
+        u_char *start, u_char *last, ngx_log_t *log)
+{
+    u_char                  *p, *nl;
+    size_t                   len;
+    ngx_uint_t               dropped;
+    ngx_chain_t             *cl, *ln;
+    ngx_http_stat_stream_t  *stream;
+
+    stream = &sink->stream;
+
+    dropped = stream->dropped;
+
+    for (cl = stream->out; cl && cl->next; cl = cl->next) { /* void */ }
+
+    p = start;
+
+    while (p < last) {
+
+        nl = ngx_strlchr(p, last, '\n');
+        len = (nl ? nl + 1 : last) - p;
+
+        if (len > sink->stream.buf_size) {
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                    "ngx_http_stat_net_enqueue_tcp: package size too small, "
+                    "need send %z to \"%V\"", len, &sink->server.name);
+            p += len;
+            continue;
+        }
+
+        if (cl == NULL || (size_t) (cl->buf->end - cl->buf->last) < len) {
+
+            ln = ngx_http_stat_net_get_buf_tcp(sink);
+
+            if (ln == NULL) {
+                stream->dropped++;
+                sink->smcf->counters.failed++;
+                break;
+            }
+
+            /* DROP_OLDEST could have unlinked the current tail */
+            for (cl = stream->out; cl && cl->next; cl = cl->next) {
+                /* void */
+            }
+
+            if (cl) {
+                cl->next = ln;
+            } else {
+                stream->out = ln;
+            }
+
+            cl = ln;
+        }
+
+        cl->buf->last = ngx_cpymem(cl->buf->last, p, len);
+
+        p += len;
+    }
+
+    if (stream->dropped != dropped) {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                "ngx_http_stat_net_enqueue_tcp: queue to \"%V\" is full, "
+                "%ui packages dropped", &sink->server.name,
+                stream->dropped - dropped);
+    }
+}
+
+
+static ngx_chain_t *
+ngx_http_stat_net_get_buf_tcp(ngx_http_stat_sink_t *sink)
+{
+    ngx_chain_t             *cl, **ll;
+    ngx_http_stat_stream_t  *stream;
+
+    stream = &sink->stream;
+
+    cl = ngx_http_stat_net_alloc_buf_tcp(sink);
+
+    if (cl || stream->nbufs < stream->max_bufs) {
+        return cl;
+    }
+
+    if (stream->out == NULL
+            || (sink->drop == DROP_NEWEST && sink->spool.header == NULL))
+    {
+        return NULL;
+    }
+
+    /*
+     * DROP_OLDEST or a spool: the head buffer might be in the middle of
+     * sending, so the oldest untouched buffer is reused instead
+     */
+    ll = &stream->out;
+
+    if ((*ll)->buf->pos != (*ll)->buf->start) {
+        ll = &(*ll)->next;
+    }
+
+    cl = *ll;
+
+    if (cl == NULL || cl->next == NULL) {
+        return NULL;
+    }
+
+    *ll = cl->next;
+
+    if (sink->spool.header) {
+        ngx_http_stat_net_spool_tcp(sink, cl->buf, stream->peer.log);
+
+    } else {
+        stream->dropped++;
+        sink->smcf->counters.failed++;
+    }
+
+    cl->buf->pos = cl->buf->start;
+    cl->buf->last = cl->buf->start;
+    cl->next = NULL;
+
+    return cl;
+}
+
+
+/** Returns a free buffer without touching the queue, NULL if the queue
+ *  holds "queue" bytes already.
+ */
+static ngx_chain_t *
+ngx_http_stat_net_alloc_buf_tcp(ngx_http_stat_sink_t *sink)
+{
+    ngx_chain_t             *cl;
+    ngx_http_stat_stream_t  *stream;
+
+    stream = &sink->stream;
+
+    if (stream->free) {
+        cl = stream->free;
+        stream->free = cl->next;
+        cl->next = NULL;
+        return cl;
+    }
+
+    if (stream->nbufs == stream->max_bufs) {
+        return NULL;
+    }
+
+    cl = ngx_alloc_chain_link(stream->pool);
+    if (cl == NULL) {
+        return NULL;
+    }
+
+    cl->buf = ngx_create_temp_buf(stream->pool, stream->buf_size);
+    if (cl->buf == NULL) {
+        return NULL;
+    }
+
+    cl->next = NULL;
+    stream->nbufs++;
+
+    return cl;
+}
+
+
+static void
+ngx_http_stat_net_spool_tcp(ngx_http_stat_sink_t *sink, ngx_buf_t *b,
+        ngx_log_t *log)
+{
+    uint64_t                 dropped;
+    ngx_http_stat_spool_t   *spool;
+
+    spool = &sink->spool;
+
+    if (ngx_http_stat_spool_lock(spool) != NGX_OK) {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                "ngx_http_stat_net_spool_tcp: spool \"%V\" of \"%V\" "
+                "is locked by process %uA, package dropped", &spool->path,
+                &sink->server.name, spool->header->lock);
+
+        sink->stream.dropped++;
+        sink->smcf->counters.failed++;
+        return;
+    }
+
+    dropped = spool->header->dropped;
+
+    if (ngx_http_stat_spool_write(spool, b->start, b->last - b->start)
+            != NGX_OK)
+    {
+        ngx_http_stat_spool_unlock(spool);
+
+        sink->stream.dropped++;
+        sink->smcf->counters.failed++;
+        return;
+    }
+
+    dropped = spool->header->dropped - dropped;
+
+    ngx_http_stat_spool_unlock(spool);
+
+    if (dropped) {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                "ngx_http_stat_net_spool_tcp: spool \"%V\" of \"%V\" "
+                "is full, %uL packages dropped", &spool->path,
+                &sink->server.name, dropped);
+
+        sink->smcf->counters.failed += dropped;
+    }
+
+    ngx_http_stat_net_replay_tcp(sink);
+}
+
+
+static void
+ngx_http_stat_net_replay_tcp(ngx_http_stat_sink_t *sink)
+{
+    ngx_http_stat_spool_t *spool;
+
+    spool = &sink->spool;
+
+    if (spool->header && spool->header->records && sink->stream.connected
+            && !spool->replay.timer_set)
+    {
+        ngx_add_timer(&spool->replay, NGX_HTTP_STAT_REPLAY);
+    }
+}
+
+
+/** Moves up to "spool_rate" spooled packages to the free buffers of the
+ *  queue, so a recovered server is not flooded and the new series still
+ *  find room.
+ */
+static void
+ngx_http_stat_tcp_replay_handler(ngx_event_t *ev)
+{
+    u_char                  *p;
+    size_t                   len;
+    ngx_uint_t               n;
+    ngx_chain_t             *cl, *ln;
+    ngx_http_stat_sink_t    *sink;
+    ngx_http_stat_spool_t   *spool;
+    ngx_http_stat_stream_t  *stream;
+
+    sink = ev->data;
+    stream = &sink->stream;
+    spool = &sink->spool;
+
+    if (ngx_quit || ngx_terminate || ngx_exiting || !stream->connected) {
+        return;
+    }
+
+    if (ngx_http_stat_spool_lock(spool) != NGX_OK) {
+        ngx_http_stat_net_replay_tcp(sink);
+        return;
+    }
+
+    for (n = 0; n < spool->rate; n++) {
+
+        p = ngx_http_stat_spool_peek(spool, &len);
+        if (p == NULL) {
+            break;
+        }
+
+        if (len > stream->buf_size) {
+            ngx_log_error(NGX_LOG_ERR, ev->log, 0,
+                    "ngx_http_stat_tcp_replay_handler: spooled package of "
+                    "%uz bytes does not fit into the queue to \"%V\"",
+                    len, &sink->server.name);
+            ngx_http_stat_spool_pop(spool);
+            continue;
+        }
+
+        ln = ngx_http_stat_net_alloc_buf_tcp(sink);
+        if (ln == NULL) {
+            break;
+        }
+
+        ln->buf->last = ngx_cpymem(ln->buf->last, p, len);
+
+        ngx_http_stat_spool_pop(spool);
+
+        for (cl = stream->out; cl && cl->next; cl = cl->next) { /* void */ }
+
+        if (cl) {
+            cl->next = ln;
+        } else {
+            stream->out = ln;
+        }
+    }
+
+    ngx_http_stat_spool_unlock(spool);
+
+    if (n) {
+        ngx_http_stat_net_flush_tcp(sink, ev->log);
+    }
+
+    ngx_http_stat_net_replay_tcp(sink);
+}
+
+
+/** Links a free buffer to the tail of the queue, NULL if the queue is full.
+ */
+ngx_buf_t *
+ngx_http_stat_tcp_append(ngx_http_stat_sink_t *sink)
+{
+    ngx_chain_t             *cl, *ln;
+    ngx_http_stat_stream_t  *stream;
+
+    stream = &sink->stream;
+
+    ln = ngx_http_stat_net_get_buf_tcp(sink);
+
+    if (ln == NULL) {
+        stream->dropped++;
+        sink->smcf->counters.failed++;
+        return NULL;
+    }
+
+    /* DROP_OLDEST could have unlinked the current tail */
+    for (cl = stream->out; cl && cl->next; cl = cl->next) { /* void */ }
+
+    if (cl) {
+        cl->next = ln;
+    } else {
+        stream->out = ln;
+    }
+
+    return ln->buf;
+}
+
+
+static ngx_int_t
+ngx_http_stat_net_test_connect(ngx_connection_t *c)
+{
+    int        err;
+    socklen_t  len;
+
+    err = 0;
+    len = sizeof(int);
+
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len) == -1) {
+        err = ngx_socket_errno;
+    }
+
+    if (err) {
+        ngx_log_error(NGX_LOG_ERR, c->log, err,
+                "ngx_http_stat_tcp_connect: connect failed");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_stat_tcp_write_handler(ngx_event_t *wev)
+{
+    ngx_connection_t        *c;
+    ngx_http_stat_sink_t    *sink;
+    ngx_http_stat_stream_t  *stream;
+
+    c = wev->data;
+    sink = c->data;
+    stream = &sink->stream;
+
+    if (!stream->connected) {
+
+        if (wev->timedout) {
+            ngx_log_error(NGX_LOG_ERR, wev->log, NGX_ETIMEDOUT,
+                    "ngx_http_stat_tcp_connect: connect to \"%V\" "
+                    "timed out", &sink->server.name);
+            goto failed;
+        }
+
+        if (wev->timer_set) {
+            ngx_del_timer(wev);
+        }
+
+        if (ngx_http_stat_net_test_connect(c) != NGX_OK) {
+            goto failed;
+        }
+
+        stream->connected = 1;
+        stream->backoff = 0;
+        sink->failed = 0;
+
+        ngx_http_stat_net_replay_tcp(sink);
+    }
+
+    ngx_http_stat_net_flush_tcp(sink, wev->log);
+
+    return;
+
+failed:
+
+    ngx_http_stat_tcp_close(sink);
+    ngx_http_stat_net_reconnect_tcp(sink);
+}
+
+
+static void
+ngx_http_stat_tcp_read_handler(ngx_event_t *rev)
+{
+    u_char                   buf[1024];
+    ssize_t                  n;
+    ngx_connection_t        *c;
+    ngx_http_stat_sink_t    *sink;
+    ngx_http_stat_stream_t  *stream;
+
+    c = rev->data;
+    sink = c->data;
+    stream = &sink->stream;
+
+    /*
+     * tcp servers are not supposed to answer, so anything but EAGAIN
+     * is EOF there; http responses are parsed to release inflight
+     * requests
+     */
+
+    for ( ;; ) {
+
+        n = c->recv(c, buf, sizeof(buf));
+
+        if (n == NGX_AGAIN) {
+
+            if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+                break;
+            }
+
+            if (stream->http && stream->connected) {
+                ngx_http_stat_net_flush_tcp(sink, rev->log);
+            }
+
+            return;
+        }
+
+        if (n <= 0) {
+            break;
+        }
+
+        if (stream->http
+                && ngx_http_stat_net_parse_http(sink, buf, buf + n,
+                    rev->log) != NGX_OK)
+        {
+            break;
+        }
+    }
+
+    if (n == 0 && stream->awaiting == 0) {
+        ngx_log_error(NGX_LOG_INFO, rev->log, 0,
+                "ngx_http_stat_tcp_read_handler: \"%V\" closed "
+                "connection", &sink->server.name);
+
+    } else {
+        ngx_log_error(NGX_LOG_NOTICE, rev->log, 0,
+                "ngx_http_stat_tcp_read_handler: \"%V\" closed "
+                "connection unexpectedly", &sink->server.name);
+    }
+
+    ngx_http_stat_tcp_close(sink);
+
+    if (stream->out) {
+        ngx_http_stat_net_reconnect_tcp(sink);
+    }
+}
+
+
+static void
+ngx_http_stat_tcp_reconnect_handler(ngx_event_t *ev)
+{
+    ngx_http_stat_sink_t *sink;
+
+    sink = ev->data;
+
+    if (ngx_quit || ngx_terminate || ngx_exiting) {
+        return;
+    }
+
+    if (sink->stream.peer.connection == NULL && sink->stream.out) {
+        ngx_http_stat_tcp_connect(sink, ev->log);
+    }
+}
+/** }}} */
+
+/** HTTP part {{{
+ */
+ngx_int_t
+ngx_http_stat_http_init(ngx_http_stat_sink_t *sink, ngx_cycle_t *cycle)
+{
+    static ngx_str_t  content_type = ngx_string("text/plain; charset=utf-8");
+
+    return ngx_http_stat_http_setup(sink, cycle, &content_type, 0);
+}
+
+
+/** Prepares the stream for POST requests of "content_type", every body is
+ *  at most "batch" bytes plus a "prefix_size" bytes prefix.
+ */
+ngx_int_t
+ngx_http_stat_http_setup(ngx_http_stat_sink_t *sink, ngx_cycle_t *cycle,
+        ngx_str_t *content_type, size_t prefix_size)
+{
+    int                      rc;
+    ngx_http_stat_stream_t  *stream;
+
+    if (ngx_http_stat_tcp_init(sink, cycle) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    stream = &sink->stream;
+
+    stream->http = 1;
+    stream->content_type = *content_type;
+
+    /* a chunk is posted as one request */
+    sink->chunk_size = sink->batch_size;
+
+    if (sink->gzip) {
+
+        rc = deflateInit2(&stream->zstream, (int) sink->gzip, Z_DEFLATED,
+                MAX_WBITS + 16, MAX_MEM_LEVEL - 1, Z_DEFAULT_STRATEGY);
+
+        if (rc != Z_OK) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, 0,
+                    "ngx_http_stat_http_setup: deflateInit2() failed: %d",
+                    rc);
+            return NGX_ERROR;
+        }
+
+        /* gzip header and trailer are not counted by compressBound() */
+        stream->scratch_size = compressBound(sink->batch_size + prefix_size)
+                + 32;
+
+    } else {
+        stream->scratch_size = sink->batch_size + prefix_size;
+    }
+
+    stream->scratch = ngx_palloc(cycle->pool, stream->scratch_size);
+    if (stream->scratch == NULL) {
+        return NGX_ERROR;
+    }
+
+    stream->buf_size = sizeof("POST  HTTP/1.1" CRLF "Host: " CRLF
+            "Content-Type: " CRLF
+            "Content-Encoding: gzip" CRLF
+            "Content-Length: " CRLF CRLF) - 1 + NGX_SIZE_T_LEN
+            + sink->uri.len + sink->server.name.len + content_type->len
+            + stream->scratch_size;
+
+    stream->max_bufs = sink->queue_size / stream->buf_size;
+
+    if (stream->max_bufs == 0) {
+        stream->max_bufs = 1;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_stat_http_flush(ngx_http_stat_sink_t *sink, u_char *start,
+        u_char *last, ngx_log_t *log)
+{
+    if (start != last) {
+        ngx_http_stat_net_enqueue_http(sink, start, last, log);
+    }
+
+    ngx_http_stat_net_send_stream(sink, log);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_stat_net_enqueue_http(ngx_http_stat_sink_t *sink,
+        u_char *start, u_char *last, ngx_log_t *log)
+{
+    u_char  *p, *nl, *batch;
+
+    p = start;
+    batch = start;
+
+    /* cut the lines into batches of at most "batch" bytes */
+
+    while (p < last) {
+
+        nl = ngx_strlchr(p, last, '\n');
+        nl = nl ? nl + 1 : last;
+
+        if ((size_t) (nl - p) > sink->batch_size) {
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                    "ngx_http_stat_net_enqueue_http: batch size too small, "
+                    "need send %z to \"%V\"", (size_t) (nl - p),
+                    &sink->server.name);
+
+            if (p != batch
+                    && ngx_http_stat_http_post(sink, NULL, batch, p, log)
+                    != NGX_OK)
+            {
+                return;
+            }
+
+            p = nl;
+            batch = nl;
+            continue;
+        }
+
+        if ((size_t) (nl - batch) > sink->batch_size) {
+
+            if (ngx_http_stat_http_post(sink, NULL, batch, p, log)
+                    != NGX_OK)
+            {
+                return;
+            }
+
+            batch = p;
+        }
+
+        p = nl;
+    }
+
+    if (p != batch) {
+        ngx_http_stat_http_post(sink, NULL, batch, p, log);
+    }
+}
+
+
+/** Queues one POST request, the body is "prefix" followed by the bytes
+ *  from "start" to "last".
+ */
+ngx_int_t
+ngx_http_stat_http_post(ngx_http_stat_sink_t *sink, ngx_str_t *prefix,
+        u_char *start, u_char *last, ngx_log_t *log)
+{
+    int                      rc;
+    size_t                   len;
+    u_char                  *body;
+    ngx_buf_t               *b;
+    ngx_http_stat_stream_t  *stream;
+
+    stream = &sink->stream;
+
+    if (sink->gzip) {
+
+        stream->zstream.next_out = stream->scratch;
+        stream->zstream.avail_out = stream->scratch_size;
+
+        if (prefix) {
+            stream->zstream.next_in = prefix->data;
+            stream->zstream.avail_in = prefix->len;
+
+            rc = deflate(&stream->zstream, Z_NO_FLUSH);
+
+            if (rc != Z_OK) {
+                ngx_log_error(NGX_LOG_ALERT, log, 0,
+                        "ngx_http_stat_http_post: deflate() failed: %d",
+                        rc);
+                deflateReset(&stream->zstream);
+                return NGX_ERROR;
+            }
+        }
+
+        stream->zstream.next_in = start;
+        stream->zstream.avail_in = last - start;
+
+        rc = deflate(&stream->zstream, Z_FINISH);
+
+        if (rc != Z_STREAM_END) {
+            ngx_log_error(NGX_LOG_ALERT, log, 0,
+                    "ngx_http_stat_http_post: deflate() failed: %d",
+                    rc);
+            deflateReset(&stream->zstream);
+            return NGX_ERROR;
+        }
+
+        body = stream->scratch;
+        len = stream->scratch_size - stream->zstream.avail_out;
+
+        deflateReset(&stream->zstream);
+
+    } else {
+        body = start;
+        len = last - start;
+
+        if (prefix) {
+            len += prefix->len;
+        }
+    }
+
+    b = ngx_http_stat_tcp_append(sink);
+
+    if (b == NULL) {
+        ngx_log_error(NGX_LOG_WARN, log, 0,
+                "ngx_http_stat_http_post: queue to \"%V\" is full, "
+                "batch of %z bytes dropped", &sink->server.name,
+                (size_t) (last - start));
+        return NGX_OK;
+    }
+
+    b->last = ngx_sprintf(b->last,
+            "POST %V HTTP/1.1" CRLF
+            "Host: %V" CRLF
+            "Content-Type: %V" CRLF
+            "%s"
+            "Content-Length: %uz" CRLF CRLF,
+            &sink->uri, &sink->server.name, &stream->content_type,
+            sink->gzip ? "Content-Encoding: gzip" CRLF : "", len);
+
+    if (prefix && !sink->gzip) {
+        b->last = ngx_cpymem(b->last, prefix->data, prefix->len);
+        len -= prefix->len;
+    }
+
+    b->last = ngx_cpymem(b->last, body, len);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_stat_net_parse_http(ngx_http_stat_sink_t *sink,
+        u_char *p, u_char *last, ngx_log_t *log)
+{
+    size_t                   n;
+    u_char                  *nl, *line, *semi;
+    ngx_int_t                status, size;
+    ngx_http_stat_stream_t  *stream;
+
+    enum {
+        sw_status = 0,
+        sw_header,
+        sw_body,
+        sw_chunk_size,
+        sw_chunk_end,
+        sw_trailer
+    };
+
+    stream = &sink->stream;
+
+    while (p < last) {
+
+        if (stream->state == sw_body) {
+
+            n = ngx_min((off_t) (last - p), stream->rest);
+
+            p += n;
+            stream->rest -= n;
+
+            if (stream->rest) {
+                return NGX_OK;
+            }
+
+            /* the CRLF after the data of a chunk */
+
+            if (stream->chunked) {
+                stream->state = sw_chunk_end;
+                continue;
+            }
+
+            goto done;
+        }
+
+        nl = ngx_strlchr(p, last, '\n');
+
+        /* a too long header line is truncated, only short ones matter */
+
+        n = ngx_min((size_t) ((nl ? nl : last) - p),
+                sizeof(stream->line) - stream->line_len);
+
+        ngx_memcpy(stream->line + stream->line_len, p, n);
+        stream->line_len += n;
+
+        if (nl == NULL) {
+            return NGX_OK;
+        }
+
+        p = nl + 1;
+
+        line = stream->line;
+        n = stream->line_len;
+        stream->line_len = 0;
+
+        if (n && line[n - 1] == '\r') {
+            n--;
+        }
+
+        switch (stream->state) {
+
+        case sw_status:
+
+            if (n < sizeof("HTTP/1.x 200") - 1
+                    || ngx_strncmp(line, "HTTP/1.", sizeof("HTTP/1.") - 1)
+                    != 0)
+            {
+                ngx_log_error(NGX_LOG_ERR, log, 0,
+                        "ngx_http_stat_net_parse_http: \"%V\" sent "
+                        "invalid status line", &sink->server.name);
+                return NGX_ERROR;
+            }
+
+            status = ngx_atoi(line + sizeof("HTTP/1.x ") - 1, 3);
+            if (status == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+
+            stream->status = status;
+            stream->rest = 0;
+            stream->chunked = 0;
+            stream->close = (line[sizeof("HTTP/1.") - 1] == '0');
+            stream->state = sw_header;
+
+            continue;
+
+        case sw_chunk_size:
+
+            /* the extensions of a chunk are skipped */
+
+            semi = ngx_strlchr(line, line + n, ';');
+            if (semi) {
+                n = semi - line;
+            }
+
+            while (n && (line[n - 1] == ' ' || line[n - 1] == '\t')) {
+                n--;
+            }
+
+            size = ngx_hextoi(line, n);
+            if (size == NGX_ERROR) {
+                ngx_log_error(NGX_LOG_ERR, log, 0,
+                        "ngx_http_stat_net_parse_http: \"%V\" sent "
+                        "invalid chunk size", &sink->server.name);
+                return NGX_ERROR;
+            }
+
+            if (size == 0) {
+                stream->state = sw_trailer;
+                continue;
+            }
+
+            stream->rest = size;
+            stream->state = sw_body;
+
+            continue;
+
+        case sw_chunk_end:
+
+            if (n) {
+                ngx_log_error(NGX_LOG_ERR, log, 0,
+                        "ngx_http_stat_net_parse_http: \"%V\" sent "
+                        "invalid chunk", &sink->server.name);
+                return NGX_ERROR;
+            }
+
+            stream->state = sw_chunk_size;
+
+            continue;
+
+        case sw_trailer:
+
+            if (n) {
+                continue;
+            }
+
+            goto done;
+
+        default: /* sw_header */
+            break;
+        }
+
+        if (n == 0) {
+
+            if (stream->chunked) {
+                stream->state = sw_chunk_size;
+                continue;
+            }
+
+            if (stream->rest) {
+                stream->state = sw_body;
+                continue;
+            }
+
+            goto done;
+        }
+
+        if (n > sizeof("Content-Length:") - 1
+                && ngx_strncasecmp(line, (u_char *) "Content-Length:",
+                    sizeof("Content-Length:") - 1) == 0)
+        {
+            line += sizeof("Content-Length:") - 1;
+            n -= sizeof("Content-Length:") - 1;
+
+            while (n && *line == ' ') {
+                line++;
+                n--;
+            }
+
+            stream->rest = ngx_atoof(line, n);
+            if (stream->rest == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+
+        } else if (n > sizeof("Transfer-Encoding:") - 1
+                && ngx_strncasecmp(line, (u_char *) "Transfer-Encoding:",
+                    sizeof("Transfer-Encoding:") - 1) == 0)
+        {
+            /* chunked is the last coding, and it takes over the length */
+
+            while (n && line[n - 1] == ' ') {
+                n--;
+            }
+
+            if (n >= sizeof("chunked") - 1
+                    && ngx_strncasecmp(line + n - (sizeof("chunked") - 1),
+                        (u_char *) "chunked", sizeof("chunked") - 1) == 0)
+            {
+                stream->chunked = 1;
+
+            } else {
+
+                /* the body of another coding ends with the connection */
+
+                stream->close = 1;
+            }
+
+        } else if (n >= sizeof("Connection: close") - 1
+                && ngx_strncasecmp(line, (u_char *) "Connection: close",
+                    sizeof("Connection: close") - 1) == 0)
+        {
+            stream->close = 1;
+        }
+
+        continue;
+
+    done:
+
+        stream->state = sw_status;
+
+        if (stream->awaiting) {
+            stream->awaiting--;
+        }
+
+        if (stream->status / 100 != 2) {
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                    "ngx_http_stat_net_parse_http: \"%V\" responded "
+                    "with status %ui", &sink->server.name, stream->status);
+        }
+
+        if (stream->close) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+/** }}} */
+
+/** Resolver part {{{
+ */
+void
+ngx_http_stat_resolve_init(ngx_http_stat_sink_t *sink, ngx_cycle_t *cycle)
+{
+    ngx_memzero(&sink->resolve_timer, sizeof(ngx_event_t));
+
+    sink->resolve_timer.handler = ngx_http_stat_resolve_handler;
+    sink->resolve_timer.data = sink;
+    sink->resolve_timer.log = cycle->log;
+    sink->resolve_timer.cancelable = 1;
+
+    sink->resolve_ctx = NULL;
+}
+
+
+void
+ngx_http_stat_resolve_start(ngx_http_stat_sink_t *sink)
+{
+    if (sink->resolve && sink->server.host.len
+            && !sink->resolve_timer.timer_set)
+    {
+        ngx_add_timer(&sink->resolve_timer, sink->resolve);
+    }
+}
+
+
+void
+ngx_http_stat_resolve_stop(ngx_http_stat_sink_t *sink)
+{
+    if (sink->resolve_timer.timer_set) {
+        ngx_del_timer(&sink->resolve_timer);
+    }
+}
+
+
+/** Resolves the server name through the "resolver" of the http block, the
+ *  answers are cached by the resolver for their TTL, so a name is asked
+ *  again only when it could have changed.
+ */
+static void
+ngx_http_stat_resolve_handler(ngx_event_t *ev)
+{
+    ngx_resolver_ctx_t    *ctx;
+    ngx_http_stat_sink_t  *sink;
+
+    sink = ev->data;
+
+    if (ngx_quit || ngx_terminate || ngx_exiting || sink->resolve_ctx) {
+        return;
+    }
+
+    ctx = ngx_resolve_start(sink->smcf->resolver, NULL);
+
+    if (ctx == NULL) {
+        goto next;
+    }
+
+    if (ctx == NGX_NO_RESOLVER) {
+        ngx_log_error(NGX_LOG_ERR, ev->log, 0,
+                "ngx_http_stat_resolve_handler: no resolver defined "
+                "to resolve \"%V\"", &sink->server.host);
+        return;
+    }
+
+    ctx->name = sink->server.host;
+    ctx->handler = ngx_http_stat_resolve_done;
+    ctx->data = sink;
+    ctx->timeout = sink->smcf->resolver_timeout;
+    ctx->cancelable = 1;
+
+    sink->resolve_ctx = ctx;
+
+    if (ngx_resolve_name(ctx) != NGX_OK) {
+        sink->resolve_ctx = NULL;
+        goto next;
+    }
+
+    return;
+
+next:
+
+    ngx_add_timer(ev, sink->resolve);
+}
+
+
+static void
+ngx_http_stat_resolve_done(ngx_resolver_ctx_t *ctx)
+{
+    u_char                   text[NGX_SOCKADDR_STRLEN];
+    ngx_str_t                addr;
+    ngx_log_t               *log;
+    ngx_uint_t               i;
+    ngx_http_stat_sink_t    *sink;
+    ngx_http_stat_server_t  *server;
+
+    sink = ctx->data;
+    server = &sink->server;
+    log = sink->resolve_timer.log;
+
+    sink->resolve_ctx = NULL;
+
+    if (ctx->state || ctx->naddrs == 0) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                "ngx_http_stat_resolve_done: \"%V\" could not be resolved "
+                "(%i: %s), \"%V\" is kept", &ctx->name, ctx->state,
+                ngx_resolver_strerror(ctx->state), &server->name);
+        goto done;
+    }
+
+    /* the current address is kept while the name still has it */
+
+    for (i = 0; i < ctx->naddrs; i++) {
+
+        if (ngx_cmp_sockaddr(ctx->addrs[i].sockaddr, ctx->addrs[i].socklen,
+                    server->sockaddr, server->socklen, 0) == NGX_OK)
+        {
+            goto done;
+        }
+    }
+
+    ngx_memcpy(&server->addr, ctx->addrs[0].sockaddr, ctx->addrs[0].socklen);
+    ngx_inet_set_port(&server->addr.sockaddr, server->port);
+
+    server->sockaddr = &server->addr.sockaddr;
+    server->socklen = ctx->addrs[0].socklen;
+
+    addr.data = text;
+    addr.len = ngx_sock_ntop(server->sockaddr, server->socklen, text,
+            NGX_SOCKADDR_STRLEN, 1);
+
+    ngx_log_error(NGX_LOG_NOTICE, log, 0,
+            "ngx_http_stat_resolve_done: \"%V\" moved to %V",
+            &server->name, &addr);
+
+    /* udp connects on every flush, a stream reconnects on the next one */
+    sink->backend->close(sink);
+
+done:
+
+    ngx_resolve_name_done(ctx);
+
+    if (ngx_quit || ngx_terminate || ngx_exiting || !sink->smcf->leading) {
+        return;
+    }
+
+    ngx_add_timer(&sink->resolve_timer, sink->resolve);
+}
+/** }}} */
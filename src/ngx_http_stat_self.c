@@ -0,0 +1,258 @@
+
+/**
+ * (c) BSD-2-Cause, link: https://opensource.org/licenses/BSD-2-Clause
+ * (c) V. Soshnikov, mailto: dedok.mad@gmail.com
+ */
+
+#include "ngx_http_stat_module.h"
+
+
+#define NGX_HTTP_STAT_SELF_COUNTERS \
+    (sizeof(ngx_http_stat_self_t) / sizeof(ngx_atomic_t))
+
+
+static void ngx_http_stat_self_take(ngx_http_stat_self_t *shared,
+        ngx_http_stat_self_t *self, ngx_uint_t drain);
+static double ngx_http_stat_self_average(ngx_atomic_uint_t total,
+        ngx_atomic_uint_t n);
+
+
+/* the times are in microseconds per request, snapshot or export */
+static ngx_str_t ngx_http_stat_self_names[] = {
+    ngx_string("stat_records"),
+    ngx_string("stat_record_time"),
+    ngx_string("stat_handler_lock_wait"),
+    ngx_string("stat_handler_lock_hold"),
+    ngx_string("stat_flush_lock_wait"),
+    ngx_string("stat_flush_lock_hold"),
+    ngx_string("stat_flush_time"),
+    ngx_string("stat_bytes"),
+    ngx_string("stat_packets_sent"),
+    ngx_string("stat_packets_failed"),
+    ngx_string("stat_nomemory"),
+    ngx_string("stat_nomemory_largest"),
+    ngx_string("stat_shm_used"),
+    ngx_string("stat_shm_free"),
+    ngx_string("stat_metrics"),
+    ngx_string("stat_statistics"),
+    ngx_string("stat_series")
+};
+
+#define NGX_HTTP_STAT_SELF_SERIES \
+    (sizeof(ngx_http_stat_self_names) / sizeof(ngx_str_t))
+
+
+/** Self-instrumentation part {{{
+ *
+ * A request only adds to the counters of its worker, they are added to the
+ * storage once per election tick, so the hot path never touches a shared
+ * cache line more than it did before. The flush path runs once per tick
+ * (possibly in a thread) and adds to the storage directly.
+ */
+uint64_t
+ngx_http_stat_self_clock(void)
+{
+#if (NGX_HAVE_CLOCK_MONOTONIC)
+    struct timespec  ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+    struct timeval   tv;
+
+    ngx_gettimeofday(&tv);
+
+    return ((uint64_t) tv.tv_sec * 1000000 + tv.tv_usec) * 1000;
+#endif
+}
+
+
+void
+ngx_http_stat_self_record(ngx_http_stat_main_conf_t *smcf, uint64_t start,
+        uint64_t locked, uint64_t unlocked)
+{
+    ngx_http_stat_self_t *counters;
+
+    counters = &smcf->counters;
+
+    counters->records++;
+    counters->record_time += ngx_http_stat_self_clock() - start;
+    counters->handler_wait += locked - start;
+    counters->handler_hold += unlocked - locked;
+}
+
+
+void
+ngx_http_stat_self_snapshot(ngx_http_stat_main_conf_t *smcf, uint64_t start,
+        uint64_t locked, uint64_t unlocked)
+{
+    ngx_slab_pool_t          *shpool;
+    ngx_http_stat_storage_t  *storage;
+
+    shpool = (ngx_slab_pool_t *) smcf->shared->shm.addr;
+    storage = (ngx_http_stat_storage_t *) shpool->data;
+
+    (void) ngx_atomic_fetch_add(&storage->self.snapshots, 1);
+    (void) ngx_atomic_fetch_add(&storage->self.flush_wait, locked - start);
+    (void) ngx_atomic_fetch_add(&storage->self.flush_hold, unlocked - locked);
+}
+
+
+void
+ngx_http_stat_self_export(ngx_http_stat_main_conf_t *smcf, uint64_t start,
+        size_t bytes)
+{
+    ngx_slab_pool_t          *shpool;
+    ngx_http_stat_storage_t  *storage;
+
+    shpool = (ngx_slab_pool_t *) smcf->shared->shm.addr;
+    storage = (ngx_http_stat_storage_t *) shpool->data;
+
+    (void) ngx_atomic_fetch_add(&storage->self.flushes, 1);
+    (void) ngx_atomic_fetch_add(&storage->self.flush_time,
+            ngx_http_stat_self_clock() - start);
+    (void) ngx_atomic_fetch_add(&storage->self.bytes, bytes);
+}
+
+
+/** Adds the counters of the worker to the storage */
+void
+ngx_http_stat_self_merge(ngx_http_stat_main_conf_t *smcf)
+{
+    ngx_uint_t                i;
+    ngx_atomic_t             *local, *shared;
+    ngx_slab_pool_t          *shpool;
+    ngx_http_stat_storage_t  *storage;
+
+    if (!smcf->self) {
+        return;
+    }
+
+    shpool = (ngx_slab_pool_t *) smcf->shared->shm.addr;
+    storage = (ngx_http_stat_storage_t *) shpool->data;
+
+    local = (ngx_atomic_t *) &smcf->counters;
+    shared = (ngx_atomic_t *) &storage->self;
+
+    for (i = 0; i < NGX_HTTP_STAT_SELF_COUNTERS; i++) {
+
+        if (local[i]) {
+            (void) ngx_atomic_fetch_add(&shared[i], local[i]);
+            local[i] = 0;
+        }
+    }
+}
+
+
+/** Appends the series of the module to the snapshot. The snapshot of the
+ *  slowest sink takes the counters out of the storage, so every series
+ *  covers the time since its previous export whichever worker exported it,
+ *  and the faster sinks read them as they have grown since then.
+ */
+ngx_int_t
+ngx_http_stat_self_series(ngx_http_stat_main_conf_t *smcf,
+        ngx_http_stat_snapshot_t *snapshot)
+{
+    double                    values[NGX_HTTP_STAT_SELF_SERIES];
+    ngx_uint_t                i, failures;
+    ngx_slab_pool_t          *shpool;
+    ngx_http_stat_self_t      self;
+    ngx_http_stat_series_t   *series, *sr;
+    ngx_http_stat_storage_t  *storage;
+
+    shpool = (ngx_slab_pool_t *) smcf->shared->shm.addr;
+    storage = (ngx_http_stat_storage_t *) shpool->data;
+
+    ngx_http_stat_self_take(&storage->self, &self, snapshot->restart);
+
+    /* only the exporter writes it, the allocator counts under the lock */
+    failures = storage->allocator->failures;
+
+    values[0] = self.records;
+    values[1] = ngx_http_stat_self_average(self.record_time, self.records);
+    values[2] = ngx_http_stat_self_average(self.handler_wait, self.records);
+    values[3] = ngx_http_stat_self_average(self.handler_hold, self.records);
+    values[4] = ngx_http_stat_self_average(self.flush_wait, self.snapshots);
+    values[5] = ngx_http_stat_self_average(self.flush_hold, self.snapshots);
+    values[6] = ngx_http_stat_self_average(self.flush_time, self.flushes);
+    values[7] = self.bytes;
+    values[8] = self.sent;
+    values[9] = self.failed;
+    values[10] = failures - storage->nomemory;
+    values[11] = storage->allocator->largest_failure;
+    values[12] = (shpool->end - shpool->start) - shpool->pfree * ngx_pagesize;
+    values[13] = shpool->pfree * ngx_pagesize;
+    values[14] = storage->metrics->nelts;
+    values[15] = storage->statistics->nelts;
+    values[16] = snapshot->nseries;
+
+    if (snapshot->restart) {
+        storage->nomemory = failures;
+    }
+
+    series = ngx_palloc(snapshot->pool, sizeof(ngx_http_stat_series_t)
+            * (snapshot->nseries + NGX_HTTP_STAT_SELF_SERIES));
+    if (series == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(series, snapshot->series,
+            sizeof(ngx_http_stat_series_t) * snapshot->nseries);
+
+    for (i = 0; i < NGX_HTTP_STAT_SELF_SERIES; i++) {
+
+        sr = &series[snapshot->nseries + i];
+
+        sr->split = SPLIT_INTERNAL;
+        sr->param = ngx_http_stat_self_names[i];
+        ngx_str_null(&sr->interval);
+        sr->window = 0;
+        sr->percentile = 0;
+        sr->aggregate = NULL;
+        sr->value = values[i];
+        sr->stt = NULL;
+        sr->index = NGX_HTTP_STAT_NO_INDEX;
+    }
+
+    snapshot->series = series;
+    snapshot->nseries += NGX_HTTP_STAT_SELF_SERIES;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_stat_self_take(ngx_http_stat_self_t *shared,
+        ngx_http_stat_self_t *self, ngx_uint_t drain)
+{
+    ngx_uint_t          i;
+    ngx_atomic_t       *from, *to;
+    ngx_atomic_uint_t   v;
+
+    from = (ngx_atomic_t *) shared;
+    to = (ngx_atomic_t *) self;
+
+    for (i = 0; i < NGX_HTTP_STAT_SELF_COUNTERS; i++) {
+        v = from[i];
+
+        if (drain) {
+            (void) ngx_atomic_fetch_add(&from[i], -(ngx_atomic_int_t) v);
+        }
+
+        to[i] = v;
+    }
+}
+
+
+static double
+ngx_http_stat_self_average(ngx_atomic_uint_t total, ngx_atomic_uint_t n)
+{
+    if (n == 0) {
+        return 0;
+    }
+
+    /* nanoseconds to microseconds */
+    return (double) total / n / 1000;
+}
+/** }}} */
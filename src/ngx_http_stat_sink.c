@@ -0,0 +1,1103 @@
+
+/**
+ * (c) BSD-2-Cause, link: https://opensource.org/licenses/BSD-2-Clause
+ * (c) V. Soshnikov, mailto: dedok.mad@gmail.com
+ */
+
+#include "ngx_http_stat_module.h"
+
+
+/* how often the workers check the exporter, ms */
+#define NGX_HTTP_STAT_ELECTION 1000
+
+/* a silent exporter is replaced after, s */
+#define NGX_HTTP_STAT_TAKEOVER 5
+
+/* points of every server on the hash ring */
+#define NGX_HTTP_STAT_RING_POINTS 160
+
+
+#if (NGX_THREADS)
+typedef struct {
+    ngx_http_stat_sink_t  *sink;
+} ngx_http_stat_sink_task_ctx_t;
+#endif
+
+
+static void ngx_http_stat_election_handler(ngx_event_t *ev);
+static void ngx_http_stat_sinks_start(ngx_http_stat_main_conf_t *smcf);
+static void ngx_http_stat_sinks_stop(ngx_http_stat_main_conf_t *smcf);
+static void ngx_http_stat_sinks_final(ngx_http_stat_main_conf_t *smcf,
+        ngx_log_t *log);
+static void ngx_http_stat_sink_timer_handler(ngx_event_t *ev);
+static void ngx_http_stat_sink_export(ngx_http_stat_sink_t *sink,
+        ngx_http_stat_backend_flush_pt flush, ngx_log_t *log);
+static size_t ngx_http_stat_sink_export_shard(ngx_http_stat_sink_t *sink,
+        ngx_http_stat_snapshot_t *snapshot,
+        ngx_http_stat_backend_flush_pt flush, ngx_log_t *log);
+static int ngx_libc_cdecl ngx_http_stat_sink_cmp_points(const void *one,
+        const void *two);
+static ngx_uint_t ngx_http_stat_sink_owner(ngx_http_stat_sink_t *sink,
+        ngx_http_stat_series_t *series);
+#if (NGX_THREADS)
+static void ngx_http_stat_sink_post(ngx_http_stat_main_conf_t *smcf,
+        ngx_log_t *log);
+static void ngx_http_stat_sink_task_handler(void *data, ngx_log_t *log);
+static void ngx_http_stat_sink_task_done(ngx_event_t *ev);
+static ngx_int_t ngx_http_stat_sink_keep(ngx_http_stat_sink_t *sink,
+        u_char *start, u_char *last, ngx_log_t *log);
+#endif
+static int ngx_libc_cdecl ngx_http_stat_sink_cmp_series(const void *one,
+        const void *two);
+static ngx_http_stat_history_t *ngx_http_stat_sink_history(
+        ngx_http_stat_sink_t *sink, ngx_http_stat_snapshot_t *snapshot,
+        ngx_log_t *log);
+static ngx_int_t ngx_http_stat_sink_grow(ngx_http_stat_allocator_t *allocator,
+        ngx_http_stat_sent_t **sent, ngx_uint_t *n, ngx_uint_t need);
+static ngx_http_stat_sent_t *ngx_http_stat_sink_sent(
+        ngx_http_stat_history_t *history, ngx_http_stat_series_t *series);
+
+
+static ngx_http_stat_backend_t ngx_http_stat_backends[] = {
+
+    {   ngx_string("influx/udp"),
+        8089,
+        ngx_null_string,
+        ngx_http_stat_udp_init,
+        ngx_http_influx_serialize,
+        ngx_http_stat_udp_flush,
+        ngx_http_stat_udp_connect,
+        ngx_http_stat_udp_close,
+        NULL },
+
+    {   ngx_string("influx/tcp"),
+        8089,
+        ngx_null_string,
+        ngx_http_stat_tcp_init,
+        ngx_http_influx_serialize,
+        ngx_http_stat_tcp_flush,
+        ngx_http_stat_tcp_connect,
+        ngx_http_stat_tcp_close,
+        ngx_http_stat_tcp_drain },
+
+    {   ngx_string("influx/http"),
+        8086,
+        ngx_string("/write?db=nginx&precision=s"),
+        ngx_http_stat_http_init,
+        ngx_http_influx_serialize,
+        ngx_http_stat_http_flush,
+        ngx_http_stat_tcp_connect,
+        ngx_http_stat_tcp_close,
+        ngx_http_stat_tcp_drain },
+
+    {   ngx_string("graphite/udp"),
+        2003,
+        ngx_null_string,
+        ngx_http_stat_udp_init,
+        ngx_http_graphite_serialize,
+        ngx_http_stat_udp_flush,
+        ngx_http_stat_udp_connect,
+        ngx_http_stat_udp_close,
+        NULL },
+
+    {   ngx_string("graphite/tcp"),
+        2003,
+        ngx_null_string,
+        ngx_http_stat_tcp_init,
+        ngx_http_graphite_serialize,
+        ngx_http_stat_tcp_flush,
+        ngx_http_stat_tcp_connect,
+        ngx_http_stat_tcp_close,
+        ngx_http_stat_tcp_drain },
+
+    {   ngx_string("graphite/pickle"),
+        2004,
+        ngx_null_string,
+        ngx_http_graphite_pickle_init,
+        ngx_http_graphite_pickle_serialize,
+        ngx_http_graphite_pickle_flush,
+        ngx_http_stat_tcp_connect,
+        ngx_http_stat_tcp_close,
+        ngx_http_stat_tcp_drain },
+
+    {   ngx_string("statsd"),
+        8125,
+        ngx_null_string,
+        ngx_http_stat_udp_init,
+        ngx_http_statsd_serialize,
+        ngx_http_stat_udp_flush,
+        ngx_http_stat_udp_connect,
+        ngx_http_stat_udp_close,
+        NULL },
+
+    {   ngx_string("otlp/http"),
+        4318,
+        ngx_string("/v1/metrics"),
+        ngx_http_otlp_init,
+        ngx_http_otlp_serialize,
+        ngx_http_otlp_flush,
+        ngx_http_stat_tcp_connect,
+        ngx_http_stat_tcp_close,
+        ngx_http_stat_tcp_drain },
+};
+
+
+ngx_http_stat_backend_t *
+ngx_http_stat_backend(ngx_str_t *protocol)
+{
+    ngx_uint_t                i;
+    ngx_http_stat_backend_t  *backend;
+
+    for (i = 0; i < ARR_SIZE(ngx_http_stat_backends); i++) {
+
+        backend = &ngx_http_stat_backends[i];
+
+        if (backend->name.len == protocol->len
+                && ngx_strncmp(backend->name.data, protocol->data,
+                    protocol->len) == 0)
+        {
+            return backend;
+        }
+    }
+
+    return NULL;
+}
+
+
+ngx_int_t
+ngx_http_stat_sinks_init(ngx_http_stat_main_conf_t *smcf, ngx_cycle_t *cycle)
+{
+    ngx_uint_t             i;
+    ngx_http_stat_sink_t  *sink;
+
+    ngx_memzero(&smcf->snapshot, sizeof(ngx_http_stat_snapshot_t));
+
+    for (i = 0; i < smcf->sinks->nelts; i++) {
+
+        sink = &((ngx_http_stat_sink_t *) smcf->sinks->elts)[i];
+
+        if (sink->backend->init(sink, cycle) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        sink->buffer.start = ngx_palloc(cycle->pool, sink->chunk_size);
+        if (sink->buffer.start == NULL) {
+            return NGX_ERROR;
+        }
+
+        sink->buffer.end = sink->buffer.start + sink->chunk_size;
+
+        ngx_memzero(&sink->timer, sizeof(ngx_event_t));
+
+        sink->timer.handler = ngx_http_stat_sink_timer_handler;
+        sink->timer.data = sink;
+        sink->timer.log = cycle->log;
+
+        /* a graceful exit does not wait for them, the exit hook exports */
+        sink->timer.cancelable = 1;
+
+        ngx_http_stat_resolve_init(sink, cycle);
+    }
+
+#if (NGX_THREADS)
+    if (smcf->thread_pool) {
+
+        smcf->task = ngx_thread_task_alloc(cycle->pool,
+                sizeof(ngx_http_stat_sink_task_ctx_t));
+        if (smcf->task == NULL) {
+            return NGX_ERROR;
+        }
+
+        smcf->task->handler = ngx_http_stat_sink_task_handler;
+        smcf->task->event.handler = ngx_http_stat_sink_task_done;
+        smcf->task->event.data = smcf->task;
+        smcf->task->event.log = cycle->log;
+    }
+#endif
+
+    /* every worker is ready to export, but only the elected one does */
+
+    ngx_memzero(&smcf->election, sizeof(ngx_event_t));
+
+    smcf->election.handler = ngx_http_stat_election_handler;
+    smcf->election.data = smcf;
+    smcf->election.log = cycle->log;
+    smcf->election.cancelable = 1;
+
+    smcf->leading = 0;
+
+    ngx_add_timer(&smcf->election, NGX_HTTP_STAT_ELECTION);
+
+    return NGX_OK;
+}
+
+
+/** Gives up the export on worker exit, so another worker takes it over on
+ *  its next election tick instead of waiting for the heartbeat to expire.
+ *  On a graceful exit the exporter writes the checkpoint last time and
+ *  sends what has been recorded since the last export.
+ */
+void
+ngx_http_stat_sinks_exit(ngx_http_stat_main_conf_t *smcf)
+{
+    ngx_slab_pool_t          *shpool;
+    ngx_http_stat_storage_t  *storage;
+
+    if (!smcf->leading) {
+        return;
+    }
+
+    if (!ngx_terminate) {
+
+        if (smcf->checkpoint.path.len) {
+            (void) ngx_http_stat_checkpoint_write(smcf, ngx_cycle->log);
+        }
+
+        ngx_http_stat_sinks_final(smcf, ngx_cycle->log);
+    }
+
+    ngx_http_stat_sinks_stop(smcf);
+
+    shpool = (ngx_slab_pool_t *) smcf->shared->shm.addr;
+    storage = (ngx_http_stat_storage_t *) shpool->data;
+
+    (void) ngx_atomic_cmp_set(&storage->leader, (ngx_atomic_uint_t) ngx_pid,
+            0);
+}
+
+
+/** Exports every sink once more, whatever its frequency, and sends the
+ *  queues of the stream transports out within "exit_flush".
+ */
+static void
+ngx_http_stat_sinks_final(ngx_http_stat_main_conf_t *smcf, ngx_log_t *log)
+{
+    ngx_uint_t             i;
+    ngx_msec_t             start, elapsed;
+    ngx_http_stat_sink_t  *sink;
+
+    if (smcf->exit_flush == 0) {
+        return;
+    }
+
+#if (NGX_THREADS)
+    if (smcf->task
+            && ((ngx_http_stat_sink_task_ctx_t *) smcf->task->ctx)->sink)
+    {
+        /* the thread still uses the snapshot and the buffers */
+
+        ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                "stat final export skipped, an export is running in \"%V\"",
+                &smcf->thread_pool_name);
+        return;
+    }
+#endif
+
+    smcf->exiting = 1;
+
+    ngx_time_update();
+    start = ngx_current_msec;
+
+    for (i = 0; i < smcf->sinks->nelts; i++) {
+
+        sink = &((ngx_http_stat_sink_t *) smcf->sinks->elts)[i];
+
+        if (sink->shard == 0) {
+            ngx_http_stat_sink_export(sink, sink->backend->flush, log);
+        }
+    }
+
+    for (i = 0; i < smcf->sinks->nelts; i++) {
+
+        sink = &((ngx_http_stat_sink_t *) smcf->sinks->elts)[i];
+
+        if (sink->backend->drain == NULL) {
+            continue;
+        }
+
+        ngx_time_update();
+        elapsed = ngx_current_msec - start;
+
+        sink->backend->drain(sink, elapsed < smcf->exit_flush
+                ? smcf->exit_flush - elapsed : 0, log);
+    }
+}
+
+
+/** The exporter is a worker whose pid is in the shared memory, the others
+ *  only read two atomics per tick and never touch the flush path.
+ */
+static void
+ngx_http_stat_election_handler(ngx_event_t *ev)
+{
+    time_t                      now;
+    ngx_atomic_uint_t           leader;
+    ngx_slab_pool_t            *shpool;
+    ngx_http_stat_storage_t    *storage;
+    ngx_http_stat_main_conf_t  *smcf;
+
+    smcf = ev->data;
+
+    if (ngx_quit || ngx_terminate || ngx_exiting) {
+        return;
+    }
+
+    shpool = (ngx_slab_pool_t *) smcf->shared->shm.addr;
+    storage = (ngx_http_stat_storage_t *) shpool->data;
+
+    ngx_http_stat_self_merge(smcf);
+
+    now = ngx_time();
+    leader = storage->leader;
+
+    if (leader == (ngx_atomic_uint_t) ngx_pid) {
+        storage->heartbeat = (ngx_atomic_uint_t) now;
+
+        if (smcf->checkpoint.path.len
+                && now - storage->checkpoint_time
+                    >= (time_t) smcf->checkpoint.frequency)
+        {
+            storage->checkpoint_time = now;
+            (void) ngx_http_stat_checkpoint_write(smcf, ev->log);
+        }
+
+    } else {
+
+        if (smcf->leading) {
+            ngx_log_error(NGX_LOG_NOTICE, ev->log, 0,
+                    "stat exporter is taken over by %uA", leader);
+            ngx_http_stat_sinks_stop(smcf);
+        }
+
+        if ((leader == 0
+                || now - (time_t) storage->heartbeat > NGX_HTTP_STAT_TAKEOVER)
+            && ngx_atomic_cmp_set(&storage->leader, leader,
+                (ngx_atomic_uint_t) ngx_pid))
+        {
+            storage->heartbeat = (ngx_atomic_uint_t) now;
+
+            ngx_log_error(NGX_LOG_NOTICE, ev->log, 0,
+                    "stat exporter is elected, previous %uA", leader);
+
+            ngx_http_stat_sinks_start(smcf);
+        }
+    }
+
+    ngx_add_timer(ev, NGX_HTTP_STAT_ELECTION);
+}
+
+
+static void
+ngx_http_stat_sinks_start(ngx_http_stat_main_conf_t *smcf)
+{
+    ngx_uint_t             i;
+    ngx_http_stat_sink_t  *sink;
+
+    for (i = 0; i < smcf->sinks->nelts; i++) {
+
+        sink = &((ngx_http_stat_sink_t *) smcf->sinks->elts)[i];
+
+        /* the first server of a list exports the others */
+
+        if (sink->shard == 0) {
+            ngx_add_timer(&sink->timer, sink->frequency);
+        }
+
+        ngx_http_stat_resolve_start(sink);
+    }
+
+    smcf->leading = 1;
+}
+
+
+static void
+ngx_http_stat_sinks_stop(ngx_http_stat_main_conf_t *smcf)
+{
+    ngx_uint_t             i;
+    ngx_http_stat_sink_t  *sink;
+
+    for (i = 0; i < smcf->sinks->nelts; i++) {
+
+        sink = &((ngx_http_stat_sink_t *) smcf->sinks->elts)[i];
+
+        if (sink->timer.timer_set) {
+            ngx_del_timer(&sink->timer);
+        }
+
+        ngx_http_stat_resolve_stop(sink);
+
+#if (NGX_THREADS)
+        sink->pending = 0;
+#endif
+
+        sink->backend->close(sink);
+    }
+
+    smcf->leading = 0;
+}
+
+
+/** Returns the snapshot to export by the sink or NULL if it is not the time.
+ *  Sinks firing in the same second share one snapshot, so the storage is
+ *  locked and aggregated once per tick whatever the number of sinks. Only
+ *  the snapshot of the slowest sink restarts the percentiles and the self
+ *  counters.
+ */
+ngx_http_stat_snapshot_t *
+ngx_http_stat_sink_snapshot(ngx_http_stat_sink_t *sink, ngx_log_t *log)
+{
+    time_t                       ts;
+    ngx_uint_t                   frequency;
+    ngx_atomic_t                *event_time;
+    ngx_atomic_uint_t            last;
+    ngx_slab_pool_t             *shpool;
+    ngx_http_stat_storage_t     *storage;
+    ngx_http_stat_snapshot_t    *snapshot;
+    ngx_http_stat_main_conf_t   *smcf;
+
+    smcf = sink->smcf;
+    snapshot = &smcf->snapshot;
+
+    shpool = (ngx_slab_pool_t *) smcf->shared->shm.addr;
+    storage = (ngx_http_stat_storage_t *) shpool->data;
+
+    /*
+     * the zone of the next cycle exports the values it took over, the final
+     * export sends only the seconds recorded after the copy
+     */
+
+    if (storage->migrated && !smcf->exiting) {
+        return NULL;
+    }
+
+    ts = ngx_time();
+
+    /* a handover between exporters must not send a period twice */
+
+    event_time = &storage->event_times[sink->index];
+    last = *event_time;
+
+    /* the final export takes whatever is recorded since the last one */
+
+    frequency = smcf->exiting ? 1 : sink->frequency;
+
+    if ((ngx_uint_t) (ts - (time_t) last) * 1000 < frequency
+            || !ngx_atomic_cmp_set(event_time, last, (ngx_atomic_uint_t) ts))
+    {
+        return NULL;
+    }
+
+    /* a snapshot of the tick taken by a faster sink is taken again */
+
+    if (snapshot->pool && snapshot->time == ts
+            && snapshot->restart >= sink->restart)
+    {
+        return snapshot;
+    }
+
+    if (snapshot->pool) {
+        ngx_destroy_pool(snapshot->pool);
+        snapshot->pool = NULL;
+    }
+
+    if (storage->allocator->nomemory) {
+        ngx_log_error(NGX_LOG_ALERT, log, 0, "shared memory is full");
+    }
+
+    snapshot->pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, log);
+    if (snapshot->pool == NULL) {
+        return NULL;
+    }
+
+    snapshot->restart = sink->restart;
+    snapshot->series = ngx_http_stat_snapshot(smcf, snapshot->pool, NULL, 1,
+            snapshot->restart, &snapshot->nseries);
+
+    if (snapshot->series == NULL
+            || (smcf->self
+                && ngx_http_stat_self_series(smcf, snapshot) != NGX_OK))
+    {
+        ngx_destroy_pool(snapshot->pool);
+        snapshot->pool = NULL;
+        return NULL;
+    }
+
+    /* the series of one line are adjacent for the multi-field encoders */
+    ngx_qsort(snapshot->series, snapshot->nseries,
+            sizeof(ngx_http_stat_series_t), ngx_http_stat_sink_cmp_series);
+
+    snapshot->time = ts;
+
+    return snapshot;
+}
+
+
+/** Orders the series by split, interval and percentile */
+static int ngx_libc_cdecl
+ngx_http_stat_sink_cmp_series(const void *one, const void *two)
+{
+    const ngx_http_stat_series_t  *a = one, *b = two;
+
+    if (a->split != b->split) {
+        return a->split < b->split ? -1 : 1;
+    }
+
+    if (a->window != b->window) {
+        return a->window < b->window ? -1 : 1;
+    }
+
+    if (a->percentile != b->percentile) {
+        return a->percentile < b->percentile ? -1 : 1;
+    }
+
+    return 0;
+}
+
+
+/** Returns the history of a suppressing sink with room for every series
+ *  of the snapshot. The sink is exported by one worker at a time, so the
+ *  lock is only taken to extend the tables.
+ */
+static ngx_http_stat_history_t *
+ngx_http_stat_sink_history(ngx_http_stat_sink_t *sink,
+        ngx_http_stat_snapshot_t *snapshot, ngx_log_t *log)
+{
+    ngx_int_t                   rc;
+    ngx_uint_t                  i, nmetrics, nstatistics;
+    ngx_slab_pool_t            *shpool;
+    ngx_http_stat_series_t     *series;
+    ngx_http_stat_storage_t    *storage;
+    ngx_http_stat_history_t    *history;
+
+    shpool = (ngx_slab_pool_t *) sink->smcf->shared->shm.addr;
+    storage = (ngx_http_stat_storage_t *) shpool->data;
+
+    history = &storage->histories[sink->index];
+
+    nmetrics = 0;
+    nstatistics = 0;
+
+    for (i = 0; i < snapshot->nseries; i++) {
+
+        series = &snapshot->series[i];
+
+        if (series->index == NGX_HTTP_STAT_NO_INDEX) {
+            continue;
+        }
+
+        if (series->stt) {
+            nstatistics = ngx_max(nstatistics, series->index + 1);
+
+        } else {
+            nmetrics = ngx_max(nmetrics, series->index + 1);
+        }
+    }
+
+    if (nmetrics <= history->nmetrics && nstatistics <= history->nstatistics)
+    {
+        return history;
+    }
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    rc = ngx_http_stat_sink_grow(storage->allocator, &history->metrics,
+            &history->nmetrics, nmetrics);
+
+    if (rc == NGX_OK) {
+        rc = ngx_http_stat_sink_grow(storage->allocator,
+                &history->statistics, &history->nstatistics, nstatistics);
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    if (rc != NGX_OK) {
+        ngx_log_error(NGX_LOG_ALERT, log, 0,
+                "ngx_http_stat_sink_history: shared memory is full, "
+                "all series are sent to \"%V\"", &sink->server.name);
+        return NULL;
+    }
+
+    return history;
+}
+
+
+static ngx_int_t
+ngx_http_stat_sink_grow(ngx_http_stat_allocator_t *allocator,
+        ngx_http_stat_sent_t **sent, ngx_uint_t *n, ngx_uint_t need)
+{
+    ngx_uint_t             size;
+    ngx_http_stat_sent_t  *p;
+
+    if (need <= *n) {
+        return NGX_OK;
+    }
+
+    size = ngx_max(need, *n * 2);
+
+    p = ngx_http_stat_allocator_alloc(allocator,
+            sizeof(ngx_http_stat_sent_t) * size);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(p, sizeof(ngx_http_stat_sent_t) * size);
+
+    if (*sent) {
+        ngx_memcpy(p, *sent, sizeof(ngx_http_stat_sent_t) * *n);
+        ngx_http_stat_allocator_free(allocator, *sent);
+    }
+
+    *sent = p;
+    *n = size;
+
+    return NGX_OK;
+}
+
+
+static ngx_http_stat_sent_t *
+ngx_http_stat_sink_sent(ngx_http_stat_history_t *history,
+        ngx_http_stat_series_t *series)
+{
+    if (series->index == NGX_HTTP_STAT_NO_INDEX) {
+        return NULL;
+    }
+
+    if (series->stt) {
+        return &history->statistics[series->index];
+    }
+
+    return &history->metrics[series->index];
+}
+
+
+static void
+ngx_http_stat_sink_timer_handler(ngx_event_t *ev)
+{
+    ngx_http_stat_sink_t  *sink;
+
+    sink = ev->data;
+
+#if (NGX_THREADS)
+    if (sink->smcf->thread_pool) {
+        sink->pending = 1;
+        ngx_http_stat_sink_post(sink->smcf, ev->log);
+
+    } else {
+        ngx_http_stat_sink_export(sink, sink->backend->flush, ev->log);
+    }
+#else
+    ngx_http_stat_sink_export(sink, sink->backend->flush, ev->log);
+#endif
+
+    if (ngx_quit || ngx_terminate || ngx_exiting) {
+        return;
+    }
+
+    ngx_time_update();
+
+    ngx_add_timer(ev, sink->frequency);
+}
+
+
+static void
+ngx_http_stat_sink_export(ngx_http_stat_sink_t *sink,
+        ngx_http_stat_backend_flush_pt flush, ngx_log_t *log)
+{
+    size_t                       bytes;
+    uint64_t                     start;
+    ngx_uint_t                   i;
+    ngx_http_stat_snapshot_t    *snapshot;
+
+    start = sink->smcf->self ? ngx_http_stat_self_clock() : 0;
+    bytes = 0;
+
+    snapshot = ngx_http_stat_sink_snapshot(sink, log);
+
+    for (i = 0; i < sink->nshards; i++) {
+        bytes += ngx_http_stat_sink_export_shard(&sink[i], snapshot, flush,
+                log);
+    }
+
+    if (snapshot && sink->smcf->self) {
+        ngx_http_stat_self_export(sink->smcf, start, bytes);
+    }
+}
+
+
+/** Serializes the snapshot chunk by chunk, a chunk is passed to "flush"
+ *  when the next series does not fit into it, so the memory does not depend
+ *  on the number of series. Returns the number of bytes serialized.
+ */
+static size_t
+ngx_http_stat_sink_export_shard(ngx_http_stat_sink_t *sink,
+        ngx_http_stat_snapshot_t *snapshot,
+        ngx_http_stat_backend_flush_pt flush, ngx_log_t *log)
+{
+    u_char                      *b, *p, *last;
+    size_t                       bytes;
+    ngx_uint_t                   i, keyframe;
+    ngx_http_stat_sent_t        *sent;
+    ngx_http_stat_series_t      *series;
+    ngx_http_stat_history_t     *history;
+
+    b = sink->buffer.start;
+    last = sink->buffer.end;
+    bytes = 0;
+
+    history = NULL;
+    keyframe = 0;
+
+    if (snapshot && sink->suppress != SUPPRESS_OFF) {
+
+        history = ngx_http_stat_sink_history(sink, snapshot, log);
+
+        keyframe = (history && sink->keyframe
+                && (ngx_uint_t) (snapshot->time - history->keyframe)
+                    >= sink->keyframe);
+    }
+
+    sink->prev = NULL;
+
+    for (i = 0; snapshot && i < snapshot->nseries; i++) {
+
+        series = &snapshot->series[i];
+
+        if (sink->ring && ngx_http_stat_sink_owner(sink, series) != sink->shard)
+        {
+            continue;
+        }
+
+        sent = history ? ngx_http_stat_sink_sent(history, series) : NULL;
+
+        if (sent && !keyframe
+                && ((sink->suppress == SUPPRESS_ZERO && series->value == 0)
+                    || (sink->suppress == SUPPRESS_UNCHANGED && sent->sent
+                        && sent->value == series->value)))
+        {
+            continue;
+        }
+
+        p = sink->backend->serialize(sink, series, snapshot->time, b, last);
+
+        if (p == last && b != sink->buffer.start) {
+
+            /* the chunk is full, the series starts the next one */
+
+            flush(sink, sink->buffer.start, b, log);
+            bytes += b - sink->buffer.start;
+
+            b = sink->buffer.start;
+            sink->prev = NULL;
+
+            p = sink->backend->serialize(sink, series, snapshot->time, b,
+                    last);
+        }
+
+        if (p == last) {
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                    "stat series \"%V\" does not fit into %uz bytes "
+                    "of \"%V\", skipped", &series->param, sink->chunk_size,
+                    &sink->server.name);
+            continue;
+        }
+
+        b = p;
+        sink->prev = series;
+
+        if (sent) {
+            sent->value = series->value;
+            sent->sent = 1;
+        }
+    }
+
+    if (keyframe) {
+        history->keyframe = snapshot->time;
+    }
+
+    /* an empty flush still drives the queue of the stream transports */
+    flush(sink, sink->buffer.start, b, log);
+
+    return bytes + (b - sink->buffer.start);
+}
+
+
+/** Builds the consistent hash ring shared by the servers of a list, so
+ *  adding or removing a server moves only the series of its neighbours.
+ */
+ngx_int_t
+ngx_http_stat_sink_ring(ngx_conf_t *cf, ngx_http_stat_sink_t *sink)
+{
+    u_char                       buf[NGX_SOCKADDR_STRLEN + NGX_INT_T_LEN + 1];
+    size_t                       len;
+    ngx_uint_t                   i, k, n;
+    ngx_http_stat_ring_point_t  *ring;
+
+    n = sink->nshards * NGX_HTTP_STAT_RING_POINTS;
+
+    ring = ngx_palloc(cf->pool, sizeof(ngx_http_stat_ring_point_t) * n);
+    if (ring == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (k = 0; k < sink->nshards; k++) {
+
+        for (i = 0; i < NGX_HTTP_STAT_RING_POINTS; i++) {
+
+            len = ngx_snprintf(buf, sizeof(buf), "%V-%ui",
+                    &sink[k].server.name, i) - buf;
+
+            ring[k * NGX_HTTP_STAT_RING_POINTS + i].hash =
+                ngx_crc32_short(buf, len);
+            ring[k * NGX_HTTP_STAT_RING_POINTS + i].shard = k;
+        }
+    }
+
+    ngx_qsort(ring, n, sizeof(ngx_http_stat_ring_point_t),
+            ngx_http_stat_sink_cmp_points);
+
+    for (k = 0; k < sink->nshards; k++) {
+        sink[k].ring = ring;
+        sink[k].npoints = n;
+    }
+
+    return NGX_OK;
+}
+
+
+static int ngx_libc_cdecl
+ngx_http_stat_sink_cmp_points(const void *one, const void *two)
+{
+    const ngx_http_stat_ring_point_t  *a = one, *b = two;
+
+    if (a->hash != b->hash) {
+        return a->hash < b->hash ? -1 : 1;
+    }
+
+    return a->shard < b->shard ? -1 : (a->shard > b->shard);
+}
+
+
+/** Returns the shard of a series: the first point after its hash on the
+ *  ring, or the next one of a live server if that server has failed.
+ *  With "fields=multi" the param is left out, so a line stays whole.
+ */
+static ngx_uint_t
+ngx_http_stat_sink_owner(ngx_http_stat_sink_t *sink,
+        ngx_http_stat_series_t *series)
+{
+    uint32_t                     hash;
+    ngx_str_t                   *split;
+    ngx_uint_t                   i, lo, hi, mid;
+    ngx_http_stat_sink_t        *shards;
+    ngx_http_stat_ring_point_t  *ring;
+
+    /* the shards are adjacent in smcf->sinks, the first one leads */
+    shards = sink - sink->shard;
+    ring = sink->ring;
+
+    ngx_crc32_init(hash);
+
+    if (series->split != SPLIT_INTERNAL) {
+        split = &((ngx_str_t *) sink->smcf->splits->elts)[series->split];
+        ngx_crc32_update(&hash, split->data, split->len);
+    }
+
+    if (sink->fields != FIELDS_MULTI) {
+        ngx_crc32_update(&hash, series->param.data, series->param.len);
+    }
+
+    ngx_crc32_update(&hash, (u_char *) &series->window,
+            sizeof(series->window));
+    ngx_crc32_update(&hash, (u_char *) &series->percentile,
+            sizeof(series->percentile));
+
+    ngx_crc32_final(hash);
+
+    lo = 0;
+    hi = sink->npoints;
+
+    while (lo < hi) {
+
+        mid = lo + (hi - lo) / 2;
+
+        if (ring[mid].hash < hash) {
+            lo = mid + 1;
+
+        } else {
+            hi = mid;
+        }
+    }
+
+    for (i = 0; i < sink->npoints; i++) {
+
+        mid = (lo + i) % sink->npoints;
+
+        if (!shards[ring[mid].shard].failed) {
+            return ring[mid].shard;
+        }
+    }
+
+    return ring[lo % sink->npoints].shard;
+}
+
+
+#if (NGX_THREADS)
+
+/** Posts the export of the first pending sink. Only one task runs at a
+ *  time, so the snapshot shared by the sinks is never touched by two
+ *  threads and the sinks are exported in order. A sink that is not posted
+ *  stays pending for the next post and the others are tried.
+ */
+static void
+ngx_http_stat_sink_post(ngx_http_stat_main_conf_t *smcf, ngx_log_t *log)
+{
+    ngx_uint_t                      i;
+    ngx_http_stat_sink_t           *sink;
+    ngx_http_stat_sink_task_ctx_t  *ctx;
+
+    ctx = smcf->task->ctx;
+
+    if (ctx->sink) {
+        return;
+    }
+
+    for (i = 0; i < smcf->sinks->nelts; i++) {
+
+        sink = &((ngx_http_stat_sink_t *) smcf->sinks->elts)[i];
+
+        if (!sink->pending) {
+            continue;
+        }
+
+        sink->chunks_pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, log);
+        if (sink->chunks_pool == NULL) {
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                    "ngx_http_stat_sink_post: no memory, export to \"%V\" "
+                    "is not posted", &sink->server.name);
+
+            smcf->counters.failed++;
+            continue;
+        }
+
+        sink->chunks = NULL;
+        sink->last_chunk = &sink->chunks;
+
+        ctx->sink = sink;
+
+        if (ngx_thread_task_post(smcf->thread_pool, smcf->task) != NGX_OK) {
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                    "ngx_http_stat_sink_post: export to \"%V\" is not "
+                    "posted to \"%V\"", &sink->server.name,
+                    &smcf->thread_pool_name);
+
+            ngx_destroy_pool(sink->chunks_pool);
+            sink->chunks_pool = NULL;
+            ctx->sink = NULL;
+
+            smcf->counters.failed++;
+            continue;
+        }
+
+        sink->pending = 0;
+
+        return;
+    }
+}
+
+
+/** Runs in a thread of the pool, aggregates and encodes, but leaves the
+ *  sending to the event loop.
+ */
+static void
+ngx_http_stat_sink_task_handler(void *data, ngx_log_t *log)
+{
+    ngx_http_stat_sink_task_ctx_t *ctx = data;
+
+    ngx_http_stat_sink_export(ctx->sink, ngx_http_stat_sink_keep, log);
+}
+
+
+static void
+ngx_http_stat_sink_task_done(ngx_event_t *ev)
+{
+    ngx_uint_t                      i;
+    ngx_chain_t                    *cl;
+    ngx_thread_task_t              *task;
+    ngx_http_stat_sink_t           *sink, *shard;
+    ngx_http_stat_sink_task_ctx_t  *ctx;
+
+    task = ev->data;
+    ctx = task->ctx;
+
+    sink = ctx->sink;
+    ctx->sink = NULL;
+
+    /* the export may be handed over while the task was running */
+
+    if (sink->smcf->leading) {
+
+        for (cl = sink->chunks; cl; cl = cl->next) {
+            shard = cl->buf->tag;
+            shard->backend->flush(shard, cl->buf->pos, cl->buf->last,
+                    ev->log);
+        }
+
+        /* an empty flush still drives the queue of the stream transports */
+
+        for (i = 0; i < sink->nshards; i++) {
+            sink[i].backend->flush(&sink[i], sink[i].buffer.start,
+                    sink[i].buffer.start, ev->log);
+        }
+    }
+
+    ngx_destroy_pool(sink->chunks_pool);
+    sink->chunks_pool = NULL;
+
+    if (ngx_quit || ngx_terminate || ngx_exiting) {
+        return;
+    }
+
+    ngx_http_stat_sink_post(sink->smcf, ev->log);
+}
+
+
+/** Flush of the thread, copies the chunk out of the sink buffer and keeps
+ *  it with the first server of a list, tagged with the server to send to.
+ */
+static ngx_int_t
+ngx_http_stat_sink_keep(ngx_http_stat_sink_t *sink, u_char *start,
+        u_char *last, ngx_log_t *log)
+{
+    ngx_buf_t             *b;
+    ngx_chain_t           *cl;
+    ngx_http_stat_sink_t  *first;
+
+    if (start == last) {
+        return NGX_OK;
+    }
+
+    first = sink - sink->shard;
+
+    b = ngx_create_temp_buf(first->chunks_pool, last - start);
+    cl = ngx_alloc_chain_link(first->chunks_pool);
+
+    if (b == NULL || cl == NULL) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                "ngx_http_stat_sink_keep: no memory, %z bytes to \"%V\" "
+                "dropped", (size_t) (last - start), &sink->server.name);
+        return NGX_ERROR;
+    }
+
+    b->last = ngx_cpymem(b->last, start, last - start);
+    b->tag = sink;
+
+    cl->buf = b;
+    cl->next = NULL;
+
+    *first->last_chunk = cl;
+    first->last_chunk = &cl->next;
+
+    return NGX_OK;
+}
+
+#endif
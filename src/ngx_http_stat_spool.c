@@ -0,0 +1,464 @@
+
+/**
+ * (c) BSD-2-Cause, link: https://opensource.org/licenses/BSD-2-Clause
+ * (c) V. Soshnikov, mailto: dedok.mad@gmail.com
+ */
+
+#include "ngx_http_stat_module.h"
+
+#include <sys/file.h>
+#include <sys/mman.h>
+
+
+#define NGX_HTTP_STAT_SPOOL_MAGIC 0x326f6f7073746173ULL   /* "satspoo2" */
+
+/* attempts to take the lock of the header before its holder is checked */
+#define NGX_HTTP_STAT_SPOOL_SPIN  2048
+
+/* a record is a 4 bytes length followed by the package */
+#define NGX_HTTP_STAT_SPOOL_RECORD(len) (sizeof(uint32_t) + (len))
+
+
+static void ngx_http_stat_spool_cleanup(void *data);
+static void ngx_http_stat_spool_evict(ngx_http_stat_spool_t *spool);
+static ngx_int_t ngx_http_stat_spool_valid(ngx_http_stat_spool_t *spool);
+static void ngx_http_stat_spool_reset(ngx_http_stat_spool_t *spool);
+
+
+/** Spool part {{{
+ *
+ * The file is a header followed by a ring of records. The records between
+ * head and tail are in order, a zero length (or less than 4 bytes left)
+ * sends the reader to the start of the ring. The file is mapped by the
+ * master, so every worker shares the mapping and the exporter elected
+ * later continues where the previous one stopped. Nothing read from the
+ * file is trusted: a header or a record that does not fit into the ring
+ * resets it.
+ *
+ * The old workers of a reload keep writing the file while the new ones
+ * replay it, so the header is only updated under the lock word in it.
+ * Every worker also holds a shared flock() on the file: the master does
+ * not reset or resize a file that a running worker still maps.
+ */
+ngx_int_t
+ngx_http_stat_spool_open(ngx_conf_t *cf, ngx_http_stat_spool_t *spool)
+{
+    u_char                        *addr;
+    size_t                         size;
+    ssize_t                        n;
+    ngx_fd_t                       fd;
+    ngx_str_t                      name;
+    ngx_uint_t                     busy;
+    ngx_file_info_t                fi;
+    ngx_pool_cleanup_t            *cln;
+    ngx_http_stat_spool_header_t  *header, old;
+
+    name.len = spool->path.len;
+    name.data = ngx_pnalloc(cf->pool, name.len + 1);
+    if (name.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_cpystrn(name.data, spool->path.data, name.len + 1);
+
+    if (ngx_conf_full_name(cf->cycle, &name, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    spool->path = name;
+    spool->fd = NGX_INVALID_FILE;
+
+    fd = ngx_open_file(name.data, NGX_FILE_RDWR, NGX_FILE_CREATE_OR_OPEN,
+            NGX_FILE_DEFAULT_ACCESS);
+
+    if (fd == NGX_INVALID_FILE) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, ngx_errno,
+                ngx_open_file_n " \"%V\" failed", &name);
+        return NGX_ERROR;
+    }
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, ngx_errno,
+                ngx_fd_info_n " \"%V\" failed", &name);
+        goto failed;
+    }
+
+    busy = (flock(fd, LOCK_EX|LOCK_NB) == -1);
+
+    if (busy) {
+
+        /* the workers of the running cycle map it, it is kept as is */
+
+        n = ngx_read_fd(fd, &old, sizeof(ngx_http_stat_spool_header_t));
+
+        if (n != (ssize_t) sizeof(ngx_http_stat_spool_header_t)
+                || old.magic != NGX_HTTP_STAT_SPOOL_MAGIC
+                || (off_t) (sizeof(ngx_http_stat_spool_header_t) + old.size)
+                   != ngx_file_size(&fi))
+        {
+            ngx_conf_log_error(NGX_LOG_ERR, cf, 0,
+                    "stat spool \"%V\" is used by running workers and "
+                    "can not be reset", &name);
+            goto failed;
+        }
+
+        if (old.size != spool->size) {
+            ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0,
+                    "stat spool \"%V\" is used by running workers, "
+                    "spool_size is applied once they exit", &name);
+
+            spool->size = old.size;
+        }
+    }
+
+    size = sizeof(ngx_http_stat_spool_header_t) + spool->size;
+
+    if (ngx_file_size(&fi) != (off_t) size && ftruncate(fd, size) == -1) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, ngx_errno,
+                "ftruncate() \"%V\" failed", &name);
+        goto failed;
+    }
+
+    addr = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (addr == MAP_FAILED) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, ngx_errno,
+                "mmap() \"%V\" failed", &name);
+        goto failed;
+    }
+
+    cln = ngx_pool_cleanup_add(cf->cycle->pool, 0);
+    if (cln == NULL) {
+        munmap(addr, size);
+        goto failed;
+    }
+
+    cln->handler = ngx_http_stat_spool_cleanup;
+    cln->data = spool;
+
+    header = (ngx_http_stat_spool_header_t *) addr;
+
+    spool->header = header;
+    spool->data = addr + sizeof(ngx_http_stat_spool_header_t);
+
+    if (busy) {
+        ngx_close_file(fd);
+        return NGX_OK;
+    }
+
+    /* nobody else maps the file, a lock left by a crash is dropped */
+
+    header->lock = 0;
+
+    if (header->magic != NGX_HTTP_STAT_SPOOL_MAGIC
+            || header->size != spool->size)
+    {
+        if (header->magic) {
+            ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0,
+                    "stat spool \"%V\" does not match spool_size, "
+                    "%uL packages dropped", &name, header->records);
+        }
+
+        ngx_memzero(header, sizeof(ngx_http_stat_spool_header_t));
+
+        header->magic = NGX_HTTP_STAT_SPOOL_MAGIC;
+        header->size = spool->size;
+
+    } else if (ngx_http_stat_spool_valid(spool) != NGX_OK) {
+        ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0,
+                "stat spool \"%V\" is damaged, %uL packages dropped",
+                &name, header->records);
+
+        ngx_http_stat_spool_reset(spool);
+    }
+
+    (void) flock(fd, LOCK_UN);
+    ngx_close_file(fd);
+
+    return NGX_OK;
+
+failed:
+
+    ngx_close_file(fd);
+
+    return NGX_ERROR;
+}
+
+
+/** Called by every worker, the shared lock is released on exit */
+void
+ngx_http_stat_spool_attach(ngx_http_stat_spool_t *spool, ngx_log_t *log)
+{
+    ngx_fd_t  fd;
+
+    fd = ngx_open_file(spool->path.data, NGX_FILE_RDWR, NGX_FILE_OPEN, 0);
+
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                ngx_open_file_n " \"%V\" failed", &spool->path);
+        return;
+    }
+
+    if (flock(fd, LOCK_SH) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                "flock() \"%V\" failed", &spool->path);
+        ngx_close_file(fd);
+        return;
+    }
+
+    spool->fd = fd;
+}
+
+
+/** Takes the lock word of the header, a lock held by a process that is gone
+ *  is taken over. Returns NGX_BUSY if another process keeps it.
+ */
+ngx_int_t
+ngx_http_stat_spool_lock(ngx_http_stat_spool_t *spool)
+{
+    ngx_uint_t          i;
+    ngx_atomic_t       *lock;
+    ngx_atomic_uint_t   pid;
+
+    lock = &spool->header->lock;
+
+    for (i = 0; i < NGX_HTTP_STAT_SPOOL_SPIN; i++) {
+
+        if (*lock == 0 && ngx_atomic_cmp_set(lock, 0, ngx_pid)) {
+            return NGX_OK;
+        }
+
+        ngx_sched_yield();
+    }
+
+    pid = *lock;
+
+    if (pid && kill((ngx_pid_t) pid, 0) == -1 && ngx_errno == NGX_ESRCH
+            && ngx_atomic_cmp_set(lock, pid, ngx_pid))
+    {
+        return NGX_OK;
+    }
+
+    return NGX_BUSY;
+}
+
+
+void
+ngx_http_stat_spool_unlock(ngx_http_stat_spool_t *spool)
+{
+    (void) ngx_atomic_cmp_set(&spool->header->lock, ngx_pid, 0);
+}
+
+
+static void
+ngx_http_stat_spool_cleanup(void *data)
+{
+    ngx_http_stat_spool_t *spool = data;
+
+    if (spool->header) {
+        munmap((void *) spool->header,
+                sizeof(ngx_http_stat_spool_header_t) + spool->size);
+        spool->header = NULL;
+    }
+}
+
+
+/** Appends a package, the oldest ones are dropped to make room.
+ *  Returns NGX_DECLINED if the package is larger than the whole ring.
+ *  The write, peek and pop are called with the lock of the header.
+ */
+ngx_int_t
+ngx_http_stat_spool_write(ngx_http_stat_spool_t *spool, u_char *start,
+        size_t len)
+{
+    size_t                         need;
+    uint32_t                       n;
+    ngx_http_stat_spool_header_t  *header;
+
+    header = spool->header;
+    need = NGX_HTTP_STAT_SPOOL_RECORD(len);
+
+    if (need > spool->size || len == 0) {
+        return NGX_DECLINED;
+    }
+
+    if (ngx_http_stat_spool_valid(spool) != NGX_OK) {
+        ngx_http_stat_spool_reset(spool);
+    }
+
+    for ( ;; ) {
+
+        if (header->records == 0) {
+            header->head = 0;
+            header->tail = 0;
+        }
+
+        if (header->records == 0 || header->tail > header->head) {
+
+            /* the records do not wrap, free space is at both ends */
+
+            if (need <= spool->size - header->tail) {
+                break;
+            }
+
+            if (header->records && need <= header->head) {
+
+                if (spool->size - header->tail >= sizeof(uint32_t)) {
+                    n = 0;
+                    ngx_memcpy(spool->data + header->tail, &n, sizeof(n));
+                }
+
+                header->tail = 0;
+                break;
+            }
+
+        } else if (need <= header->head - header->tail) {
+            break;
+        }
+
+        ngx_http_stat_spool_evict(spool);
+    }
+
+    n = (uint32_t) len;
+
+    ngx_memcpy(spool->data + header->tail, &n, sizeof(n));
+    ngx_memcpy(spool->data + header->tail + sizeof(n), start, len);
+
+    header->tail += need;
+    header->records++;
+
+    return NGX_OK;
+}
+
+
+/** Returns the oldest package or NULL if the spool is empty. The package
+ *  ends before the tail, or before the end of the ring if the records
+ *  wrap, otherwise the ring is reset.
+ */
+u_char *
+ngx_http_stat_spool_peek(ngx_http_stat_spool_t *spool, size_t *len)
+{
+    uint32_t                       n;
+    uint64_t                       limit;
+    ngx_uint_t                     wrapped;
+    ngx_http_stat_spool_header_t  *header;
+
+    header = spool->header;
+
+    if (header->records == 0) {
+        return NULL;
+    }
+
+    if (ngx_http_stat_spool_valid(spool) != NGX_OK) {
+        goto invalid;
+    }
+
+    /* the records wrap if the tail is not after the head */
+    wrapped = (header->tail <= header->head);
+
+    if (spool->size - header->head < sizeof(uint32_t)) {
+        n = 0;
+
+    } else {
+        ngx_memcpy(&n, spool->data + header->head, sizeof(n));
+    }
+
+    if (n == 0) {
+
+        if (!wrapped) {
+            goto invalid;
+        }
+
+        header->head = 0;
+        wrapped = 0;
+
+        ngx_memcpy(&n, spool->data, sizeof(n));
+    }
+
+    limit = wrapped ? spool->size : header->tail;
+
+    if (n == 0 || header->head + NGX_HTTP_STAT_SPOOL_RECORD(n) > limit) {
+        goto invalid;
+    }
+
+    *len = n;
+
+    return spool->data + header->head + sizeof(n);
+
+invalid:
+
+    ngx_http_stat_spool_reset(spool);
+
+    return NULL;
+}
+
+
+void
+ngx_http_stat_spool_pop(ngx_http_stat_spool_t *spool)
+{
+    size_t                         len;
+    ngx_http_stat_spool_header_t  *header;
+
+    header = spool->header;
+
+    if (ngx_http_stat_spool_peek(spool, &len) == NULL) {
+        return;
+    }
+
+    header->head += NGX_HTTP_STAT_SPOOL_RECORD(len);
+    header->records--;
+}
+
+
+static void
+ngx_http_stat_spool_evict(ngx_http_stat_spool_t *spool)
+{
+    ngx_http_stat_spool_pop(spool);
+    spool->header->dropped++;
+}
+
+
+/** Checks the offsets and the counter of the header against the ring */
+static ngx_int_t
+ngx_http_stat_spool_valid(ngx_http_stat_spool_t *spool)
+{
+    ngx_http_stat_spool_header_t  *header;
+
+    header = spool->header;
+
+    if (header->size != spool->size
+            || header->head > spool->size
+            || header->tail > spool->size)
+    {
+        return NGX_ERROR;
+    }
+
+    if (header->records == 0) {
+        return NGX_OK;
+    }
+
+    /* every record takes more than its length */
+
+    if (header->records > spool->size / NGX_HTTP_STAT_SPOOL_RECORD(1)) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+/** Drops every record, the ones lost so are counted as dropped */
+static void
+ngx_http_stat_spool_reset(ngx_http_stat_spool_t *spool)
+{
+    ngx_http_stat_spool_header_t  *header;
+
+    header = spool->header;
+
+    header->size = spool->size;
+    header->dropped += header->records;
+    header->head = 0;
+    header->tail = 0;
+    header->records = 0;
+}
+/** }}} */
@@ -0,0 +1,855 @@
+/**
+ * (c) BSD-2-Cause, link: https://opensource.org/licenses/BSD-2-Clause
+ * (c) V. Soshnikov, mailto: dedok.mad@gmail.com
+ */
+
+#include "ngx_http_stat_module.h"
+
+
+#define NGX_HTTP_STAT_STATUS_LINE_LEN 128
+
+
+typedef struct {
+    ngx_http_request_t  *r;
+    ngx_buf_t           *b;
+    ngx_int_t            rc;
+} ngx_http_stat_status_out_t;
+
+
+/** Shared memory taken by the series of a location, param or internal */
+typedef struct {
+    ngx_str_t            name;
+    ngx_str_t            interval;
+    ngx_uint_t           percentile;
+    ngx_uint_t           metrics;
+    ngx_uint_t           statistics;
+    size_t               bytes;
+} ngx_http_stat_memory_usage_t;
+
+
+static u_char *ngx_http_stat_status_reserve(ngx_http_stat_status_out_t *out,
+        size_t size);
+static ngx_int_t ngx_http_stat_status_finish(
+        ngx_http_stat_status_out_t *out);
+static int ngx_libc_cdecl ngx_http_stat_status_cmp_series(const void *one,
+        const void *two);
+static ngx_int_t ngx_http_stat_status_family(ngx_pool_t *pool,
+        ngx_http_stat_series_t *series);
+static u_char *ngx_http_stat_status_name(u_char *b, ngx_str_t *name);
+static u_char *ngx_http_stat_status_label(u_char *b, ngx_str_t *value);
+static ngx_int_t ngx_http_stat_query_arg(ngx_http_request_t *r, char *name,
+        size_t len, ngx_str_t *value);
+static u_char *ngx_http_stat_query_json(u_char *b, ngx_str_t *value);
+static u_char *ngx_http_stat_memory_usage(ngx_http_stat_status_out_t *out,
+        char *key, ngx_http_stat_memory_usage_t *usage, ngx_uint_t n);
+
+
+/** Prometheus exposition {{{ */
+ngx_int_t
+ngx_http_stat_status_handler(ngx_http_request_t *r)
+{
+    ngx_int_t                      rc;
+    ngx_uint_t                     i, n;
+    size_t                         len;
+    u_char                        *b;
+    ngx_str_t                     *split, *last;
+    ngx_http_stat_main_conf_t     *smcf;
+    ngx_http_stat_series_t        *series, *sr;
+    ngx_http_stat_status_out_t     out;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    smcf = ngx_http_get_module_main_conf(r, ngx_http_stat_module);
+
+    if (!smcf->enable) {
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    series = ngx_http_stat_snapshot(smcf, r->pool, NULL, 0, 0, &n);
+    if (series == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (ngx_http_stat_status_family(r->pool, &series[i]) != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    /* the lines of one metric family must be grouped */
+    ngx_qsort(series, n, sizeof(ngx_http_stat_series_t),
+            ngx_http_stat_status_cmp_series);
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = -1;
+    ngx_str_set(&r->headers_out.content_type, "text/plain; version=0.0.4");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    out.r = r;
+    out.b = NULL;
+    out.rc = NGX_OK;
+
+    last = NULL;
+
+    for (i = 0; i < n; i++) {
+
+        sr = &series[i];
+
+        split = (sr->split != SPLIT_INTERNAL) ?
+            &((ngx_str_t *) smcf->splits->elts)[sr->split] : NULL;
+
+        len = NGX_HTTP_STAT_STATUS_LINE_LEN + 2 * sr->param.len
+            + 2 * (smcf->host.len + sr->interval.len
+                   + (split ? split->len : 0));
+
+        b = ngx_http_stat_status_reserve(&out, len);
+        if (b == NULL) {
+            return out.rc;
+        }
+
+        if (last == NULL || last->len != sr->param.len
+                || ngx_strncmp(last->data, sr->param.data, last->len) != 0)
+        {
+            b = ngx_cpymem(b, "# TYPE ", sizeof("# TYPE ") - 1);
+            b = ngx_cpymem(b, sr->param.data, sr->param.len);
+            b = ngx_cpymem(b, " gauge\n", sizeof(" gauge\n") - 1);
+
+            last = &sr->param;
+        }
+
+        b = ngx_cpymem(b, sr->param.data, sr->param.len);
+
+        b = ngx_cpymem(b, "{host=\"", sizeof("{host=\"") - 1);
+        b = ngx_http_stat_status_label(b, &smcf->host);
+
+        if (split) {
+            b = ngx_cpymem(b, "\",location=\"", sizeof("\",location=\"") - 1);
+            b = ngx_http_stat_status_label(b, split);
+        }
+
+        if (sr->percentile) {
+            b = ngx_sprintf(b, "\",quantile=\"%ui.%02ui\"}",
+                    sr->percentile / 100, sr->percentile % 100);
+
+        } else {
+            b = ngx_cpymem(b, "\",interval=\"", sizeof("\",interval=\"") - 1);
+            b = ngx_http_stat_status_label(b, &sr->interval);
+            *b++ = '"';
+            *b++ = '}';
+        }
+
+        b = ngx_sprintf(b, " %.3f\n", sr->value);
+
+        out.b->last = b;
+    }
+
+    return ngx_http_stat_status_finish(&out);
+}
+/** }}} */
+
+
+/** JSON query {{{ */
+ngx_int_t
+ngx_http_stat_query_handler(ngx_http_request_t *r)
+{
+    ngx_int_t                      rc;
+    ngx_uint_t                     i, n;
+    size_t                         len;
+    u_char                        *b;
+    ngx_str_t                     *split, interval;
+    ngx_slab_pool_t               *shpool;
+    ngx_http_stat_storage_t       *storage;
+    ngx_http_stat_main_conf_t     *smcf;
+    ngx_http_stat_series_t        *series, *sr;
+    ngx_http_stat_interval_t      *iv, window;
+    ngx_http_stat_filter_t         filter;
+    ngx_http_stat_status_out_t     out;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    smcf = ngx_http_get_module_main_conf(r, ngx_http_stat_module);
+
+    if (!smcf->enable) {
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    ngx_memzero(&filter, sizeof(ngx_http_stat_filter_t));
+
+    if (ngx_http_stat_query_arg(r, "location", sizeof("location") - 1,
+                &filter.split) != NGX_OK
+        || ngx_http_stat_query_arg(r, "param", sizeof("param") - 1,
+                &filter.param) != NGX_OK
+        || ngx_http_stat_query_arg(r, "interval", sizeof("interval") - 1,
+                &interval) != NGX_OK)
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (interval.len) {
+
+        /* a configured interval or any window up to the longest one */
+
+        for (i = 0; i < smcf->intervals->nelts; i++) {
+
+            iv = &((ngx_http_stat_interval_t *) smcf->intervals->elts)[i];
+
+            if (iv->name.len == interval.len
+                    && ngx_strncmp(iv->name.data, interval.data,
+                        interval.len) == 0)
+            {
+                filter.interval = iv;
+                break;
+            }
+        }
+
+        if (filter.interval == NULL) {
+
+            shpool = (ngx_slab_pool_t *) smcf->shared->shm.addr;
+            storage = (ngx_http_stat_storage_t *) shpool->data;
+
+            if (ngx_http_stat_parse_interval(&interval, &window.value)
+                    != NGX_OK
+                || window.value == 0
+                || window.value > storage->max_interval)
+            {
+                return NGX_HTTP_BAD_REQUEST;
+            }
+
+            window.name = interval;
+            filter.interval = &window;
+        }
+    }
+
+    series = ngx_http_stat_snapshot(smcf, r->pool, &filter, 0, 0, &n);
+    if (series == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = -1;
+    ngx_str_set(&r->headers_out.content_type, "application/json");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    out.r = r;
+    out.b = NULL;
+    out.rc = NGX_OK;
+
+    b = ngx_http_stat_status_reserve(&out,
+            NGX_HTTP_STAT_STATUS_LINE_LEN + 6 * smcf->host.len);
+    if (b == NULL) {
+        return out.rc;
+    }
+
+    b = ngx_cpymem(b, "{\"host\":\"", sizeof("{\"host\":\"") - 1);
+    b = ngx_http_stat_query_json(b, &smcf->host);
+    b = ngx_sprintf(b, "\",\"time\":%T,\"series\":[", ngx_time());
+
+    out.b->last = b;
+
+    for (i = 0; i < n; i++) {
+
+        sr = &series[i];
+
+        split = (sr->split != SPLIT_INTERNAL) ?
+            &((ngx_str_t *) smcf->splits->elts)[sr->split] : NULL;
+
+        len = NGX_HTTP_STAT_STATUS_LINE_LEN + 6 * (sr->param.len
+                + sr->interval.len + (split ? split->len : 0));
+
+        b = ngx_http_stat_status_reserve(&out, len);
+        if (b == NULL) {
+            return out.rc;
+        }
+
+        if (i) {
+            *b++ = ',';
+        }
+
+        *b++ = '{';
+
+        if (split) {
+            b = ngx_cpymem(b, "\"location\":\"",
+                    sizeof("\"location\":\"") - 1);
+            b = ngx_http_stat_query_json(b, split);
+            b = ngx_cpymem(b, "\",", sizeof("\",") - 1);
+        }
+
+        b = ngx_cpymem(b, "\"param\":\"", sizeof("\"param\":\"") - 1);
+        b = ngx_http_stat_query_json(b, &sr->param);
+
+        if (sr->percentile) {
+            b = ngx_sprintf(b, "\",\"percentile\":%ui", sr->percentile);
+
+        } else {
+            b = ngx_cpymem(b, "\",\"interval\":\"",
+                    sizeof("\",\"interval\":\"") - 1);
+            b = ngx_http_stat_query_json(b, &sr->interval);
+            *b++ = '"';
+        }
+
+        b = ngx_sprintf(b, ",\"value\":%.3f}", sr->value);
+
+        out.b->last = b;
+    }
+
+    b = ngx_http_stat_status_reserve(&out, sizeof("]}\n") - 1);
+    if (b == NULL) {
+        return out.rc;
+    }
+
+    out.b->last = ngx_cpymem(b, "]}\n", sizeof("]}\n") - 1);
+
+    return ngx_http_stat_status_finish(&out);
+}
+
+
+static ngx_int_t
+ngx_http_stat_query_arg(ngx_http_request_t *r, char *name, size_t len,
+        ngx_str_t *value)
+{
+    u_char  *dst, *src;
+
+    if (ngx_http_arg(r, (u_char *) name, len, value) != NGX_OK) {
+        ngx_str_null(value);
+        return NGX_OK;
+    }
+
+    dst = ngx_pnalloc(r->pool, value->len);
+    if (dst == NULL) {
+        return NGX_ERROR;
+    }
+
+    src = value->data;
+    value->data = dst;
+
+    ngx_unescape_uri(&dst, &src, value->len, NGX_UNESCAPE_URI);
+
+    value->len = dst - value->data;
+
+    return NGX_OK;
+}
+
+
+static u_char *
+ngx_http_stat_query_json(u_char *b, ngx_str_t *value)
+{
+    ngx_uint_t  i;
+    u_char      ch;
+
+    for (i = 0; i < value->len; i++) {
+
+        ch = value->data[i];
+
+        if (ch == '"' || ch == '\\') {
+            *b++ = '\\';
+            *b++ = ch;
+
+        } else if (ch < 0x20) {
+            b = ngx_sprintf(b, "\\u%04xui", (ngx_uint_t) ch);
+
+        } else {
+            *b++ = ch;
+        }
+    }
+
+    return b;
+}
+/** }}} */
+
+
+/** Memory accounting {{{
+ *
+ * The slab statistics tell how the zone is used, the series tell who uses
+ * it: the bytes of a metric are its entry and its accumulators, the bytes
+ * of a statistic its entry and its estimator state.
+ */
+ngx_int_t
+ngx_http_stat_memory_handler(ngx_http_request_t *r)
+{
+    size_t                          acc_size, bytes, largest, arena_free;
+    u_char                         *b;
+    ngx_int_t                       rc;
+    ngx_uint_t                      i, k, m, nslots, nsplits, nparams;
+    ngx_uint_t                      ninternals, pages, pfree, failures;
+    ngx_uint_t                      regions;
+    ngx_slab_stat_t                *slots;
+    ngx_slab_pool_t                *shpool;
+    ngx_http_stat_param_t          *param;
+    ngx_http_stat_metric_t         *metric;
+    ngx_http_stat_arena_t          *arena;
+    ngx_http_stat_storage_t        *storage;
+    ngx_http_stat_internal_t       *internal;
+    ngx_http_stat_statistic_t      *statistic;
+    ngx_http_stat_main_conf_t      *smcf;
+    ngx_http_stat_status_out_t      out;
+    ngx_http_stat_memory_usage_t   *splits, *params, *internals, *usage;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    smcf = ngx_http_get_module_main_conf(r, ngx_http_stat_module);
+
+    if (!smcf->enable) {
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    shpool = (ngx_slab_pool_t *) smcf->shared->shm.addr;
+    storage = (ngx_http_stat_storage_t *) shpool->data;
+
+    /*
+     * the sizes are read without the lock, so the params and internals
+     * registered in between are skipped
+     */
+    nslots = ngx_pagesize_shift - shpool->min_shift;
+    nsplits = smcf->splits->nelts;
+    nparams = storage->params->nelts;
+    ninternals = storage->internals->nelts;
+
+    slots = ngx_palloc(r->pool, sizeof(ngx_slab_stat_t) * nslots);
+    splits = ngx_pcalloc(r->pool,
+            sizeof(ngx_http_stat_memory_usage_t) * (nsplits + 1));
+    params = ngx_pcalloc(r->pool,
+            sizeof(ngx_http_stat_memory_usage_t) * (nparams + 1));
+    internals = ngx_pcalloc(r->pool,
+            sizeof(ngx_http_stat_memory_usage_t) * (ninternals + 1));
+
+    if (slots == NULL || splits == NULL || params == NULL
+            || internals == NULL)
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    for (i = 0; i < nsplits; i++) {
+        splits[i].name = ((ngx_str_t *) smcf->splits->elts)[i];
+    }
+
+    acc_size = sizeof(ngx_http_stat_acc_t) * (storage->max_interval + 1);
+
+    /** Lock {{{ */
+    ngx_shmtx_lock(&shpool->mutex);
+
+    ngx_memcpy(slots, shpool->stats, sizeof(ngx_slab_stat_t) * nslots);
+    pfree = shpool->pfree;
+
+    failures = storage->allocator->failures;
+    largest = storage->allocator->largest_failure;
+
+    arena = storage->allocator->pool;
+    regions = arena->regions;
+    arena_free = arena->free_bytes + (arena->end - arena->pos)
+        + (arena->hot_end - arena->hot_pos);
+
+    for (i = 0; i < ninternals; i++) {
+
+        internal = ngx_http_stat_array_get(storage->internals, i);
+        usage = &internals[i];
+
+        usage->name = internal->name;
+        usage->bytes = sizeof(ngx_http_stat_internal_t) + internal->name.len
+            + 2 * sizeof(ngx_http_stat_array_t)
+            + internal->data.metrics->nalloc * internal->data.metrics->size
+            + internal->data.statistics->nalloc
+              * internal->data.statistics->size;
+
+        for (k = 0; k < internal->data.metrics->nelts; k++) {
+
+            m = *(ngx_uint_t *) ngx_http_stat_array_get(
+                    internal->data.metrics, k);
+            metric = ngx_http_stat_array_get(storage->metrics, m);
+
+            usage->metrics++;
+            usage->bytes += sizeof(ngx_http_stat_metric_t)
+                + (metric->acc ? acc_size : 0);
+        }
+
+        for (k = 0; k < internal->data.statistics->nelts; k++) {
+
+            m = *(ngx_uint_t *) ngx_http_stat_array_get(
+                    internal->data.statistics, k);
+            statistic = ngx_http_stat_array_get(storage->statistics, m);
+
+            usage->statistics++;
+            usage->bytes += sizeof(ngx_http_stat_statistic_t)
+                + (statistic->stt ? sizeof(ngx_http_stat_stt_t) : 0);
+        }
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+    /** Lock }}} */
+
+    /*
+     * the params, metrics and statistics never move once pushed, a metric
+     * registered in between may be seen zeroed
+     */
+
+    for (i = 0; i < nparams; i++) {
+
+        param = ngx_http_stat_array_get(storage->params, i);
+
+        params[i].name = param->name;
+        params[i].interval = param->interval.name;
+        params[i].percentile = param->percentile;
+        params[i].bytes = sizeof(ngx_http_stat_param_t) + param->name.len;
+    }
+
+    for (m = 0; m < storage->metrics->nelts; m++) {
+
+        metric = ngx_http_stat_array_get(storage->metrics, m);
+
+        bytes = sizeof(ngx_http_stat_metric_t)
+            + (metric->acc ? acc_size : 0);
+
+        if (metric->split < nsplits) {
+            splits[metric->split].metrics++;
+            splits[metric->split].bytes += bytes;
+        }
+
+        if (metric->param < nparams) {
+            params[metric->param].metrics++;
+            params[metric->param].bytes += bytes;
+        }
+    }
+
+    for (m = 0; m < storage->statistics->nelts; m++) {
+
+        statistic = ngx_http_stat_array_get(storage->statistics, m);
+
+        bytes = sizeof(ngx_http_stat_statistic_t)
+            + (statistic->stt ? sizeof(ngx_http_stat_stt_t) : 0);
+
+        if (statistic->split < nsplits) {
+            splits[statistic->split].statistics++;
+            splits[statistic->split].bytes += bytes;
+        }
+
+        if (statistic->param < nparams) {
+            params[statistic->param].statistics++;
+            params[statistic->param].bytes += bytes;
+        }
+    }
+
+    pages = (shpool->end - shpool->start) / ngx_pagesize;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = -1;
+    ngx_str_set(&r->headers_out.content_type, "application/json");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    out.r = r;
+    out.b = NULL;
+    out.rc = NGX_OK;
+
+    b = ngx_http_stat_status_reserve(&out,
+            NGX_HTTP_STAT_STATUS_LINE_LEN * 2 + 6 * smcf->host.len);
+    if (b == NULL) {
+        return out.rc;
+    }
+
+    b = ngx_cpymem(b, "{\"host\":\"", sizeof("{\"host\":\"") - 1);
+    b = ngx_http_stat_query_json(b, &smcf->host);
+    b = ngx_sprintf(b, "\",\"size\":%uz,\"page_size\":%ui,\"pages\":%ui,"
+            "\"free_pages\":%ui,\"failures\":%ui,\"largest_failure\":%uz,"
+            "\"arena_regions\":%ui,\"arena_free\":%uz,"
+            "\"slots\":[", smcf->shared->shm.size, ngx_pagesize, pages,
+            pfree, failures, largest, regions, arena_free);
+
+    out.b->last = b;
+
+    for (i = 0; i < nslots; i++) {
+
+        b = ngx_http_stat_status_reserve(&out, NGX_HTTP_STAT_STATUS_LINE_LEN);
+        if (b == NULL) {
+            return out.rc;
+        }
+
+        if (i) {
+            *b++ = ',';
+        }
+
+        out.b->last = ngx_sprintf(b, "{\"size\":%uz,\"total\":%ui,"
+                "\"used\":%ui,\"reqs\":%ui,\"fails\":%ui}",
+                (size_t) 1 << (shpool->min_shift + i), slots[i].total,
+                slots[i].used, slots[i].reqs, slots[i].fails);
+    }
+
+    b = ngx_http_stat_status_reserve(&out, 1);
+    if (b == NULL) {
+        return out.rc;
+    }
+
+    *b++ = ']';
+    out.b->last = b;
+
+    if (ngx_http_stat_memory_usage(&out, "locations", splits, nsplits) == NULL
+        || ngx_http_stat_memory_usage(&out, "params", params, nparams) == NULL
+        || ngx_http_stat_memory_usage(&out, "internals", internals,
+                ninternals) == NULL)
+    {
+        return out.rc;
+    }
+
+    b = ngx_http_stat_status_reserve(&out, sizeof("}\n") - 1);
+    if (b == NULL) {
+        return out.rc;
+    }
+
+    out.b->last = ngx_cpymem(b, "}\n", sizeof("}\n") - 1);
+
+    return ngx_http_stat_status_finish(&out);
+}
+
+
+/** Writes ",\"<key>\":[...]" */
+static u_char *
+ngx_http_stat_memory_usage(ngx_http_stat_status_out_t *out, char *key,
+        ngx_http_stat_memory_usage_t *usage, ngx_uint_t n)
+{
+    u_char      *b;
+    ngx_uint_t   i;
+
+    b = ngx_http_stat_status_reserve(out, NGX_HTTP_STAT_STATUS_LINE_LEN);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    out->b->last = ngx_sprintf(b, ",\"%s\":[", key);
+
+    for (i = 0; i < n; i++) {
+
+        b = ngx_http_stat_status_reserve(out, NGX_HTTP_STAT_STATUS_LINE_LEN
+                + 6 * (usage[i].name.len + usage[i].interval.len));
+        if (b == NULL) {
+            return NULL;
+        }
+
+        if (i) {
+            *b++ = ',';
+        }
+
+        b = ngx_cpymem(b, "{\"name\":\"", sizeof("{\"name\":\"") - 1);
+        b = ngx_http_stat_query_json(b, &usage[i].name);
+        *b++ = '"';
+
+        if (usage[i].percentile) {
+            b = ngx_sprintf(b, ",\"percentile\":%ui", usage[i].percentile);
+
+        } else if (usage[i].interval.len) {
+            b = ngx_cpymem(b, ",\"interval\":\"",
+                    sizeof(",\"interval\":\"") - 1);
+            b = ngx_http_stat_query_json(b, &usage[i].interval);
+            *b++ = '"';
+        }
+
+        out->b->last = ngx_sprintf(b, ",\"metrics\":%ui,\"statistics\":%ui,"
+                "\"bytes\":%uz}", usage[i].metrics, usage[i].statistics,
+                usage[i].bytes);
+    }
+
+    b = ngx_http_stat_status_reserve(out, 1);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    *b++ = ']';
+    out->b->last = b;
+
+    return b;
+}
+/** }}} */
+
+
+/** Output helpers {{{ */
+static u_char *
+ngx_http_stat_status_reserve(ngx_http_stat_status_out_t *out, size_t size)
+{
+    ngx_chain_t  cl;
+
+    if (out->b && (size_t) (out->b->end - out->b->last) >= size) {
+        return out->b->last;
+    }
+
+    if (out->b && out->b->last != out->b->pos) {
+
+        cl.buf = out->b;
+        cl.next = NULL;
+
+        out->rc = ngx_http_output_filter(out->r, &cl);
+
+        if (out->rc == NGX_ERROR) {
+            return NULL;
+        }
+    }
+
+    out->b = ngx_create_temp_buf(out->r->pool, ngx_max(size, ngx_pagesize));
+    if (out->b == NULL) {
+        out->rc = NGX_ERROR;
+        return NULL;
+    }
+
+    return out->b->last;
+}
+
+
+static ngx_int_t
+ngx_http_stat_status_finish(ngx_http_stat_status_out_t *out)
+{
+    ngx_chain_t  cl;
+
+    if (out->b == NULL) {
+        out->b = ngx_calloc_buf(out->r->pool);
+        if (out->b == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    out->b->last_buf = (out->r == out->r->main) ? 1 : 0;
+    out->b->last_in_chain = 1;
+
+    cl.buf = out->b;
+    cl.next = NULL;
+
+    return ngx_http_output_filter(out->r, &cl);
+}
+
+
+static int ngx_libc_cdecl
+ngx_http_stat_status_cmp_series(const void *one, const void *two)
+{
+    ngx_int_t                  rc;
+    ngx_http_stat_series_t    *a, *b;
+
+    a = (ngx_http_stat_series_t *) one;
+    b = (ngx_http_stat_series_t *) two;
+
+    rc = ngx_strncmp(a->param.data, b->param.data,
+            ngx_min(a->param.len, b->param.len));
+
+    if (rc != 0) {
+        return (int) rc;
+    }
+
+    if (a->param.len != b->param.len) {
+        return (a->param.len < b->param.len) ? -1 : 1;
+    }
+
+    if (a->percentile != b->percentile) {
+        return (a->percentile < b->percentile) ? -1 : 1;
+    }
+
+    if (a->split != b->split) {
+        return (a->split < b->split) ? -1 : 1;
+    }
+
+    return 0;
+}
+
+
+/** Replaces the param of a series by the name of its metric family, so
+ *  params that only differ in the characters replaced by '_' share one
+ *  family, and the percentiles get a family of their own.
+ */
+static ngx_int_t
+ngx_http_stat_status_family(ngx_pool_t *pool, ngx_http_stat_series_t *series)
+{
+    u_char  *name, *p;
+
+    name = ngx_pnalloc(pool, sizeof("nginx_stat_") - 1 + series->param.len
+            + sizeof("_quantile") - 1);
+    if (name == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_http_stat_status_name(name, &series->param);
+
+    if (series->percentile) {
+        p = ngx_cpymem(p, "_quantile", sizeof("_quantile") - 1);
+    }
+
+    series->param.data = name;
+    series->param.len = p - name;
+
+    return NGX_OK;
+}
+
+
+static u_char *
+ngx_http_stat_status_name(u_char *b, ngx_str_t *name)
+{
+    ngx_uint_t i;
+
+    b = ngx_cpymem(b, "nginx_stat_", sizeof("nginx_stat_") - 1);
+
+    for (i = 0; i < name->len; i++) {
+        *b++ = isalnum(name->data[i]) ? name->data[i] : '_';
+    }
+
+    return b;
+}
+
+
+static u_char *
+ngx_http_stat_status_label(u_char *b, ngx_str_t *value)
+{
+    ngx_uint_t i;
+
+    for (i = 0; i < value->len; i++) {
+
+        switch (value->data[i]) {
+        case '"':
+        case '\\':
+            *b++ = '\\';
+            *b++ = value->data[i];
+            break;
+        case '\n':
+            *b++ = '\\';
+            *b++ = 'n';
+            break;
+        default:
+            *b++ = value->data[i];
+        }
+    }
+
+    return b;
+}
+/** }}} */
@@ -0,0 +1,90 @@
+
+/**
+ * (c) BSD-2-Cause, link: https://opensource.org/licenses/BSD-2-Clause
+ * (c) V. Soshnikov, mailto: dedok.mad@gmail.com
+ */
+
+#include "ngx_http_stat_module.h"
+
+
+/** Serializer part {{{
+ */
+
+/** DogStatsD line, "<name>:<value>|<type>|#<tags>".
+ *  The values are aggregated already, so the agent only forwards them:
+ *  "sum" params become counters increased by the share of the window
+ *  that passed since the previous export, the others are gauges.
+ */
+u_char *
+ngx_http_statsd_serialize(ngx_http_stat_sink_t *sink,
+        ngx_http_stat_series_t *series, time_t ts, u_char *buffer,
+        u_char *last)
+{
+    char                       *type;
+    u_char                      p[4], *b;
+    double                      value;
+    ngx_str_t                   percentile, *split, *interval;
+    ngx_http_stat_main_conf_t  *smcf;
+
+    smcf = sink->smcf;
+
+    b = buffer;
+
+    if (series->percentile) {
+        percentile.data = p;
+        percentile.len = ngx_snprintf(p, sizeof(p), "p%ui",
+                series->percentile) - p;
+
+        interval = &percentile;
+
+    } else {
+        interval = &series->interval;
+    }
+
+    split = NULL;
+
+    if (series->split != SPLIT_INTERNAL) {
+        split = &((ngx_str_t *) smcf->splits->elts)[series->split];
+    }
+
+    if (split && sink->template->nelts) {
+
+        ngx_str_t *variables[] = TEMPLATE_VARIABLES(
+                &smcf->host, split, &series->param, interval);
+
+        b = ngx_http_stat_template_execute(b, last - b, sink->template,
+                variables);
+
+    } else {
+        b = ngx_snprintf(b, last - b, "nginx_stat_%V", &series->param);
+    }
+
+    value = series->value;
+    type = "g";
+
+    if (series->aggregate == ngx_http_stat_aggregate_sum && series->window) {
+        value = value * (sink->frequency / 1000) / series->window;
+        type = "c";
+    }
+
+    b = ngx_snprintf(b, last - b, ":%.3f|%s|#host:%V", value, type,
+            &smcf->host);
+
+    if (split) {
+        b = ngx_snprintf(b, last - b, ",location:%V", split);
+    }
+
+    if (series->percentile) {
+        b = ngx_snprintf(b, last - b, ",percentile:%V", interval);
+
+    } else if (interval->len) {
+        b = ngx_snprintf(b, last - b, ",interval:%V", interval);
+    }
+
+    if (b < last) {
+        *b++ = '\n';
+    }
+
+    return b;
+}
+/** }}} */
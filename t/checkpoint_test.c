@@ -0,0 +1,364 @@
+/**
+ * (c) BSD-2-Cause, link: https://opensource.org/licenses/BSD-2-Clause
+ * (c) V. Soshnikov, mailto: dedok.mad@gmail.com
+ */
+
+#include "ngx_http_stat_module.h"
+
+#include "ngx_core_stub.h"
+
+
+#define MAX_INTERVAL  60
+#define NMETRICS      3
+#define NSTATISTICS   2
+#define NOW           1700000000
+
+
+static ngx_log_t                   log_;
+static ngx_shm_zone_t              zone;
+static ngx_slab_pool_t             shpool;
+static ngx_http_stat_storage_t     storage;
+static ngx_http_stat_main_conf_t   smcf;
+
+static ngx_http_stat_array_t       metrics, statistics;
+static ngx_http_stat_metric_t      metric[NMETRICS];
+static ngx_http_stat_statistic_t   statistic[NSTATISTICS];
+static ngx_http_stat_acc_t         acc[NMETRICS][MAX_INTERVAL + 1];
+static ngx_http_stat_stt_t         stt[NSTATISTICS];
+
+static char                       *path = "checkpoint_test.ckpt";
+
+
+/* the arrays of a single segment, as ngx_http_stat_array_get reads them */
+
+static void
+array_init(ngx_http_stat_array_t *array, void *elts, ngx_uint_t n,
+    size_t size)
+{
+    ngx_memzero(array, sizeof(ngx_http_stat_array_t));
+
+    array->segments[0] = elts;
+    array->nsegments = 1;
+    array->base = n;
+    array->nelts = n;
+    array->size = size;
+    array->nalloc = n;
+}
+
+
+/* the config and the zone share the arrays, as after the shared init */
+
+static void
+storage_init(void)
+{
+    u_char      *temp;
+    ngx_uint_t   m, s;
+
+    for (m = 0; m < NMETRICS; m++) {
+        metric[m].split = m;
+        metric[m].param = 1;
+        metric[m].acc = acc[m];
+    }
+
+    for (s = 0; s < NSTATISTICS; s++) {
+        statistic[s].split = s;
+        statistic[s].param = 2;
+        statistic[s].stt = &stt[s];
+    }
+
+    array_init(&metrics, metric, NMETRICS, sizeof(ngx_http_stat_metric_t));
+    array_init(&statistics, statistic, NSTATISTICS,
+            sizeof(ngx_http_stat_statistic_t));
+
+    storage.max_interval = MAX_INTERVAL;
+    storage.metrics = &metrics;
+    storage.statistics = &statistics;
+
+    shpool.data = &storage;
+    zone.shm.addr = (u_char *) &shpool;
+
+    temp = malloc(ngx_strlen(path) + NGX_INT_T_LEN + 2);
+    check(temp != NULL);
+
+    smcf.storage = &storage;
+    smcf.shared = &zone;
+    smcf.checkpoint.path.data = (u_char *) path;
+    smcf.checkpoint.path.len = ngx_strlen(path);
+    smcf.checkpoint.temp = temp;
+}
+
+
+static double
+value(ngx_uint_t m, time_t t)
+{
+    return (double) (m * 1000 + t % 997) + 0.5;
+}
+
+
+/* every second of the rings, as recorded by the workers up to now */
+
+static void
+storage_fill(time_t now)
+{
+    time_t      t;
+    ngx_uint_t  m, s, k;
+
+    storage.start_time = now - MAX_INTERVAL - 17;
+    storage.last_time = now - MAX_INTERVAL;
+
+    for (m = 0; m < NMETRICS; m++) {
+        for (t = now - MAX_INTERVAL; t <= now; t++) {
+            acc[m][(t - storage.start_time) % (MAX_INTERVAL + 1)].value =
+                value(m, t);
+            acc[m][(t - storage.start_time) % (MAX_INTERVAL + 1)].count =
+                (ngx_uint_t) (t % 13);
+        }
+    }
+
+    for (s = 0; s < NSTATISTICS; s++) {
+        for (k = 0; k < P2_METRIC_COUNT; k++) {
+            stt[s].q[k] = (double) (s * 10 + k);
+            stt[s].n[k] = (ngx_int_t) k;
+        }
+
+        stt[s].count = 100 + s;
+    }
+}
+
+
+static void
+storage_poison(void)
+{
+    ngx_memset(acc, 0xa5, sizeof(acc));
+    ngx_memset(stt, 0xa5, sizeof(stt));
+
+    storage.start_time = 1;
+    storage.last_time = 1;
+}
+
+
+static ngx_uint_t
+storage_poisoned(void)
+{
+    u_char      *p;
+    ngx_uint_t   i;
+
+    p = (u_char *) acc;
+
+    for (i = 0; i < sizeof(acc); i++) {
+        if (p[i] != 0xa5) {
+            return 0;
+        }
+    }
+
+    p = (u_char *) stt;
+
+    for (i = 0; i < sizeof(stt); i++) {
+        if (p[i] != 0xa5) {
+            return 0;
+        }
+    }
+
+    return storage.start_time == 1;
+}
+
+
+static void
+file_patch(off_t offset, void *data, size_t len)
+{
+    FILE  *f;
+
+    f = fopen(path, "r+");
+    check(f != NULL);
+    check(fseek(f, offset, SEEK_SET) == 0);
+    check(fwrite(data, 1, len, f) == len);
+    check(fclose(f) == 0);
+}
+
+
+/* a valid checkpoint of NOW, the zone is poisoned to see a load */
+
+static void
+checkpoint_rewrite(void)
+{
+    ngx_stub_time_set(NOW);
+    storage_fill(NOW);
+
+    check(ngx_http_stat_checkpoint_write(&smcf, &log_) == NGX_OK);
+
+    storage_poison();
+}
+
+
+/*
+ * The values written are the values loaded, shifted by the seconds nginx
+ * was down, and the seconds after the checkpoint read as zero.
+ */
+static void
+test_round_trip(void)
+{
+    time_t      t, now;
+    ngx_uint_t  m, i;
+
+    ngx_stub_time_set(NOW);
+    storage_fill(NOW);
+
+    check(ngx_http_stat_checkpoint_write(&smcf, &log_) == NGX_OK);
+    check(access((char *) smcf.checkpoint.temp, F_OK) == -1);
+
+    /* the zone of the next start is zero filled */
+
+    ngx_memzero(acc, sizeof(acc));
+    ngx_memzero(stt, sizeof(stt));
+
+    now = NOW + 10;
+    ngx_stub_time_set(now);
+
+    ngx_http_stat_checkpoint_load(&smcf, &log_);
+
+    check(storage.start_time == now - MAX_INTERVAL);
+    check(storage.last_time == now - MAX_INTERVAL);
+
+    for (m = 0; m < NMETRICS; m++) {
+        for (t = now - MAX_INTERVAL; t <= now; t++) {
+            i = (t - storage.start_time) % (MAX_INTERVAL + 1);
+
+            if (t <= NOW) {
+                check(acc[m][i].value == value(m, t));
+                check(acc[m][i].count == (ngx_uint_t) (t % 13));
+
+            } else {
+                check(acc[m][i].value == 0);
+                check(acc[m][i].count == 0);
+            }
+        }
+    }
+
+    for (i = 0; i < NSTATISTICS; i++) {
+        check(stt[i].q[3] == (double) (i * 10 + 3));
+        check(stt[i].n[4] == 4);
+        check(stt[i].count == 100 + i);
+    }
+}
+
+
+/*
+ * A file of another config, out of the intervals or damaged is ignored and
+ * leaves the zone as it is.
+ */
+static void
+test_ignored(void)
+{
+    uint32_t   garbage;
+    uint64_t   magic;
+
+    checkpoint_rewrite();
+
+    /* too old */
+
+    ngx_stub_time_set(NOW + MAX_INTERVAL + 1);
+    ngx_http_stat_checkpoint_load(&smcf, &log_);
+    check(storage_poisoned());
+
+    /* from the future */
+
+    ngx_stub_time_set(NOW - 1);
+    ngx_http_stat_checkpoint_load(&smcf, &log_);
+    check(storage_poisoned());
+
+    ngx_stub_time_set(NOW);
+
+    /* another metric in the same place, the size is the same */
+
+    metric[1].param = 3;
+    ngx_http_stat_checkpoint_load(&smcf, &log_);
+    check(storage_poisoned());
+    metric[1].param = 1;
+
+    /* fewer metrics, the size differs */
+
+    metrics.nelts = NMETRICS - 1;
+    ngx_http_stat_checkpoint_load(&smcf, &log_);
+    check(storage_poisoned());
+    metrics.nelts = NMETRICS;
+
+    /* a header of garbage */
+
+    garbage = 0xdeadbeef;
+    file_patch(offsetof(ngx_http_stat_checkpoint_header_t, layout),
+            &garbage, sizeof(garbage));
+    ngx_http_stat_checkpoint_load(&smcf, &log_);
+    check(storage_poisoned());
+
+    checkpoint_rewrite();
+
+    magic = 0x7473706b63746173ULL;
+    file_patch(offsetof(ngx_http_stat_checkpoint_header_t, magic),
+            &magic, sizeof(magic));
+    ngx_http_stat_checkpoint_load(&smcf, &log_);
+    check(storage_poisoned());
+
+    checkpoint_rewrite();
+
+    /* a truncated file */
+
+    check(truncate(path, sizeof(ngx_http_stat_checkpoint_header_t)) == 0);
+    ngx_http_stat_checkpoint_load(&smcf, &log_);
+    check(storage_poisoned());
+
+    /* no file */
+
+    unlink(path);
+    ngx_http_stat_checkpoint_load(&smcf, &log_);
+    check(storage_poisoned());
+}
+
+
+/* the zone taken over by the next cycle is not written anymore */
+
+static void
+test_migrated(void)
+{
+    storage_fill(NOW);
+    storage.migrated = 1;
+
+    unlink(path);
+    check(ngx_http_stat_checkpoint_write(&smcf, &log_) == NGX_DECLINED);
+    check(access(path, F_OK) == -1);
+
+    storage.migrated = 0;
+}
+
+
+/*
+ * Usage: checkpoint_test [path]
+ *
+ * Writes and loads a checkpoint of a small zone, checkpoint_test.ckpt by
+ * default. It is built against a configured nginx tree by
+ * `make test_checkpoint`.
+ */
+int main(int argc, char **argv)
+{
+    if (argc > 1) {
+        path = argv[1];
+    }
+
+    ngx_stub_init(NOW);
+
+    log_.log_level = NGX_LOG_NOTICE;
+
+    storage_init();
+
+    test_round_trip();
+    printf("checkpoint round trip: ok\n");
+
+    test_ignored();
+    printf("checkpoint ignored: ok\n");
+
+    test_migrated();
+    printf("checkpoint migrated: ok\n");
+
+    unlink(path);
+
+    return 0;
+}
@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+#define SERVER "127.0.0.1"
+#define BUFLEN 512
+#define PORT 5353
+
+
+void
+die(char *s)
+{
+    perror(s);
+    exit(1);
+}
+
+
+/*
+ * Usage: dns_stub <ttl> <ip> [<ip> ...]
+ *
+ * Answers every A query with one of the given addresses, the next one each
+ * <ttl> seconds, so a moving collector can be emulated with
+ *
+ *     resolver 127.0.0.1:5353 valid=1s;
+ *     stat_config server=collector.test resolve=2s ...;
+ *
+ * Other query types get an empty answer.
+ */
+int main(int argc, char **argv)
+{
+    struct sockaddr_in  si_me, si_other;
+    struct in_addr      addr;
+    socklen_t           slen;
+    int                 s, ttl, naddrs;
+    unsigned char       buf[BUFLEN], *p, *last;
+    uint16_t            qtype;
+    ssize_t             n;
+
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <ttl> <ip> [<ip> ...]\n", argv[0]);
+        exit(1);
+    }
+
+    ttl = atoi(argv[1]);
+    naddrs = argc - 2;
+
+    if (ttl < 1) {
+        ttl = 1;
+    }
+
+    if ((s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
+        die("socket");
+    }
+
+    memset((char *) &si_me, 0, sizeof(si_me));
+    si_me.sin_family = AF_INET;
+    si_me.sin_port = htons(PORT);
+
+    if (inet_aton(SERVER , &si_me.sin_addr) == 0) {
+        fprintf(stderr, "inet_aton() failed\n");
+        exit(1);
+    }
+
+    if (bind(s, (struct sockaddr *) &si_me, sizeof(si_me)) == -1) {
+        die("bind()");
+    }
+
+    for ( ;; ) {
+
+        slen = sizeof(si_other);
+
+        n = recvfrom(s, buf, sizeof(buf) - 16, 0,
+                (struct sockaddr *) &si_other, &slen);
+
+        if (n == -1) {
+            die("recvfrom()");
+        }
+
+        /* header, then the name of the only question */
+
+        if (n < 12 + 5) {
+            continue;
+        }
+
+        p = buf + 12;
+        last = buf + n;
+
+        while (p < last && *p) {
+            p += *p + 1;
+        }
+
+        if (p + 5 > last) {
+            continue;
+        }
+
+        qtype = (uint16_t) (p[1] << 8 | p[2]);
+        p += 5;
+
+        if (inet_aton(argv[2 + (time(NULL) / ttl) % naddrs], &addr) == 0) {
+            fprintf(stderr, "inet_aton() failed\n");
+            exit(1);
+        }
+
+        buf[2] = 0x81;              /* response, recursion desired */
+        buf[3] = 0x80;              /* recursion available, no error */
+        buf[4] = 0; buf[5] = 1;     /* questions */
+        buf[6] = 0; buf[7] = 0;     /* answers */
+        memset(buf + 8, 0, 4);      /* authority and additional */
+
+        if (qtype == 1) {
+            buf[7] = 1;
+
+            *p++ = 0xc0; *p++ = 12;                 /* name of the question */
+            *p++ = 0; *p++ = 1;                     /* A */
+            *p++ = 0; *p++ = 1;                     /* IN */
+            *p++ = (unsigned char) (ttl >> 24);
+            *p++ = (unsigned char) (ttl >> 16);
+            *p++ = (unsigned char) (ttl >> 8);
+            *p++ = (unsigned char) ttl;
+            *p++ = 0; *p++ = 4;
+            memcpy(p, &addr, 4);
+            p += 4;
+        }
+
+        fprintf(stdout, "--- query type %u answered with %s\n",
+                (unsigned) qtype, qtype == 1 ? inet_ntoa(addr) : "nothing");
+        fflush(stdout);
+
+        if (sendto(s, buf, p - buf, 0, (struct sockaddr *) &si_other, slen)
+                == -1)
+        {
+            die("sendto()");
+        }
+    }
+
+    close(s);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,90 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+#define SERVER "127.0.0.1"
+#define BUFLEN 4096
+#define PORT 8089
+
+
+void
+die(char *s)
+{
+    perror(s);
+    exit(1);
+}
+
+
+/*
+ * Usage: influx_tcp_listener [delay_ms]
+ *
+ * Accepts influx/tcp connections one by one and prints received lines.
+ * A non zero delay between reads emulates a slow collector, so the send
+ * queue and the drop policy of the module can be observed.
+ */
+int main(int argc, char **argv)
+{
+    struct sockaddr_in si_me;
+    int                s, c, on = 1, delay = 0;
+    ssize_t            n;
+    char               buf[BUFLEN];
+
+    if (argc > 1) {
+        delay = atoi(argv[1]);
+    }
+
+    if ((s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) == -1) {
+        die("socket");
+    }
+
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    memset((char *) &si_me, 0, sizeof(si_me));
+    si_me.sin_family = AF_INET;
+    si_me.sin_port = htons(PORT);
+
+    if (inet_aton(SERVER , &si_me.sin_addr) == 0) {
+        fprintf(stderr, "inet_aton() failed\n");
+        exit(1);
+    }
+
+    if (bind(s, (struct sockaddr *) &si_me, sizeof(si_me)) == -1) {
+        die("bind()");
+    }
+
+    if (listen(s, 16) == -1) {
+        die("listen()");
+    }
+
+    for ( ;; ) {
+
+        if ((c = accept(s, NULL, NULL)) == -1) {
+            die("accept()");
+        }
+
+        fprintf(stdout, "--- connection accepted\n");
+
+        while ((n = read(c, buf, sizeof(buf))) > 0) {
+
+            fwrite(buf, 1, n, stdout);
+            fflush(stdout);
+
+            if (delay) {
+                usleep(delay * 1000);
+            }
+        }
+
+        fprintf(stdout, "--- connection closed\n");
+
+        close(c);
+    }
+
+    close(s);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,196 @@
+/**
+ * (c) BSD-2-Cause, link: https://opensource.org/licenses/BSD-2-Clause
+ * (c) V. Soshnikov, mailto: dedok.mad@gmail.com
+ */
+
+/*
+ * The few functions of the nginx core and of the module the spool and the
+ * checkpoint call, so they are tested as a plain program against the
+ * headers of a configured nginx tree. The config and the shared memory
+ * are built by the tests themselves, the locks are no-op.
+ */
+
+#include "ngx_http_stat_module.h"
+
+#include <stdarg.h>
+
+#include "ngx_core_stub.h"
+
+
+ngx_pid_t                 ngx_pid;
+volatile ngx_time_t      *ngx_cached_time;
+uint32_t                  ngx_crc32_table256[256];
+
+static ngx_time_t         ngx_stub_time;
+
+
+void
+ngx_stub_init(time_t now)
+{
+    uint32_t    c;
+    ngx_uint_t  i, k;
+
+    for (i = 0; i < 256; i++) {
+        c = (uint32_t) i;
+
+        for (k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        }
+
+        ngx_crc32_table256[i] = c;
+    }
+
+    ngx_pid = getpid();
+
+    ngx_stub_time.sec = now;
+    ngx_cached_time = &ngx_stub_time;
+}
+
+
+void
+ngx_stub_time_set(time_t now)
+{
+    ngx_stub_time.sec = now;
+}
+
+
+void
+ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+    const char *fmt, ...)
+{
+    fprintf(stderr, "    log %d: %s\n", (int) level, fmt);
+}
+
+
+void
+ngx_conf_log_error(ngx_uint_t level, ngx_conf_t *cf, ngx_err_t err,
+    const char *fmt, ...)
+{
+    fprintf(stderr, "    conf %d: %s\n", (int) level, fmt);
+}
+
+
+void *
+ngx_pnalloc(ngx_pool_t *pool, size_t size)
+{
+    return malloc(size);
+}
+
+
+ngx_pool_cleanup_t *
+ngx_pool_cleanup_add(ngx_pool_t *p, size_t size)
+{
+    return calloc(1, sizeof(ngx_pool_cleanup_t));
+}
+
+
+u_char *
+ngx_cpystrn(u_char *dst, u_char *src, size_t n)
+{
+    if (n == 0) {
+        return dst;
+    }
+
+    while (--n) {
+        *dst = *src;
+
+        if (*dst == '\0') {
+            return dst;
+        }
+
+        dst++;
+        src++;
+    }
+
+    *dst = '\0';
+
+    return dst;
+}
+
+
+/* the paths of the tests are used as given */
+
+ngx_int_t
+ngx_conf_full_name(ngx_cycle_t *cycle, ngx_str_t *name, ngx_uint_t conf_prefix)
+{
+    return NGX_OK;
+}
+
+
+/* only the formats of the tested code: %V, %P and %Z */
+
+u_char *
+ngx_sprintf(u_char *buf, const char *fmt, ...)
+{
+    va_list     args;
+    ngx_str_t  *v;
+
+    va_start(args, fmt);
+
+    while (*fmt) {
+
+        if (*fmt != '%') {
+            *buf++ = *fmt++;
+            continue;
+        }
+
+        fmt++;
+
+        switch (*fmt++) {
+
+        case 'V':
+            v = va_arg(args, ngx_str_t *);
+            buf = ngx_cpymem(buf, v->data, v->len);
+            break;
+
+        case 'P':
+            buf += sprintf((char *) buf, "%ld", (long) va_arg(args, ngx_pid_t));
+            break;
+
+        case 'Z':
+            *buf++ = '\0';
+            break;
+        }
+    }
+
+    va_end(args);
+
+    return buf;
+}
+
+
+void
+ngx_shmtx_lock(ngx_shmtx_t *mtx)
+{
+}
+
+
+void
+ngx_shmtx_unlock(ngx_shmtx_t *mtx)
+{
+}
+
+
+/* the rings of the tests are always up to date */
+
+void
+ngx_http_stat_gc(ngx_http_stat_main_conf_t *smcf, time_t ts)
+{
+}
+
+
+uint32_t
+ngx_http_stat_shared_key(ngx_http_stat_main_conf_t *smcf,
+    ngx_http_stat_storage_t *storage, ngx_uint_t split, ngx_uint_t param)
+{
+    uint32_t  crc;
+
+    ngx_crc32_init(crc);
+
+    ngx_crc32_update(&crc, (u_char *) &split, sizeof(split));
+    ngx_crc32_update(&crc, (u_char *) &param, sizeof(param));
+
+    ngx_crc32_final(crc);
+
+    return crc;
+}
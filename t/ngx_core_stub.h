@@ -0,0 +1,26 @@
+/**
+ * (c) BSD-2-Cause, link: https://opensource.org/licenses/BSD-2-Clause
+ * (c) V. Soshnikov, mailto: dedok.mad@gmail.com
+ */
+
+#ifndef NGX_CORE_STUB_H_INCLUDED
+#define NGX_CORE_STUB_H_INCLUDED 1
+
+#include <stdio.h>
+#include <stdlib.h>
+
+
+#define check(expr)                                                          \
+    do {                                                                     \
+        if (!(expr)) {                                                       \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,          \
+                    __LINE__, #expr);                                        \
+            exit(1);                                                         \
+        }                                                                    \
+    } while (0)
+
+
+void ngx_stub_init(time_t now);
+void ngx_stub_time_set(time_t now);
+
+#endif /** NGX_CORE_STUB_H_INCLUDED */
@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <zlib.h>
+
+
+#define SERVER "127.0.0.1"
+#define BUFLEN (1024 * 1024)
+#define PORT 4318
+
+
+static char   in[BUFLEN];
+static u_char body[BUFLEN];
+
+
+void
+die(char *s)
+{
+    perror(s);
+    exit(1);
+}
+
+
+static int
+varint(u_char **p, u_char *last, uint64_t *v)
+{
+    int shift;
+
+    *v = 0;
+
+    for (shift = 0; *p < last && shift < 64; shift += 7) {
+
+        *v |= (uint64_t) (**p & 0x7f) << shift;
+
+        if (!(*(*p)++ & 0x80)) {
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+
+/* checks that the bytes are a sequence of well formed fields */
+static int
+message(u_char *p, u_char *last)
+{
+    uint64_t tag, len;
+
+    while (p < last) {
+
+        if (varint(&p, last, &tag) || (tag >> 3) == 0) {
+            return 0;
+        }
+
+        switch (tag & 7) {
+        case 0:
+            if (varint(&p, last, &len)) {
+                return 0;
+            }
+            break;
+        case 1:
+            p += 8;
+            break;
+        case 2:
+            if (varint(&p, last, &len) || len > (uint64_t) (last - p)) {
+                return 0;
+            }
+            p += len;
+            break;
+        case 5:
+            p += 4;
+            break;
+        default:
+            return 0;
+        }
+    }
+
+    return p == last;
+}
+
+
+/*
+ * Schema-less dump: length delimited fields are printed as nested
+ * messages when they parse as such, as strings when printable and as
+ * packed fixed64 (both integer and double) otherwise.
+ */
+static void
+dump(u_char *p, u_char *last, int depth)
+{
+    size_t    i;
+    double    d;
+    uint64_t  tag, v, len;
+
+    while (p < last) {
+
+        varint(&p, last, &tag);
+
+        fprintf(stdout, "%*s%u: ", depth * 2, "", (unsigned) (tag >> 3));
+
+        switch (tag & 7) {
+
+        case 0:
+            varint(&p, last, &v);
+            fprintf(stdout, "%llu\n", (unsigned long long) v);
+            break;
+
+        case 1:
+            memcpy(&v, p, 8);
+            memcpy(&d, p, 8);
+            p += 8;
+            fprintf(stdout, "%llu (%g)\n", (unsigned long long) v, d);
+            break;
+
+        case 2:
+            varint(&p, last, &len);
+
+            for (i = 0; i < len && isprint(p[i]); i++) { /* void */ }
+
+            if (len && i == len) {
+                fprintf(stdout, "\"%.*s\"\n", (int) len, p);
+
+            } else if (len && message(p, p + len)) {
+                fprintf(stdout, "{\n");
+                dump(p, p + len, depth + 1);
+                fprintf(stdout, "%*s}\n", depth * 2, "");
+
+            } else {
+                fprintf(stdout, "[");
+
+                for (i = 0; i + 8 <= len; i += 8) {
+                    memcpy(&v, p + i, 8);
+                    memcpy(&d, p + i, 8);
+                    fprintf(stdout, " %llu (%g)", (unsigned long long) v, d);
+                }
+
+                fprintf(stdout, " ]\n");
+            }
+
+            p += len;
+            break;
+
+        default:
+            fprintf(stdout, "unexpected wire type %u\n", (unsigned) (tag & 7));
+            return;
+        }
+    }
+}
+
+
+static size_t
+gunzip(u_char *src, size_t len)
+{
+    static u_char  out[BUFLEN];
+    z_stream       zs;
+
+    memset(&zs, 0, sizeof(zs));
+
+    if (inflateInit2(&zs, MAX_WBITS + 16) != Z_OK) {
+        return 0;
+    }
+
+    zs.next_in = src;
+    zs.avail_in = len;
+    zs.next_out = out;
+    zs.avail_out = sizeof(out);
+
+    if (inflate(&zs, Z_FINISH) != Z_STREAM_END) {
+        fprintf(stdout, "--- inflate() failed\n");
+        inflateEnd(&zs);
+        return 0;
+    }
+
+    len = sizeof(out) - zs.avail_out;
+    memcpy(src, out, len);
+
+    inflateEnd(&zs);
+
+    return len;
+}
+
+
+/*
+ * Usage: otlp_collector [status]
+ *
+ * Accepts otlp/http connections, prints every ExportMetricsServiceRequest
+ * as a field dump and answers with the given status (200 by default), so
+ * the retry and the error logging of the module can be observed.
+ */
+int main(int argc, char **argv)
+{
+    struct sockaddr_in si_me;
+    int                s, c, on = 1, status = 200, gzip;
+    char              *h, *eoh, resp[128];
+    size_t             have, need, len;
+    ssize_t            n;
+
+    if (argc > 1) {
+        status = atoi(argv[1]);
+    }
+
+    if ((s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) == -1) {
+        die("socket");
+    }
+
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    memset((char *) &si_me, 0, sizeof(si_me));
+    si_me.sin_family = AF_INET;
+    si_me.sin_port = htons(PORT);
+
+    if (inet_aton(SERVER , &si_me.sin_addr) == 0) {
+        fprintf(stderr, "inet_aton() failed\n");
+        exit(1);
+    }
+
+    if (bind(s, (struct sockaddr *) &si_me, sizeof(si_me)) == -1) {
+        die("bind()");
+    }
+
+    if (listen(s, 16) == -1) {
+        die("listen()");
+    }
+
+    for ( ;; ) {
+
+        if ((c = accept(s, NULL, NULL)) == -1) {
+            die("accept()");
+        }
+
+        fprintf(stdout, "--- connection accepted\n");
+
+        have = 0;
+
+        for ( ;; ) {
+
+            /* headers */
+
+            in[have] = '\0';
+
+            while ((eoh = strstr(in, "\r\n\r\n")) == NULL) {
+
+                n = read(c, in + have, sizeof(in) - 1 - have);
+                if (n <= 0) {
+                    goto closed;
+                }
+
+                have += n;
+                in[have] = '\0';
+            }
+
+            eoh += 4;
+
+            h = strstr(in, "Content-Length:");
+            need = (h && h < eoh) ? strtoul(h + 15, NULL, 10) : 0;
+
+            h = strstr(in, "Content-Encoding: gzip");
+            gzip = (h && h < eoh);
+
+            fprintf(stdout, "%.*s", (int) (strchr(in, '\r') - in), in);
+            fprintf(stdout, " (%zu bytes%s)\n", need, gzip ? ", gzip" : "");
+
+            /* body */
+
+            while ((size_t) (in + have - eoh) < need) {
+
+                if (eoh + need >= in + sizeof(in)) {
+                    fprintf(stdout, "--- request is too large\n");
+                    goto closed;
+                }
+
+                n = read(c, in + have, sizeof(in) - 1 - have);
+                if (n <= 0) {
+                    goto closed;
+                }
+
+                have += n;
+            }
+
+            memcpy(body, eoh, need);
+            len = gzip ? gunzip(body, need) : need;
+
+            dump(body, body + len, 0);
+            fflush(stdout);
+
+            n = snprintf(resp, sizeof(resp),
+                    "HTTP/1.1 %d Status\r\nContent-Length: 0\r\n\r\n", status);
+
+            if (write(c, resp, n) != n) {
+                goto closed;
+            }
+
+            /* pipelined requests */
+
+            have -= eoh + need - in;
+            memmove(in, eoh + need, have);
+        }
+
+    closed:
+
+        fprintf(stdout, "--- connection closed\n");
+
+        close(c);
+    }
+
+    close(s);
+
+    return EXIT_SUCCESS;
+}
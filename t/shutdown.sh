@@ -0,0 +1,68 @@
+#!/bin/sh
+#
+# (c) BSD-2-Cause, link: https://opensource.org/licenses/BSD-2-Clause
+# (c) V. Soshnikov, mailto: dedok.mad@gmail.com
+#
+# Usage: t/shutdown.sh [nginx binary]
+#
+# Starts nginx with frequency=60s, lets a worker become the exporter and
+# asks for a graceful shutdown: it must end within exit_flush and a few
+# seconds of slack, not once the export timer fires.
+#
+
+NGINX=${1:-${NGINX:-nginx/objs/nginx}}
+LIMIT=4
+
+set -e
+
+prefix=$(mktemp -d)
+trap 'kill -TERM $(cat $prefix/logs/nginx.pid 2>/dev/null) 2>/dev/null; \
+      rm -rf $prefix' EXIT
+
+mkdir -p $prefix/conf $prefix/logs
+
+cat > $prefix/conf/nginx.conf <<CONF
+${STAT_MODULE:+load_module $STAT_MODULE;}
+
+worker_processes 2;
+pid logs/nginx.pid;
+error_log logs/error.log info;
+
+events {}
+
+http {
+    access_log off;
+
+    stat_config protocol=influx/udp server=127.0.0.1:8089 frequency=60
+        exit_flush=1s;
+
+    server {
+        listen 127.0.0.1:18081;
+
+        location / {
+            stat nginx.all params=*;
+            return 204;
+        }
+    }
+}
+CONF
+
+$NGINX -p $prefix -c conf/nginx.conf
+
+# the election runs every second
+sleep 3
+
+pid=$(cat $prefix/logs/nginx.pid)
+start=$(date +%s)
+
+kill -QUIT $pid
+
+while kill -0 $pid 2>/dev/null; do
+    if [ $(( $(date +%s) - start )) -gt $LIMIT ]; then
+        echo "FAIL: nginx still runs $LIMIT seconds after QUIT"
+        exit 1
+    fi
+    sleep 0.2
+done
+
+echo "OK: shutdown took $(( $(date +%s) - start )) seconds"
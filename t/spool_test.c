@@ -0,0 +1,291 @@
+/**
+ * (c) BSD-2-Cause, link: https://opensource.org/licenses/BSD-2-Clause
+ * (c) V. Soshnikov, mailto: dedok.mad@gmail.com
+ */
+
+#include "ngx_http_stat_module.h"
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "ngx_core_stub.h"
+
+
+#define SPOOL_SIZE   4096
+#define QUEUE_SIZE   1024
+#define PACKAGE_MAX  120
+
+
+static ngx_log_t    log_;
+static ngx_pool_t   pool;
+static ngx_cycle_t  cycle;
+static ngx_conf_t   cf;
+
+static char        *path = "spool_test.spool";
+
+
+static void
+spool_open(ngx_http_stat_spool_t *spool, size_t size)
+{
+    ngx_memzero(spool, sizeof(ngx_http_stat_spool_t));
+
+    spool->path.data = (u_char *) path;
+    spool->path.len = ngx_strlen(path);
+    spool->size = size;
+
+    check(ngx_http_stat_spool_open(&cf, spool) == NGX_OK);
+    check(spool->header->size == spool->size);
+}
+
+
+static void
+spool_close(ngx_http_stat_spool_t *spool)
+{
+    munmap((void *) spool->header,
+            sizeof(ngx_http_stat_spool_header_t) + spool->size);
+
+    if (spool->fd != NGX_INVALID_FILE) {
+        ngx_close_file(spool->fd);
+    }
+}
+
+
+/* the package of a length, so a record read back is checked by itself */
+
+static size_t
+package(u_char *buf, size_t len, ngx_uint_t seq)
+{
+    size_t  i;
+
+    for (i = 0; i < len; i++) {
+        buf[i] = (u_char) (seq + i);
+    }
+
+    return len;
+}
+
+
+/*
+ * The packages read back are the ones written, in order, whatever the
+ * wraps and the evictions, and the spool survives a reopen.
+ */
+static void
+test_order(void)
+{
+    u_char                  buf[PACKAGE_MAX], *p;
+    size_t                  len, lens[QUEUE_SIZE];
+    uint64_t                dropped;
+    ngx_uint_t              i, head, tail, seqs[QUEUE_SIZE];
+    ngx_http_stat_spool_t   spool;
+
+    unlink(path);
+    spool_open(&spool, SPOOL_SIZE);
+
+    head = 0;
+    tail = 0;
+
+    for (i = 0; i < 200000; i++) {
+
+        if (i == 100000) {
+            spool_close(&spool);
+            spool_open(&spool, SPOOL_SIZE);
+        }
+
+        if (random() % 3) {
+            len = package(buf, 1 + random() % PACKAGE_MAX, i);
+            dropped = spool.header->dropped;
+
+            check(ngx_http_stat_spool_write(&spool, buf, len) == NGX_OK);
+
+            head += spool.header->dropped - dropped;
+            lens[tail % QUEUE_SIZE] = len;
+            seqs[tail % QUEUE_SIZE] = i;
+            tail++;
+
+        } else {
+            p = ngx_http_stat_spool_peek(&spool, &len);
+
+            if (p == NULL) {
+                check(head == tail);
+                continue;
+            }
+
+            check(len == lens[head % QUEUE_SIZE]);
+            package(buf, len, seqs[head % QUEUE_SIZE]);
+            check(ngx_memcmp(p, buf, len) == 0);
+
+            ngx_http_stat_spool_pop(&spool);
+            head++;
+        }
+
+        check(tail - head == spool.header->records);
+        check(tail - head < QUEUE_SIZE);
+    }
+
+    check(spool.header->dropped > 0);
+
+    /* an empty package or one larger than the ring is not written */
+
+    check(ngx_http_stat_spool_write(&spool, buf, 0) == NGX_DECLINED);
+    check(ngx_http_stat_spool_write(&spool, buf, SPOOL_SIZE) == NGX_DECLINED);
+
+    spool_close(&spool);
+}
+
+
+/*
+ * A header or a record damaged on disk never makes the spool read or write
+ * out of the ring, whatever the values.
+ */
+static void
+test_bounds(void)
+{
+    u_char                  buf[PACKAGE_MAX], *p;
+    size_t                  len;
+    uint64_t               *field;
+    ngx_uint_t              i;
+    ngx_http_stat_spool_t   spool;
+
+    unlink(path);
+    spool_open(&spool, SPOOL_SIZE);
+
+    for (i = 0; i < 2000000; i++) {
+
+        if (random() % 50 == 0) {
+            field = &spool.header->head + random() % 3;
+            *field = (random() % 3) ? (uint64_t) (random() % (SPOOL_SIZE * 2))
+                                    : (uint64_t) random() << 33 | random();
+        }
+
+        if (random() % 50 == 0) {
+            spool.data[random() % SPOOL_SIZE] = (u_char) random();
+        }
+
+        if (random() % 2) {
+            len = package(buf, 1 + random() % PACKAGE_MAX, i);
+            (void) ngx_http_stat_spool_write(&spool, buf, len);
+
+            check(spool.header->head <= SPOOL_SIZE);
+            check(spool.header->tail <= SPOOL_SIZE);
+
+        } else {
+            p = ngx_http_stat_spool_peek(&spool, &len);
+
+            if (p) {
+                check(len > 0);
+                check(p >= spool.data);
+                check(p + len <= spool.data + SPOOL_SIZE);
+
+                ngx_http_stat_spool_pop(&spool);
+            }
+        }
+    }
+
+    /* a damaged header is reset by the next open */
+
+    spool.header->head = SPOOL_SIZE * 2;
+    spool.header->records = 7;
+    spool_close(&spool);
+
+    spool_open(&spool, SPOOL_SIZE);
+    check(spool.header->records == 0);
+    check(ngx_http_stat_spool_peek(&spool, &len) == NULL);
+
+    /* so is a file of another spool_size */
+
+    spool_close(&spool);
+    spool_open(&spool, SPOOL_SIZE / 2);
+    check(spool.header->records == 0);
+
+    spool_close(&spool);
+}
+
+
+/*
+ * A file mapped by the running workers is neither reset nor resized by the
+ * next cycle, and a lock left by a crashed worker is taken over.
+ */
+static void
+test_lock(void)
+{
+    u_char                  buf[PACKAGE_MAX];
+    size_t                  len;
+    ngx_pid_t               pid;
+    ngx_http_stat_spool_t   spool, next;
+
+    unlink(path);
+    spool_open(&spool, SPOOL_SIZE);
+
+    len = package(buf, PACKAGE_MAX, 0);
+    check(ngx_http_stat_spool_write(&spool, buf, len) == NGX_OK);
+
+    pid = fork();
+    check(pid != -1);
+
+    if (pid == 0) {
+        ngx_pid = getpid();
+        ngx_http_stat_spool_attach(&spool, &log_);
+        check(spool.fd != NGX_INVALID_FILE);
+        sleep(2);
+        _exit(0);
+    }
+
+    sleep(1);
+
+    spool_open(&next, SPOOL_SIZE / 2);
+    check(next.size == SPOOL_SIZE);
+    check(next.header->records == 1);
+    spool_close(&next);
+
+    check(waitpid(pid, NULL, 0) == pid);
+
+    /* the pid of the child is gone now */
+
+    spool.header->lock = (ngx_atomic_uint_t) pid;
+    check(ngx_http_stat_spool_lock(&spool) == NGX_OK);
+    check(spool.header->lock == (ngx_atomic_uint_t) ngx_pid);
+    ngx_http_stat_spool_unlock(&spool);
+    check(spool.header->lock == 0);
+
+    spool.header->lock = (ngx_atomic_uint_t) getppid();
+    check(ngx_http_stat_spool_lock(&spool) == NGX_BUSY);
+    spool.header->lock = 0;
+
+    spool_close(&spool);
+}
+
+
+/*
+ * Usage: spool_test [path]
+ *
+ * Checks the spool of the module on a file, spool_test.spool by default.
+ * It is built against a configured nginx tree by `make test_spool`.
+ */
+int main(int argc, char **argv)
+{
+    if (argc > 1) {
+        path = argv[1];
+    }
+
+    ngx_stub_init(time(NULL));
+    srandom(1);
+
+    log_.log_level = NGX_LOG_NOTICE;
+    cycle.pool = &pool;
+    cf.cycle = &cycle;
+    cf.pool = &pool;
+    cf.log = &log_;
+
+    test_order();
+    printf("spool order: ok\n");
+
+    test_bounds();
+    printf("spool bounds: ok\n");
+
+    test_lock();
+    printf("spool lock: ok\n");
+
+    unlink(path);
+
+    return 0;
+}